@@ -0,0 +1,410 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file aio.c */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "aio.h"
+#include "engine.h"
+#include "jobs.h"
+
+/** The maximum number of reads in flight at once through io_uring. */
+#define AIO_QUEUE_DEPTH (64)
+
+/**
+ * Orders reads by file and then by offset, so that each file is read front to
+ * back and the device sees as few seeks as possible.
+ */
+int aio_compare_reads(const void *a, const void *b)
+{
+    const aio_read_t *ra = *(aio_read_t * const *)a;
+    const aio_read_t *rb = *(aio_read_t * const *)b;
+
+    if (ra->fd != rb->fd) {
+        return ra->fd < rb->fd ? -1 : 1;
+    }
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads exactly \p size bytes at \p offset from \p fd into \p buf.
+ * @return True on success, false on error or a short read
+ */
+bool aio_pread_full(int fd, void *buf, size_t size, size_t offset)
+{
+    uint8_t *dest = buf;
+    while (size > 0) {
+        ssize_t count = pread(fd, dest, size, offset);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+
+        dest += count;
+        offset += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+#ifdef __linux__
+
+/** The userspace half of an io_uring instance. */
+typedef struct {
+    int fd;
+    unsigned entries;
+
+    void  *sq_ring;
+    size_t sq_ring_size;
+    void  *cq_ring;
+    size_t cq_ring_size;
+
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} aio_ring_t;
+
+void aio_ring_close(aio_ring_t *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED &&
+            ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+/**
+ * Returns whether \p ring can perform IORING_OP_READ. Kernels from before the
+ * opcode was added (5.1 to 5.5) also lack IORING_REGISTER_PROBE, so a failed
+ * probe means the opcode is missing too.
+ */
+bool aio_ring_supports_read(const aio_ring_t *ring)
+{
+    size_t size = sizeof (struct io_uring_probe) +
+            (IORING_OP_READ + 1) * sizeof (struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) {
+        return false;
+    }
+
+    bool supported = syscall(__NR_io_uring_register, ring->fd,
+            IORING_REGISTER_PROBE, probe, IORING_OP_READ + 1) == 0 &&
+            probe->last_op >= IORING_OP_READ &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+/**
+ * Sets up an io_uring instance with room for \p entries submissions.
+ * @return True on success, false if io_uring or its read opcode is unavailable
+ */
+bool aio_ring_open(aio_ring_t *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof *ring);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array +
+            params.sq_entries * sizeof (unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+            params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        aio_ring_close(ring);
+        return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            aio_ring_close(ring);
+            return false;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        aio_ring_close(ring);
+        return false;
+    }
+
+    if (!aio_ring_supports_read(ring)) {
+        aio_ring_close(ring);
+        return false;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    uint8_t *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+/**
+ * Queues a read of \p size bytes at \p offset in \p fd into \p buf. The caller
+ * must ensure the submission queue has room.
+ */
+void aio_ring_queue_read(aio_ring_t *ring, int fd, void *buf, size_t size,
+        size_t offset, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = size > UINT32_MAX ? UINT32_MAX : size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Reads every request in \p sorted through io_uring, calling \p done for each
+ * as it completes.
+ * @return False if io_uring could not be used, in which case nothing has been
+ * read and the caller must fall back to another method
+ */
+bool aio_read_uring(aio_read_t **sorted, size_t count, aio_done_fn_t done,
+        void *ctx)
+{
+    aio_ring_t ring;
+    if (!aio_ring_open(&ring, AIO_QUEUE_DEPTH)) {
+        return false;
+    }
+
+    /* Bytes read so far for each request, to resubmit after short reads */
+    size_t *progress = calloc(count, sizeof *progress);
+    if (progress == NULL) {
+        aio_ring_close(&ring);
+        return false;
+    }
+
+    size_t next = 0;
+    size_t in_flight = 0;
+    size_t finished = 0;
+    unsigned to_submit = 0;
+
+    /* Requests resubmitted after a short read, kept as a stack of indices */
+    size_t *retry = calloc(count, sizeof *retry);
+    size_t retry_count = 0;
+    if (retry == NULL) {
+        free(progress);
+        aio_ring_close(&ring);
+        return false;
+    }
+
+    bool started = false;
+    while (finished < count) {
+        while (in_flight < ring.entries &&
+                (retry_count > 0 || next < count)) {
+            size_t i = retry_count > 0 ? retry[--retry_count] : next++;
+            aio_read_t *read = sorted[i];
+            aio_ring_queue_read(&ring, read->fd,
+                    (uint8_t *)read->buf + progress[i],
+                    read->size - progress[i],
+                    read->offset + progress[i], i);
+            in_flight += 1;
+            to_submit += 1;
+        }
+
+        int ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!started) {
+                /* Nothing was submitted; let the caller fall back */
+                free(retry);
+                free(progress);
+                aio_ring_close(&ring);
+                return false;
+            }
+            Engine.fatal("io_uring_enter failed with %d reads in flight.\n",
+                    (int)in_flight);
+        }
+        started = true;
+        to_submit -= ret < (int)to_submit ? ret : (int)to_submit;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            size_t i = cqe->user_data;
+            aio_read_t *read = sorted[i];
+            in_flight -= 1;
+
+            if (cqe->res > 0) {
+                progress[i] += cqe->res;
+                if (progress[i] < read->size) {
+                    retry[retry_count++] = i;
+                    continue;
+                }
+                read->ok = true;
+            } else if (cqe->res < 0) {
+                /*
+                 * The ring couldn't do this read, whether for a transient
+                 * reason such as -EAGAIN or because the file doesn't support
+                 * it, so finish it with plain positioned reads instead.
+                 */
+                read->ok = aio_pread_full(read->fd,
+                        (uint8_t *)read->buf + progress[i],
+                        read->size - progress[i], read->offset + progress[i]);
+            } else {
+                /* End of file before the read was complete */
+                read->ok = progress[i] == read->size;
+            }
+
+            finished += 1;
+            if (done != NULL) {
+                done(read, ctx);
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    free(retry);
+    free(progress);
+    aio_ring_close(&ring);
+    return true;
+}
+
+#endif
+
+/** Runs one read from the sorted batch on the worker pool. */
+void aio_read_job(void *ctx, size_t index)
+{
+    aio_read_t *read = ((aio_read_t **)ctx)[index];
+    read->ok = aio_pread_full(read->fd, read->buf, read->size, read->offset);
+}
+
+/**
+ * Reads every request in \p reads, calling \p done on the calling thread as
+ * each completes, and returns once all have completed. Requests are issued in
+ * file and offset order. On Linux the reads are submitted together through
+ * io_uring; where that is unavailable they are spread across the worker pool
+ * as blocking positioned reads.
+ * @param reads The reads to be performed
+ * @param count The number of elements in \p reads
+ * @param done Called once for each read as it completes; may be NULL
+ * @param ctx Passed to every call of \p done
+ */
+void aio_read_all(aio_read_t *reads, size_t count, aio_done_fn_t done,
+        void *ctx)
+{
+    if (count == 0) {
+        return;
+    }
+
+    aio_read_t **sorted = calloc(count, sizeof *sorted);
+    if (sorted == NULL) {
+        Engine.fatal("Failed to allocate read batch.\n");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        reads[i].ok = false;
+        sorted[i] = &reads[i];
+    }
+    qsort(sorted, count, sizeof *sorted, aio_compare_reads);
+
+#ifdef __linux__
+    if (aio_read_uring(sorted, count, done, ctx)) {
+        free(sorted);
+        return;
+    }
+#endif
+
+    Jobs.run(count, aio_read_job, sorted);
+    if (done != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            done(sorted[i], ctx);
+        }
+    }
+
+    free(sorted);
+}
+
+const struct aio_namespace AsyncIO = {
+    .readFull = aio_pread_full,
+    .readAll = aio_read_all
+};
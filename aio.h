@@ -0,0 +1,52 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    /** The file to be read from. */
+    int fd;
+
+    /** The offset in bytes in \p fd to start reading at. */
+    size_t offset;
+
+    /** The number of bytes to be read. */
+    size_t size;
+
+    /** The buffer to be filled. Must hold at least \p size bytes. */
+    void *buf;
+
+    /** Set once the read completes: true if all \p size bytes were read. */
+    bool ok;
+
+    /** Opaque to AsyncIO; for the submitter's use. */
+    void *user;
+} aio_read_t;
+
+/** Called on the submitting thread as each read in a batch completes. */
+typedef void (*aio_done_fn_t)(aio_read_t *read, void *ctx);
+
+extern const struct aio_namespace {
+    bool (* const readFull)(int fd, void *buf, size_t size, size_t offset);
+    void (* const readAll)(aio_read_t *reads, size_t count, aio_done_fn_t done,
+            void *ctx);
+} AsyncIO;
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file atlas.c
+ *
+ * Packs rectangles into square pages of a fixed size. Each page keeps a
+ * skyline: the top edge of everything placed in it so far, as a list of
+ * horizontal segments from left to right. A rectangle goes wherever its top
+ * would end up lowest, over every page, and a new page is opened only when
+ * it fits nowhere. Space under an overhang of the skyline is never reused,
+ * so rectangles should be added tallest first to waste little of it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atlas.h"
+#include "engine.h"
+
+/*
+ * A segment of a skyline, at height y from x to x + width.
+ */
+typedef struct {
+    int x;
+    int y;
+    int width;
+} atlas_segment_t;
+
+typedef struct {
+    int segment_count;
+
+    /*
+     * Every segment is at least one unit wide, so a page never has more
+     * segments than its size.
+     */
+    atlas_segment_t *segments;
+} atlas_page_t;
+
+struct atlas_s {
+    int page_size;
+    int page_count;
+    int page_capacity;
+    atlas_page_t *pages;
+    size_t used_area;
+};
+
+/**
+ * Creates an empty atlas of square pages \p page_size units across.
+ * @return The new atlas, or NULL on error
+ */
+atlas_t *atlas_create(int page_size)
+{
+    if (page_size <= 0) {
+        Engine.error("Atlas pages must have a positive size.\n");
+        return NULL;
+    }
+
+    atlas_t *atlas = calloc(1, sizeof *atlas);
+    if (atlas == NULL) {
+        Engine.error("Couldn't allocate atlas.\n");
+        return NULL;
+    }
+
+    atlas->page_size = page_size;
+    return atlas;
+}
+
+void atlas_free(atlas_t *atlas)
+{
+    if (atlas == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < atlas->page_count; i++) {
+        free(atlas->pages[i].segments);
+    }
+    free(atlas->pages);
+    free(atlas);
+}
+
+/**
+ * Returns the height at which a \p width by \p height rectangle would rest if
+ * its left edge were at the start of segment \p index of \p page, or -1 if it
+ * would stick out of the page there.
+ */
+static int atlas_fit(const atlas_t *atlas, const atlas_page_t *page,
+        int index, int width, int height)
+{
+    int x = page->segments[index].x;
+    if (x + width > atlas->page_size) {
+        return -1;
+    }
+
+    int y = 0;
+    int remaining = width;
+    for (int i = index; remaining > 0; i++) {
+        if (page->segments[i].y > y) {
+            y = page->segments[i].y;
+        }
+        if (y + height > atlas->page_size) {
+            return -1;
+        }
+        remaining -= page->segments[i].width;
+    }
+
+    return y;
+}
+
+/**
+ * Raises the skyline of \p page to y + height over the rectangle placed at
+ * the start of segment \p index, trimming or removing the segments it covers
+ * and merging neighbours of the same height.
+ */
+static void atlas_place(atlas_page_t *page, int index, int y, int width,
+        int height)
+{
+    atlas_segment_t *segments = page->segments;
+    atlas_segment_t placed = {
+        .x = segments[index].x,
+        .y = y + height,
+        .width = width
+    };
+
+    /* Find the first segment that reaches past the right edge */
+    int end = placed.x + width;
+    int last = index;
+    while (last < page->segment_count &&
+            segments[last].x + segments[last].width <= end) {
+        last += 1;
+    }
+
+    if (last < page->segment_count && segments[last].x < end) {
+        segments[last].width -= end - segments[last].x;
+        segments[last].x = end;
+    }
+
+    /* Segments index to last - 1 are replaced by the one just placed */
+    memmove(&segments[index + 1], &segments[last],
+            (page->segment_count - last) * sizeof *segments);
+    page->segment_count += 1 - (last - index);
+    segments[index] = placed;
+
+    /* Merge runs of equal height so the skyline stays short */
+    int out = 0;
+    for (int i = 1; i < page->segment_count; i++) {
+        if (segments[i].y == segments[out].y) {
+            segments[out].width += segments[i].width;
+        } else {
+            segments[++out] = segments[i];
+        }
+    }
+    page->segment_count = out + 1;
+}
+
+/**
+ * Opens a new, empty page in \p atlas.
+ * @return The new page, or NULL on error
+ */
+static atlas_page_t *atlas_add_page(atlas_t *atlas)
+{
+    if (atlas->page_count == atlas->page_capacity) {
+        int capacity = atlas->page_capacity > 0 ? 2 * atlas->page_capacity : 4;
+        atlas_page_t *pages = realloc(atlas->pages,
+                capacity * sizeof *pages);
+        if (pages == NULL) {
+            return NULL;
+        }
+        atlas->pages = pages;
+        atlas->page_capacity = capacity;
+    }
+
+    atlas_page_t *page = &atlas->pages[atlas->page_count];
+    page->segments = malloc(atlas->page_size * sizeof *page->segments);
+    if (page->segments == NULL) {
+        return NULL;
+    }
+
+    page->segments[0] = (atlas_segment_t){ 0, 0, atlas->page_size };
+    page->segment_count = 1;
+    atlas->page_count += 1;
+    return page;
+}
+
+/**
+ * Finds room for a \p width by \p height rectangle in \p atlas and reserves
+ * it.
+ * @param atlas The atlas to add the rectangle to
+ * @param width The width of the rectangle
+ * @param height The height of the rectangle
+ * @param page Set to the index of the page the rectangle is on
+ * @param x Set to the left edge of the rectangle in its page
+ * @param y Set to the bottom edge of the rectangle in its page
+ * @return False if the rectangle is larger than a page or memory runs out
+ */
+bool atlas_add(atlas_t *atlas, int width, int height, int *page, int *x,
+        int *y)
+{
+    if (width <= 0 || height <= 0 || width > atlas->page_size ||
+            height > atlas->page_size) {
+        return false;
+    }
+
+    int best_page = -1, best_index = -1, best_y = 0;
+    int best_top = atlas->page_size + 1;
+    for (int p = 0; p < atlas->page_count; p++) {
+        const atlas_page_t *candidate = &atlas->pages[p];
+        for (int i = 0; i < candidate->segment_count; i++) {
+            int fit = atlas_fit(atlas, candidate, i, width, height);
+            if (fit != -1 && fit + height < best_top) {
+                best_page = p;
+                best_index = i;
+                best_y = fit;
+                best_top = fit + height;
+            }
+        }
+    }
+
+    if (best_page == -1) {
+        if (atlas_add_page(atlas) == NULL) {
+            Engine.error("Couldn't allocate atlas page.\n");
+            return false;
+        }
+        best_page = atlas->page_count - 1;
+        best_index = 0;
+        best_y = 0;
+    }
+
+    atlas_page_t *target = &atlas->pages[best_page];
+    *page = best_page;
+    *x = target->segments[best_index].x;
+    *y = best_y;
+
+    atlas_place(target, best_index, best_y, width, height);
+    atlas->used_area += (size_t)width * height;
+    return true;
+}
+
+int atlas_page_count(const atlas_t *atlas)
+{
+    return atlas->page_count;
+}
+
+/**
+ * Returns the total area of the rectangles added to \p atlas.
+ */
+size_t atlas_used_area(const atlas_t *atlas)
+{
+    return atlas->used_area;
+}
+
+const struct atlas_namespace Atlas = {
+    .create = atlas_create,
+    .free = atlas_free,
+    .add = atlas_add,
+    .pageCount = atlas_page_count,
+    .usedArea = atlas_used_area
+};
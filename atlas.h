@@ -0,0 +1,34 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct atlas_s atlas_t;
+
+extern const struct atlas_namespace {
+    atlas_t *(* const create)(int page_size);
+    void (* const free)(atlas_t *atlas);
+    bool (* const add)(atlas_t *atlas, int width, int height, int *page,
+            int *x, int *y);
+    int (* const pageCount)(const atlas_t *atlas);
+    size_t (* const usedArea)(const atlas_t *atlas);
+} Atlas;
+
+#endif
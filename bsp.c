@@ -14,443 +14,2106 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "atlas.h"
 #include "bsp.h"
+#include "bsp_private.h"
+#include "cache.h"
+#include "cvar.h"
+#include "derived.h"
 #include "engine.h"
+#include "entities.h"
+#include "file.h"
+#include "jobs.h"
+#include "pvs.h"
+#include "trace.h"
 #include "utils.h"
 #include "vecmath.h"
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define BSP_ARENA_ALIGN (16)
+
+/**
+ * Returns \p size rounded up to the arena's alignment.
+ */
+static inline size_t bsp_arena_round(size_t size)
+{
+    return (size + BSP_ARENA_ALIGN - 1) & ~(size_t)(BSP_ARENA_ALIGN - 1);
+}
+
+/**
+ * Carves \p size zeroed bytes out of \p arena. The arena is sized up front
+ * from the lump sizes, so running out of it is a bug rather than a runtime
+ * condition. Lumps are decoded in parallel, so the arena is bumped with a
+ * compare-and-swap rather than under a lock.
+ */
+void *bsp_arena_alloc(bsp_arena_t *arena, size_t size)
+{
+    size_t used = __atomic_load_n(&arena->used, __ATOMIC_RELAXED);
+    size_t start;
+    do {
+        start = bsp_arena_round(used);
+        if (start + size > arena->capacity) {
+            Engine.fatal("BSP arena overflow (%zu of %zu bytes).\n",
+                    start + size, arena->capacity);
+        }
+    } while (!__atomic_compare_exchange_n(&arena->used, &used, start + size,
+            true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return arena->base + start;
+}
+
+/**
+ * Returns the alignment that lump \p lump needs to be used in place, or 0 if
+ * it is always converted into a runtime structure instead.
+ */
+static inline size_t bsp_lump_align(int lump)
+{
+    switch (lump) {
+    case LUMP_TEXTURES:
+        return _Alignof(bspfile_texheader_t);
+    case LUMP_VERTICES:
+        return _Alignof(vec3_t);
+    case LUMP_EDGES:
+        return _Alignof(bsp_edge_t);
+    case LUMP_EDGETABLE:
+        return _Alignof(int32_t);
+    case LUMP_LIGHTMAPS:
+    case LUMP_VISLISTS:
+        return 1;
+    case LUMP_TEXINFO:
+        return _Alignof(bsp_texinfo_t);
+    case LUMP_FACES:
+        return _Alignof(bspfile_face_t);
+    case LUMP_FACETABLE:
+        return _Alignof(uint16_t);
+    case LUMP_PLANES:
+        return _Alignof(bsp_plane_t);
+    case LUMP_MODELS:
+        return _Alignof(bsp_model_t);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Returns true if lump \p lump at \p data has to be copied into the arena
+ * rather than used in place. This is the case when the lump is misaligned in
+ * the file data, or for every lump when the cvar bsp_copylumps is nonzero.
+ */
+static inline bool bsp_lump_needs_copy(int lump, const void *data)
+{
+    size_t align = bsp_lump_align(lump);
+    if (align == 0) {
+        return false;
+    }
+
+    return Cvar.getNumber("bsp_copylumps") != 0.0f ||
+            (uintptr_t)data % align != 0;
+}
+
+/**
+ * Returns the number of textures listed by the texture lump \p data of
+ * \p size bytes, or 0 if it is too short to hold its own header.
+ */
+static int bsp_lump_texture_count(const void *data, int size)
+{
+    int32_t count = 0;
+    if (size >= (int)sizeof count) {
+        memcpy(&count, data, sizeof count);
+    }
+
+    if (count < 0 || (size_t)count > (size - sizeof count) / sizeof count) {
+        return 0;
+    }
+
+    return count;
+}
+
+/**
+ * Adds to \p size the space needed for the static geometry built from the
+ * faces in \p faces, which is \p faces_size bytes long and may be misaligned.
+ * Every face is counted, not just the world's, so this is an upper bound.
+ */
+static size_t bsp_geometry_arena_size(const void *faces, int faces_size,
+        int edgetable_size)
+{
+    size_t face_count = faces_size / sizeof (bspfile_face_t);
+    size_t edgetable_count = edgetable_size / sizeof (int32_t);
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+
+    for (size_t i = 0; i < face_count; i++) {
+        bspfile_face_t face;
+        memcpy(&face, (const uint8_t *)faces + i * sizeof face, sizeof face);
+
+        size_t edges = face.edge_count < edgetable_count ? face.edge_count :
+                edgetable_count;
+        if (edges >= 3) {
+            vertex_count += edges;
+            index_count += 3 * (edges - 2);
+        }
+    }
+
+    /* There are never more batches than faces */
+    return bsp_arena_round(face_count * sizeof (bsp_surface_t)) +
+            bsp_arena_round(vertex_count * sizeof (bsp_vertex_t)) +
+            bsp_arena_round(index_count * sizeof (uint32_t)) +
+            bsp_arena_round(face_count * sizeof (bsp_batch_t));
+}
+
+/**
+ * Returns the size in bytes of the arena needed to load a BSP whose lumps are
+ * at \p elements with sizes \p sizes.
+ */
+size_t bsp_arena_size(void * const elements[LUMP_COUNT],
+        const int sizes[LUMP_COUNT])
+{
+    size_t size = bsp_arena_round(sizeof (bsp_t));
+    size += bsp_arena_round(bsp_lump_texture_count(elements[LUMP_TEXTURES],
+            sizes[LUMP_TEXTURES]) * sizeof (bsp_texture_t));
+    size += bsp_arena_round(sizes[LUMP_LEAVES] / sizeof (bspfile_leaf_t) *
+            sizeof (bsp_leaf_t));
+    size += bsp_arena_round(sizes[LUMP_NODES] / sizeof (bspfile_node_t) *
+            sizeof (bsp_node_t));
+    size += bsp_arena_round(sizes[LUMP_NODES] / sizeof (bspfile_node_t) *
+            sizeof (bsp_cnode_t));
+    size += bsp_arena_round(sizes[LUMP_MODELS] / sizeof (bspfile_model_t) *
+            sizeof (int32_t));
+    size += bsp_arena_round((sizes[LUMP_NODES] / sizeof (bspfile_node_t) +
+            sizes[LUMP_CLIPNODES] / sizeof (bspfile_clipnode_t)) *
+            sizeof (bsp_hullnode_t));
+    size += bsp_arena_round(sizes[LUMP_MODELS] / sizeof (bspfile_model_t) *
+            HULL_COUNT * sizeof (int32_t));
+    size += bsp_geometry_arena_size(elements[LUMP_FACES], sizes[LUMP_FACES],
+            sizes[LUMP_EDGETABLE]);
+
+    for (int i = 0; i < LUMP_COUNT; i++) {
+        if (bsp_lump_needs_copy(i, elements[i])) {
+            size += bsp_arena_round(sizes[i]);
+        }
+    }
+
+    return size;
+}
+
+/**
+ * Returns the lump \p lump of \p size bytes at \p data in a form that can be
+ * used in place, copying it into the arena of \p bsp if necessary.
+ */
+void *bsp_lump_view(bsp_t *bsp, int lump, void *data, int size)
+{
+    if (!bsp_lump_needs_copy(lump, data)) {
+        return data;
+    }
+
+    void *copy = bsp_arena_alloc(&bsp->arena, size);
+    memcpy(copy, data, size);
+    return copy;
+}
+
+/*
+ * Sections of a map's entry in the derived cache. Everything in them refers
+ * to the rest of the map by index, so they are used where they are mapped.
+ */
+enum {
+    BSP_DERIVED_COUNTS,
+    BSP_DERIVED_TEXTURES,
+    BSP_DERIVED_SURFACES,
+    BSP_DERIVED_VERTICES,
+    BSP_DERIVED_INDICES,
+    BSP_DERIVED_BATCHES,
+    BSP_DERIVED_LIGHTMAPS,
+    BSP_DERIVED_CNODES,
+    BSP_DERIVED_CNODE_ROOTS,
+    BSP_DERIVED_HULLNODES,
+    BSP_DERIVED_HULL_ROOTS,
+    BSP_DERIVED_SECTIONS
+};
+
+/*
+ * The values derived along with the arrays in the other sections.
+ */
 typedef struct {
-    uint16_t endpoints[2];
-} bsp_edge_t;
-
-#define BSP_LEAF_NORMAL (-1)
-#define BSP_LEAF_SOLID  (-2)
-#define BSP_LEAF_WATER  (-3)
-#define BSP_LEAF_ACID   (-4)
-#define BSP_LEAF_LAVA   (-5)
-#define BSP_LEAF_SKY    (-6)
+    int32_t max_depth;
+    int32_t hull_depth;
+    int32_t lightmap_page_count;
+    int32_t unused;
+    uint64_t luxel_count;
+} bsp_derived_counts_t;
+
+/**
+ * Returns the variant under which maps are cached, which changes with every
+ * setting that changes what is derived from them.
+ */
+static inline uint64_t bsp_derived_variant()
+{
+    uint64_t indexed = Cvar.getNumber("bsp_indexedtextures") != 0.0f;
+    return (uint64_t)BSP_LIGHTMAP_PAGE_SIZE << 1 | indexed;
+}
+
+/**
+ * Returns section \p index of the derived cache entry of \p bsp if it has one
+ * and the section is \p size bytes long, or NULL if the caller has to derive
+ * it itself.
+ */
+static const void *bsp_derived_section(const bsp_t *bsp, int index,
+        size_t size)
+{
+    if (bsp->derived == NULL) {
+        return NULL;
+    }
+
+    size_t actual;
+    const void *data = Derived.section(bsp->derived, index, &actual);
+    return actual == size ? data : NULL;
+}
+
+/**
+ * Returns section \p index of the derived cache entry of \p bsp as an array
+ * of elements of \p size bytes, setting \p count to their number, or NULL if
+ * there is no such section, in which case \p count is set to 0.
+ */
+static const void *bsp_derived_array(const bsp_t *bsp, int index, size_t size,
+        size_t *count)
+{
+    size_t actual;
+    const void *data = Derived.section(bsp->derived, index, &actual);
+    if (data == NULL || actual % size != 0) {
+        *count = 0;
+        return NULL;
+    }
+
+    *count = actual / size;
+    return data;
+}
+
+/**
+ * Saves what was derived in loading \p bsp to the derived cache, under the
+ * content hash \p hash of its file.
+ */
+void bsp_save_derived(const bsp_t *bsp, uint64_t hash)
+{
+    bsp_derived_counts_t counts = {
+        .max_depth = bsp->max_depth,
+        .hull_depth = bsp->hull_depth,
+        .lightmap_page_count = bsp->lightmap_pages.page_count,
+        .luxel_count = bsp->lightmap_pages.luxel_count
+    };
+    size_t page_area = (size_t)bsp->lightmap_pages.page_size *
+            bsp->lightmap_pages.page_size;
+
+    const derived_section_t sections[BSP_DERIVED_SECTIONS] = {
+        [BSP_DERIVED_COUNTS] = { &counts, sizeof counts },
+        [BSP_DERIVED_TEXTURES] = { bsp->texture_pixels,
+                bsp->texture_pixel_size },
+        [BSP_DERIVED_SURFACES] = { bsp->surfaces,
+                bsp->surface_count * sizeof *bsp->surfaces },
+        [BSP_DERIVED_VERTICES] = { bsp->geometry.vertices,
+                bsp->geometry.vertex_count * sizeof (bsp_vertex_t) },
+        [BSP_DERIVED_INDICES] = { bsp->geometry.indices,
+                bsp->geometry.index_count * sizeof (uint32_t) },
+        [BSP_DERIVED_BATCHES] = { bsp->geometry.batches,
+                bsp->geometry.batch_count * sizeof (bsp_batch_t) },
+        [BSP_DERIVED_LIGHTMAPS] = { bsp->lightmap_pages.pages,
+                bsp->lightmap_pages.page_count * page_area },
+        [BSP_DERIVED_CNODES] = { bsp->cnodes,
+                bsp->node_count * sizeof *bsp->cnodes },
+        [BSP_DERIVED_CNODE_ROOTS] = { bsp->cnode_roots,
+                bsp->model_count * sizeof *bsp->cnode_roots },
+        [BSP_DERIVED_HULLNODES] = { bsp->hullnodes,
+                (bsp->node_count + bsp->clipnode_count) *
+                sizeof *bsp->hullnodes },
+        [BSP_DERIVED_HULL_ROOTS] = { bsp->hull_roots,
+                bsp->model_count * sizeof *bsp->hull_roots }
+    };
+
+    Derived.save("bsp", hash, bsp_derived_variant(), sections,
+            BSP_DERIVED_SECTIONS);
+}
+
+/**
+ * Descends the compact tree from the node at index \p root to the leaf that
+ * contains \p point.
+ * @return The index of the leaf containing \p point
+ */
+static inline int bsp_descend(const bsp_t *bsp, int32_t root,
+        const float *point)
+{
+    int32_t index = root;
+    while (index >= 0) {
+        const bsp_cnode_t *node = &bsp->cnodes[index];
+
+        float dist;
+        if (node->type < BSP_PLANE_ANYX) {
+            dist = point[node->type] - node->dist;
+        } else {
+            dist = vec3_dot(point, node->normal) - node->dist;
+        }
+
+        /*
+         * A branch rather than indexing children with the comparison, so the
+         * CPU can start fetching the predicted child before the plane test
+         * resolves; queries from moving entities are highly coherent.
+         */
+        if (dist >= 0.0f) {
+            index = node->children[0];
+        } else {
+            index = node->children[1];
+        }
+    }
+
+    return ~index;
+}
+
+/**
+ * Returns the index of the world leaf that contains \p point.
+ * @param bsp The BSP structure to search
+ * @param point The point to be matched with a leaf
+ * @return The index of the leaf containing \p point, or 0 (the solid leaf
+ * outside the world) if the BSP has no nodes
+ */
+int bsp_find_leaf(const bsp_t *bsp, const vec3_t point)
+{
+    if (bsp->node_count == 0 || bsp->model_count == 0) {
+        return 0;
+    }
+
+    return bsp_descend(bsp, bsp->cnode_roots[0], point);
+}
+
+/**
+ * Returns the contents of the world at \p point.
+ * @param bsp The BSP structure to search
+ * @param point The point to be tested
+ * @return One of the BSP_LEAF_* values
+ */
+int bsp_point_contents(const bsp_t *bsp, const vec3_t point)
+{
+    if (bsp->leaf_count == 0) {
+        return BSP_LEAF_SOLID;
+    }
+
+    return bsp->leaves[bsp_find_leaf(bsp, point)].type;
+}
+
+/**
+ * Returns the potentially visible sets of \p bsp's leaves, which are freed
+ * along with it.
+ */
+pvs_t *bsp_pvs(const bsp_t *bsp)
+{
+    return bsp->pvs;
+}
+
+/**
+ * Returns the static geometry of the world of \p bsp, which is freed along
+ * with it.
+ */
+const bsp_geometry_t *bsp_geometry(const bsp_t *bsp)
+{
+    return &bsp->geometry;
+}
+
+/**
+ * Returns the number of textures in \p bsp, including missing ones.
+ */
+int bsp_texture_count(const bsp_t *bsp)
+{
+    return bsp->texture_count;
+}
+
+/**
+ * Returns texture \p index of \p bsp, or NULL if there is no such texture.
+ * The texture is freed along with the BSP.
+ */
+const bsp_texture_t *bsp_texture(const bsp_t *bsp, int index)
+{
+    if (index < 0 || index >= bsp->texture_count) {
+        return NULL;
+    }
+
+    return &bsp->textures[index];
+}
+
+/**
+ * Returns the entities of \p bsp. Their keys and values point into the map
+ * file's data and stay valid until \p bsp is freed.
+ */
+const entities_t *bsp_entities(const bsp_t *bsp)
+{
+    return bsp->entities;
+}
+
+/**
+ * Returns the lightmap pages of the world of \p bsp, which are freed along
+ * with it.
+ */
+const bsp_lightmap_pages_t *bsp_lightmap_pages(const bsp_t *bsp)
+{
+    return &bsp->lightmap_pages;
+}
+
+/**
+ * Marks the world leaves potentially visible from \p camera, and every node
+ * above them, by stamping them with the current frame count. Afterwards a
+ * leaf or node is visible if its last_visited equals bsp->vis_frame. Nothing
+ * is done if the camera is still in the leaf it was in for the last pass, as
+ * the marks from that pass still hold.
+ *
+ * This changes \p bsp, so it must not run concurrently with anything else
+ * that reads the marks.
+ *
+ * @param bsp The BSP whose leaves and nodes are to be marked
+ * @param camera The position the world is seen from
+ */
+void bsp_mark_visible(bsp_t *bsp, const vec3_t camera)
+{
+    if (bsp->leaf_count == 0) {
+        return;
+    }
+
+    int camera_leaf = bsp_find_leaf(bsp, camera);
+    if (camera_leaf == bsp->vis_leaf) {
+        return;
+    }
+
+    /*
+     * A second pass in the same frame still needs a stamp of its own, or the
+     * marks of the first would survive it. Stamps start at 1, since 0 is what
+     * every leaf and node holds before the first pass.
+     */
+    uint32_t frame = Engine.getFrameCount();
+    if (frame <= bsp->vis_frame) {
+        frame = bsp->vis_frame + 1;
+    }
+    bsp->vis_frame = frame;
+    bsp->vis_leaf = camera_leaf;
+
+    PVS.row(bsp->pvs, camera_leaf, bsp->vis_row);
+    size_t words = PVS.rowWords(bsp->pvs);
+    for (size_t w = 0; w < words; w++) {
+        uint64_t bits = bsp->vis_row[w];
+        while (bits != 0) {
+            int leaf = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            bsp_leaf_t *visible = &bsp->leaves[leaf];
+            visible->last_visited = frame;
+
+            /* Stop at the first ancestor another leaf has already marked */
+            bsp_node_t *node = visible->parent;
+            while (node != NULL && node->last_visited != frame) {
+                node->last_visited = frame;
+                node = node->parent;
+            }
+        }
+    }
+}
+
+/**
+ * Returns true if world leaf \p leaf was marked potentially visible by the
+ * last call to BSP.markVisible().
+ */
+bool bsp_leaf_visible(const bsp_t *bsp, int leaf)
+{
+    return bsp->vis_leaf != -1 && leaf >= 0 && leaf < bsp->leaf_count &&
+            bsp->leaves[leaf].last_visited == bsp->vis_frame;
+}
+
+/**
+ * Returns true if node \p node has a leaf below it that was marked
+ * potentially visible by the last call to BSP.markVisible().
+ */
+bool bsp_node_visible(const bsp_t *bsp, int node)
+{
+    return bsp->vis_leaf != -1 && node >= 0 && node < bsp->node_count &&
+            bsp->nodes[node].last_visited == bsp->vis_frame;
+}
+
+#ifdef __AVX2__
+#define BSP_BATCH_WIDTH (8)
+
+/**
+ * Moves the eight points whose coordinates start at \p x, \p y and \p z one
+ * level down the compact tree, from the nodes in \p index to their children.
+ * Points already at a leaf are left alone.
+ * @return False if every point was already at a leaf
+ */
+static inline bool bsp_step_batch(const bsp_t *bsp, const float *x,
+        const float *y, const float *z, int32_t *index)
+{
+    const float *base = (const float *)bsp->cnodes;
+    const int *ibase = (const int *)bsp->cnodes;
+    const __m256i leaf_mask = _mm256_set1_epi32(-1);
+
+    __m256i current = _mm256_loadu_si256((const __m256i *)index);
+    __m256i active = _mm256_cmpgt_epi32(current, leaf_mask);
+    if (_mm256_testz_si256(active, active)) {
+        return false;
+    }
+
+    /* Points already at a leaf read node 0 and discard the result */
+    __m256i field = _mm256_slli_epi32(_mm256_and_si256(current, active), 3);
+    __m256 nx = _mm256_i32gather_ps(base + 0, field, 4);
+    __m256 ny = _mm256_i32gather_ps(base + 1, field, 4);
+    __m256 nz = _mm256_i32gather_ps(base + 2, field, 4);
+    __m256 nd = _mm256_i32gather_ps(base + 3, field, 4);
+
+    __m256 dist = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(_mm256_loadu_ps(x), nx),
+            _mm256_mul_ps(_mm256_loadu_ps(y), ny)),
+            _mm256_mul_ps(_mm256_loadu_ps(z), nz)), nd);
+
+    /* All ones where the point is behind the plane, selecting children[1] */
+    __m256i back = _mm256_castps_si256(
+            _mm256_cmp_ps(dist, _mm256_setzero_ps(), _CMP_LT_OQ));
+    __m256i child_field = _mm256_add_epi32(field, _mm256_set1_epi32(
+            offsetof(bsp_cnode_t, children) / sizeof (int32_t)));
+    __m256i child = _mm256_i32gather_epi32(ibase,
+            _mm256_sub_epi32(child_field, back), 4);
+
+    _mm256_storeu_si256((__m256i *)index,
+            _mm256_blendv_epi8(current, child, active));
+    return true;
+}
+#else
+#define BSP_BATCH_WIDTH (1)
+
+/**
+ * Moves the point at \p x, \p y and \p z one level down the compact tree,
+ * from the node in \p index to its child, unless it is already at a leaf.
+ * Unlike bsp_descend, the child is selected without a branch: consecutive
+ * steps here belong to unrelated points, so there is nothing to predict.
+ * @return False if the point was already at a leaf
+ */
+static inline bool bsp_step_batch(const bsp_t *bsp, const float *x,
+        const float *y, const float *z, int32_t *index)
+{
+    if (*index < 0) {
+        return false;
+    }
+
+    const bsp_cnode_t *node = &bsp->cnodes[*index];
+    float dist = *x * node->normal[0] + *y * node->normal[1] +
+            *z * node->normal[2] - node->dist;
+    *index = node->children[dist < 0.0f];
+    return true;
+}
+#endif
+
+/**
+ * Finds the world leaves containing \p count points given as separate arrays
+ * of coordinates.
+ *
+ * Rather than descending one point at a time, every point is moved one level
+ * down the tree per pass until all of them reach a leaf. The steps for
+ * different points do not depend on each other, so their node fetches
+ * overlap instead of each waiting on the last. When AVX2 is enabled at
+ * compile time, each step handles eight points with gathers.
+ *
+ * @param bsp The BSP structure to search
+ * @param x The X coordinates of the points
+ * @param y The Y coordinates of the points
+ * @param z The Z coordinates of the points
+ * @param count The number of points
+ * @param leaves Receives the index of the leaf containing each point
+ * @param contents Receives the BSP_LEAF_* contents at each point, if not NULL
+ */
+void bsp_find_leaves(const bsp_t *bsp, const float *x, const float *y,
+        const float *z, size_t count, int *leaves, int *contents)
+{
+    if (bsp->node_count == 0 || bsp->model_count == 0) {
+        for (size_t i = 0; i < count; i++) {
+            leaves[i] = 0;
+        }
+    } else {
+        /* The output doubles as the current node of each point */
+        int32_t root = bsp->cnode_roots[0];
+        for (size_t i = 0; i < count; i++) {
+            leaves[i] = root;
+        }
+
+        size_t whole = count - count % BSP_BATCH_WIDTH;
+        bool stepped = true;
+        while (stepped) {
+            stepped = false;
+            for (size_t i = 0; i < whole; i += BSP_BATCH_WIDTH) {
+                stepped |= bsp_step_batch(bsp, x + i, y + i, z + i,
+                        leaves + i);
+            }
+        }
+
+        for (size_t i = whole; i < count; i++) {
+            const float point[3] = { x[i], y[i], z[i] };
+            leaves[i] = ~bsp_descend(bsp, root, point);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            leaves[i] = ~leaves[i];
+        }
+    }
+
+    if (contents != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            contents[i] = bsp->leaf_count > 0 ? bsp->leaves[leaves[i]].type :
+                    BSP_LEAF_SOLID;
+        }
+    }
+}
+
+/*
+ * Bit i of a clip mask is set while the box being tested may still cross
+ * frustum plane i.
+ */
 typedef struct {
-    int id;
+    const bsp_node_t *node;
+    unsigned clip;
+} bsp_cull_entry_t;
+
+/**
+ * Tests the box from \p mins to \p maxs against the planes of \p frustum set
+ * in \p clip. For each plane, the corner furthest along the normal is picked
+ * by \p signbits: if even that corner is behind the plane, so is the box. If
+ * the nearest corner is in front, the box is inside that plane and it is
+ * dropped from the mask.
+ * @return The planes the box still crosses, or -1 if it is outside
+ */
+static inline int bsp_cull_box(const bsp_frustum_t *frustum,
+        const uint8_t *signbits, unsigned clip, const vec3_t mins,
+        const vec3_t maxs)
+{
+    for (int i = 0; i < frustum->plane_count; i++) {
+        if (!(clip & (1u << i))) {
+            continue;
+        }
+
+        const float *n = frustum->planes[i].normal;
+        uint8_t bits = signbits[i];
+        float far = n[0] * (bits & 1 ? mins[0] : maxs[0]) +
+                n[1] * (bits & 2 ? mins[1] : maxs[1]) +
+                n[2] * (bits & 4 ? mins[2] : maxs[2]);
+        if (far < frustum->planes[i].dist) {
+            return -1;
+        }
+
+        float near = n[0] * (bits & 1 ? maxs[0] : mins[0]) +
+                n[1] * (bits & 2 ? maxs[1] : mins[1]) +
+                n[2] * (bits & 4 ? maxs[2] : mins[2]);
+        if (near >= frustum->planes[i].dist) {
+            clip &= ~(1u << i);
+        }
+    }
+
+    return clip;
+}
+
+/**
+ * Walks the tree of model \p model front to back from the frustum's origin,
+ * calling \p fn for every non-solid leaf whose bounds touch \p frustum. Whole
+ * subtrees are skipped as soon as their bounds are outside, and once a node
+ * is entirely inside a plane its descendants are not tested against it
+ * again. For the world, leaves and nodes not marked by the last call to
+ * BSP.markVisible() are skipped as well, if it has been called.
+ * @param bsp The BSP containing the model
+ * @param model The index of the model, 0 being the world
+ * @param frustum The view frustum in the model's space
+ * @param fn The function to call for each leaf
+ * @param ctx Passed through to \p fn
+ * @return The number of leaves passed to \p fn
+ */
+size_t bsp_cull(const bsp_t *bsp, int model, const bsp_frustum_t *frustum,
+        bsp_leaf_fn_t fn, void *ctx)
+{
+    if (model < 0 || model >= bsp->model_count || bsp->node_count == 0 ||
+            frustum->plane_count > BSP_MAX_FRUSTUM_PLANES) {
+        return 0;
+    }
+
+    /* Sign bit i of each normal selects the corner to test, as in Quake */
+    uint8_t signbits[BSP_MAX_FRUSTUM_PLANES];
+    for (int i = 0; i < frustum->plane_count; i++) {
+        const float *n = frustum->planes[i].normal;
+        signbits[i] = (n[0] < 0.0f) | (n[1] < 0.0f) << 1 | (n[2] < 0.0f) << 2;
+    }
+
+    bool use_vis = model == 0 && bsp->vis_leaf != -1;
+    size_t leaf_count = 0;
+
+    /* Only far children wait on the stack, one per level at most */
+    bsp_cull_entry_t stack[bsp->max_depth + 1];
+    size_t depth = 0;
+    stack[depth++] = (bsp_cull_entry_t){
+        .node = &bsp->nodes[bsp->models[model].bsp_index],
+        .clip = (1u << frustum->plane_count) - 1
+    };
+
+    while (depth > 0) {
+        bsp_cull_entry_t entry = stack[--depth];
+        const bsp_node_t *node = entry.node;
+        unsigned clip = entry.clip;
+
+        for (;;) {
+            if (node->type == BSP_LEAF_SOLID ||
+                    (use_vis && node->last_visited != bsp->vis_frame)) {
+                break;
+            }
+
+            if (clip != 0) {
+                int result = bsp_cull_box(frustum, signbits, clip,
+                        node->mins, node->maxs);
+                if (result == -1) {
+                    break;
+                }
+                clip = result;
+            }
+
+            if (node->type != 0) {
+                fn(((const bsp_leaf_t *)node)->id, ctx);
+                leaf_count += 1;
+                break;
+            }
+
+            const bsp_plane_t *plane = node->plane;
+            float side = vec3_dot(frustum->origin, plane->normal) -
+                    plane->offset;
+            const bsp_node_t *near = side >= 0.0f ? node->front : node->back;
+            const bsp_node_t *far = side >= 0.0f ? node->back : node->front;
+
+            stack[depth++] = (bsp_cull_entry_t){ .node = far, .clip = clip };
+            node = near;
+        }
+    }
+
+    return leaf_count;
+}
+
+/**
+ * Returns a pointer to the leaf that contains \p point.
+ * @param bsp The BSP structure to search
+ * @param point The point to be matched with a leaf
+ * @return The leaf containing \p point
+ */
+bsp_leaf_t *bsp_find_leaf_containing(bsp_t *bsp, vec3_t point)
+{
+    if (bsp == NULL || bsp->leaf_count == 0) {
+        return NULL;
+    }
+
+    return &bsp->leaves[bsp_find_leaf(bsp, point)];
+}
+
+/**
+ * Loads \p size bytes' worth of vertex data from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the vertices
+ * @param data An array of vertices to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_vertices(bsp_t *bsp, const vec3_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Vertex data has bad size.\n", stderr);
+        return;
+    }
+
+    bsp->vertex_count = size / sizeof *data;
+    bsp->vertices = data;
+}
 
-    /*
-     * This indicates the behavior of space inside this leaf. See the BSP_LEAF_*
-     * definitions above.
-     */
-    int type;
+/**
+ * Loads \p size bytes' worth of edges from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the edges
+ * @param data An array of edges to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_edges(bsp_t *bsp, const bspfile_edge_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Edge data has bad size.\n", stderr);
+        return;
+    }
 
-    /*
-     * The frame when this leaf was traversed last. If this equals the current
-     * frame count, this leaf needs to be examined.
-     */
-    int last_visited;
+    bsp->edge_count = size / sizeof *data;
+    bsp->edges = data;
+}
 
-    /*
-     * A pointer to this leaf's compressed visibility list.
-     */
-    uint8_t *vislist;
-} bsp_leaf_t;
+/**
+ * Loads \p size bytes' worth of edge indices from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the edge indices
+ * @param data An array of edge indices to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_edgetable(bsp_t *bsp, const int32_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Edge list data has bad size.\n", stderr);
+        return;
+    }
+
+    bsp->edgetable_count = size / sizeof *data;
+    bsp->edgetable = data;
+}
 
 typedef struct {
-    vec3_t   normal;
-    float    offset;
-    uint32_t type;
-} bsp_plane_t;
+    const bsp_t *bsp;
+    const uint8_t *data;
+    const int32_t *offsets;
+} bsp_texture_decode_t;
 
-/*
- * Internal representation of a node in a BSP tree
+/**
+ * Converts the mip levels of texture \p index through the palette into the
+ * space set aside for them. Run on the worker pool, one texture per job.
+ */
+void bsp_decode_texture(void *ctx, size_t index)
+{
+    const bsp_texture_decode_t *decode = ctx;
+    const bsp_texture_t *texture = &decode->bsp->textures[index];
+    if (texture->width == 0) {
+        return;
+    }
+
+    const bspfile_texture_t *texdata = (const bspfile_texture_t *)
+            (decode->data + decode->offsets[index]);
+    const uint32_t offsets[BSP_MIP_LEVELS] = {
+        texdata->offset_full, texdata->offset_half, texdata->offset_quarter,
+        texdata->offset_eighth
+    };
+
+    for (int level = 0; level < BSP_MIP_LEVELS; level++) {
+        size_t count = (texture->width >> level) * (texture->height >> level);
+        Utils.indexedToRGBABuffer((const uint8_t *)texdata + offsets[level],
+                count, (uint8_t *)texture->mips[level]);
+    }
+}
+
+/**
+ * Loads \p size bytes' worth of texture data from \p data into \p bsp.
+ *
+ * Every texture's header and mip levels are checked against the lump first.
+ * Unless the cvar bsp_indexedtextures is set, the mip levels are then
+ * converted to RGBA in one block, spread over the worker pool a texture at a
+ * time, unless the map's entry in the derived cache already holds them;
+ * otherwise they are used in place.
+ *
+ * @param bsp A pointer to the BSP struct in which to store the texture data
+ * @param data A pointer to a texture header listing the textures
+ * @param size The total size of all texture data
+ */
+void bsp_load_textures(bsp_t *bsp, const bspfile_texheader_t *data, int size)
+{
+    int count = bsp_lump_texture_count(data, size);
+    bsp_texture_t *textures = bsp_arena_alloc(&bsp->arena,
+            count * sizeof *textures);
+    bool indexed = Cvar.getNumber("bsp_indexedtextures") != 0.0f;
+
+    size_t pixel_size = 0;
+    for (int i = 0; i < count; i++) {
+        /*
+         * Textures that the map compiler couldn't find in its WAD files are
+         * listed with an offset of -1, as some of the original maps (e.g.
+         * e1m2) have. Faces using them get a placeholder.
+         */
+        int32_t offset = data->offsets[i];
+        if (offset == -1) {
+            continue;
+        }
+
+        if (offset < 0 || (size_t)offset + sizeof (bspfile_texture_t) >
+                (size_t)size) {
+            Engine.fatal("Texture %d is out of bounds.\n", i);
+        }
+
+        const bspfile_texture_t *texdata = (const bspfile_texture_t *)
+                ((const uint8_t *)data + offset);
+        uint32_t width = texdata->width;
+        uint32_t height = texdata->height;
+        if (width == 0 || height == 0 || width % 16 != 0 ||
+                height % 16 != 0 || width > (uint32_t)size ||
+                height > (uint32_t)size) {
+            Engine.fatal("Texture %d has illegal dimensions.\n", i);
+        }
+
+        const uint32_t offsets[BSP_MIP_LEVELS] = {
+            texdata->offset_full, texdata->offset_half,
+            texdata->offset_quarter, texdata->offset_eighth
+        };
+        for (int level = 0; level < BSP_MIP_LEVELS; level++) {
+            size_t mip_size = (size_t)(width >> level) * (height >> level);
+            if (offsets[level] > (size_t)size - offset ||
+                    mip_size > (size_t)size - offset - offsets[level]) {
+                Engine.fatal("Texture %d has out of bounds mip levels.\n", i);
+            }
+
+            if (indexed) {
+                textures[i].mips[level] = (const uint8_t *)texdata +
+                        offsets[level];
+            }
+        }
+
+        /* The name need not be terminated in the file */
+        memcpy(textures[i].name, texdata->name, sizeof textures[i].name - 1);
+        textures[i].width = width;
+        textures[i].height = height;
+        textures[i].bytes_per_pixel = indexed ? 1 : 4;
+
+        /*
+         * Ratio of mipmap pixels to texture pixels:
+         * (8x8 + 4x4 + 2x2 + 1x1) / (8x8) = 85/64
+         */
+        pixel_size += (size_t)width * height * 85 / 64 * 4;
+    }
+
+    bsp->texture_count = count;
+    bsp->textures = textures;
+    if (indexed || pixel_size == 0) {
+        return;
+    }
+
+    const uint8_t *cached = bsp_derived_section(bsp, BSP_DERIVED_TEXTURES,
+            pixel_size);
+    uint8_t *pixels = NULL;
+    if (cached == NULL) {
+        pixels = malloc(pixel_size);
+        if (pixels == NULL) {
+            Engine.fatal("Couldn't allocate %zu bytes of textures.\n",
+                    pixel_size);
+        }
+    }
+
+    const uint8_t *next = cached != NULL ? cached : pixels;
+    for (int i = 0; i < count; i++) {
+        for (int level = 0; level < BSP_MIP_LEVELS && textures[i].width > 0;
+                level++) {
+            textures[i].mips[level] = next;
+            next += 4 * (size_t)(textures[i].width >> level) *
+                    (textures[i].height >> level);
+        }
+    }
+
+    if (cached != NULL) {
+        return;
+    }
+
+    bsp->texture_pixels = pixels;
+    bsp->texture_pixel_size = pixel_size;
+
+    bsp_texture_decode_t decode = {
+        .bsp = bsp,
+        .data = (const uint8_t *)data,
+        .offsets = data->offsets
+    };
+    Jobs.run(count, bsp_decode_texture, &decode);
+}
+
+/**
+ * Loads \p size bytes of lightmap data from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the lightmap data
+ * @param data An array of bytes containing lightmap data
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_lightmaps(bsp_t *bsp, const uint8_t *data, int size)
+{
+    bsp->lightmap_size = size;
+    bsp->lightmaps = data;
+}
+
+/**
+ * Loads \p size bytes' worth of texture mappings from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the mappings
+ * @param data An array of texture mappings to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_texinfo(bsp_t *bsp, const bsp_texinfo_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Texture mapping data has bad size.\n", stderr);
+        return;
+    }
+
+    bsp->texinfo_count = size / sizeof *data;
+    bsp->texinfo = data;
+}
+
+/**
+ * Loads \p size bytes' worth of faces from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the faces
+ * @param data An array of faces to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_faces(bsp_t *bsp, const bspfile_face_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Face data has bad size.\n", stderr);
+        return;
+    }
+
+    bsp->face_count = size / sizeof *data;
+    bsp->faces = data;
+}
+
+/**
+ * Loads \p size bytes' worth of leaf face indices from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the face indices
+ * @param data An array of face indices to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_facetable(bsp_t *bsp, const uint16_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Face list data has bad size.\n", stderr);
+        return;
+    }
+
+    bsp->facetable_count = size / sizeof *data;
+    bsp->facetable = data;
+}
+
+/**
+ * Loads \p size bytes of visibility data from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the visibility data
+ * @param data An array of bytes containing visibility data
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_vislists(bsp_t *bsp, const uint8_t *data, int size)
+{
+    bsp->vislist_size = size;
+    bsp->vislists = data;
+}
+
+/**
+ * Converts the integer bounding box \p bounds to floating point.
+ */
+static inline void bsp_load_bounds(vec3_t mins, vec3_t maxs,
+        const bspfile_shortbounds_t *bounds)
+{
+    for (int i = 0; i < 3; i++) {
+        mins[i] = bounds->min[i];
+        maxs[i] = bounds->max[i];
+    }
+}
+
+/**
+ * Loads \p size bytes' worth of leaves from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the leaf data
+ * @param data An array of leaves to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_leaves(bsp_t *bsp, const bspfile_leaf_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Leaf data has bad size.\n", stderr);
+        return;
+    }
+
+    int count = size / sizeof *data;
+    bsp_leaf_t *leaves = bsp_arena_alloc(&bsp->arena, count * sizeof *leaves);
+
+    for (int i = 0; i < count; i++) {
+        leaves[i].id = i;
+        leaves[i].type = data[i].type;
+        bsp_load_bounds(leaves[i].mins, leaves[i].maxs, &data[i].bounds);
+
+        int vislist = data[i].visibility_list;
+        if (vislist >= 0 && vislist < bsp->vislist_size) {
+            leaves[i].vislist = bsp->vislists + vislist;
+        }
+    }
+
+    bsp->leaf_count = count;
+    bsp->leaves = leaves;
+}
+
+void bsp_load_planes(bsp_t *bsp, const bspfile_plane_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        fputs("Plane data has bad size.\n", stderr);
+        return;
+    }
+
+    bsp->plane_count = size / sizeof *data;
+    bsp->planes = data;
+}
+
+/**
+ * Builds the compact tree of \p bsp from the file nodes \p data, laying out
+ * each model's tree depth-first from its root, front children first. Nodes
+ * that no model reaches are left out.
  */
-typedef struct bsp_node_s {
-    int id;
+void bsp_build_cnodes(bsp_t *bsp, const bspfile_node_t *data)
+{
+    int count = bsp->node_count;
+    const bsp_derived_counts_t *counts = bsp_derived_section(bsp,
+            BSP_DERIVED_COUNTS, sizeof *counts);
+    const bsp_cnode_t *cnodes = bsp_derived_section(bsp, BSP_DERIVED_CNODES,
+            count * sizeof *cnodes);
+    const int32_t *roots = bsp_derived_section(bsp, BSP_DERIVED_CNODE_ROOTS,
+            bsp->model_count * sizeof *roots);
+    if (counts != NULL && cnodes != NULL && roots != NULL) {
+        bsp->cnodes = (bsp_cnode_t *)cnodes;
+        bsp->cnode_roots = (int32_t *)roots;
+        bsp->max_depth = counts->max_depth;
+        return;
+    }
+
+    bsp->cnodes = bsp_arena_alloc(&bsp->arena, count * sizeof *bsp->cnodes);
+    bsp->cnode_roots = bsp_arena_alloc(&bsp->arena,
+            bsp->model_count * sizeof *bsp->cnode_roots);
+
+    if (count == 0) {
+        return;
+    }
 
     /*
-     * This field is the same as the bspfile_node_t's plane_index field, kept
-     * here solely to determine if this is a node or a leaf.
+     * Each child reference is pushed at most once, so the stack never holds
+     * more than 2 * count entries, even for a malformed tree.
      */
-    int type;
+    int32_t *remap = malloc(count * sizeof *remap);
+    int32_t *stack = malloc(2 * count * sizeof *stack);
+    if (remap == NULL || stack == NULL) {
+        Engine.fatal("Couldn't allocate %d nodes.\n", count);
+    }
+    for (int i = 0; i < count; i++) {
+        remap[i] = -1;
+    }
+
+    int32_t next = 0;
+    for (int m = 0; m < bsp->model_count; m++) {
+        int32_t root = bsp->models[m].bsp_index;
+        if (root < 0 || root >= count) {
+            Engine.fatal("Model %d has an out of range root node.\n", m);
+        }
+
+        if (remap[root] != -1) {
+            bsp->cnode_roots[m] = remap[root];
+            continue;
+        }
+
+        size_t depth = 0;
+        stack[depth++] = root;
+        while (depth > 0) {
+            int32_t i = stack[--depth];
+            if (remap[i] != -1) {
+                Engine.fatal("BSP tree is not acyclic.\n");
+            }
+
+            const bspfile_plane_t *plane = &bsp->planes[data[i].plane_index];
+            bsp_cnode_t *cnode = &bsp->cnodes[next];
+            vec3_copy(cnode->normal, (float *)plane->normal);
+            cnode->dist = plane->offset;
+            cnode->type = plane->type >= 0 ? plane->type : BSP_PLANE_ANYX;
+            cnode->node = i;
+            remap[i] = next++;
+
+            /* The back child goes on the stack first to be laid out last */
+            if (data[i].back >= 0) {
+                stack[depth++] = data[i].back;
+            }
+            if (data[i].front >= 0) {
+                stack[depth++] = data[i].front;
+            }
+        }
+
+        bsp->cnode_roots[m] = remap[root];
+    }
 
     /*
-     * The frame when this node was traversed last. If this equals the current
-     * frame count, this node's children need to be examined.
+     * Parents come before their children in depth-first order, so one pass
+     * finds the depth of every node, reusing the stack to hold them.
      */
-    int last_visited;
+    int32_t *depths = stack;
+    for (int m = 0; m < bsp->model_count; m++) {
+        depths[bsp->cnode_roots[m]] = 1;
+    }
+
+    bsp->max_depth = 0;
+    for (int32_t i = 0; i < next; i++) {
+        const bspfile_node_t *node = &data[bsp->cnodes[i].node];
+        bsp->cnodes[i].children[0] = node->front < 0 ? node->front :
+                remap[node->front];
+        bsp->cnodes[i].children[1] = node->back < 0 ? node->back :
+                remap[node->back];
+
+        for (int c = 0; c < 2; c++) {
+            if (bsp->cnodes[i].children[c] >= 0) {
+                depths[bsp->cnodes[i].children[c]] = depths[i] + 1;
+            }
+        }
+        if (depths[i] > bsp->max_depth) {
+            bsp->max_depth = depths[i];
+        }
+    }
+
+    free(stack);
+    free(remap);
+}
 
+/**
+ * Loads \p size bytes' worth of nodes from \p data into \p bsp.
+ * @param bsp A pointer to the BSP struct in which to store the node data
+ * @param data An array of nodes to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_nodes(bsp_t *bsp, const bspfile_node_t *data, int size)
+{
     /*
-     * A direct pointer to this node's plane is stored to avoid having to index
-     * into the BSP's plane array for every node every frame.
+     * Make sure size is of correct parity
      */
-    bsp_plane_t *plane;
+    if (size % sizeof *data != 0) {
+        fputs("Node data has bad size.\n", stderr);
+        return;
+    }
 
-    struct bsp_node_s *front;
-    struct bsp_node_s *back;
-} bsp_node_t;
+    int count = size / sizeof *data;
+    bsp_node_t *nodes = bsp_arena_alloc(&bsp->arena, count * sizeof *nodes);
 
-typedef struct {
+    for (int i = 0; i < count; i++) {
+        if (data[i].plane_index < 0 ||
+                data[i].plane_index >= bsp->plane_count ||
+                (data[i].front >= 0 && data[i].front >= count) ||
+                (data[i].front < 0 && ~data[i].front >= bsp->leaf_count) ||
+                (data[i].back >= 0 && data[i].back >= count) ||
+                (data[i].back < 0 && ~data[i].back >= bsp->leaf_count)) {
+            Engine.fatal("Node %d has an out of range plane or child.\n", i);
+        }
+
+        nodes[i].id = i;
+        nodes[i].type = 0;
+        nodes[i].plane = &bsp->planes[data[i].plane_index];
+        bsp_load_bounds(nodes[i].mins, nodes[i].maxs, &data[i].bounds);
+
+        const int front = data[i].front;
+        if (front < 0) {
+            nodes[i].front = (bsp_node_t *)&bsp->leaves[~front];
+        } else {
+            nodes[i].front = &nodes[front];
+        }
+
+        const int back = data[i].back;
+        if (back < 0) {
+            nodes[i].back = (bsp_node_t *)&bsp->leaves[~back];
+        } else {
+            nodes[i].back = &nodes[back];
+        }
+
+        nodes[i].front->parent = &nodes[i];
+        nodes[i].back->parent = &nodes[i];
+    }
+
+    bsp->node_count = count;
+    bsp->nodes = nodes;
 
-} bsp_surface_t;
+    /* This also rejects trees with cycles or shared subtrees */
+    bsp_build_cnodes(bsp, data);
+}
 
-typedef struct bsp_s {
-    int vertex_count;
-    vec3_t *vertices;
+/**
+ * Copies \p plane into the hull node \p node.
+ */
+static inline void bsp_load_hullnode_plane(bsp_hullnode_t *node,
+        const bsp_plane_t *plane)
+{
+    vec3_copy(node->normal, (float *)plane->normal);
+    node->dist = plane->offset;
+    node->type = plane->type >= 0 ? plane->type : BSP_PLANE_ANYX;
+}
 
-    int edge_count;
-    bsp_edge_t *edges;
+/**
+ * Loads \p size bytes' worth of clip nodes from \p data into \p bsp and builds
+ * the collision hulls of every model. Hull 0 is the compact tree with each
+ * leaf replaced by its contents. Hulls 1 and 2 are laid out after it,
+ * depth-first from the model's clip_index roots, front children first, so
+ * that a trace mostly walks forward through memory. If the map has no clip
+ * nodes at all, hulls 1 and 2 of every model are empty.
+ * @param bsp A pointer to the BSP struct in which to store the hulls
+ * @param data An array of clip nodes to be loaded
+ * @param size The size in bytes of \p data
+ */
+void bsp_load_clipnodes(bsp_t *bsp, const bspfile_clipnode_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        Engine.fatal("Clip node data has bad size.\n");
+    }
 
-    int edgetable_count;
-    int *edgetable;
+    int count = size / sizeof *data;
+    for (int i = 0; i < count; i++) {
+        if (data[i].plane_index >= (uint32_t)bsp->plane_count ||
+                data[i].front >= count || data[i].back >= count) {
+            Engine.fatal("Clip node %d has an out of range plane or child.\n",
+                    i);
+        }
+    }
 
-    int texture_count;
-    bsp_texture_t **textures;
+    bsp->clipnode_count = count;
+
+    const bsp_derived_counts_t *counts = bsp_derived_section(bsp,
+            BSP_DERIVED_COUNTS, sizeof *counts);
+    const bsp_hullnode_t *cached = bsp_derived_section(bsp,
+            BSP_DERIVED_HULLNODES,
+            (bsp->node_count + count) * sizeof *cached);
+    const void *roots = bsp_derived_section(bsp, BSP_DERIVED_HULL_ROOTS,
+            bsp->model_count * sizeof *bsp->hull_roots);
+    if (counts != NULL && cached != NULL && roots != NULL) {
+        bsp->hullnodes = (bsp_hullnode_t *)cached;
+        bsp->hull_roots = (int32_t (*)[HULL_COUNT])roots;
+        bsp->hull_depth = counts->hull_depth;
+        return;
+    }
 
-    uint8_t *lightmaps;
+    bsp_hullnode_t *hullnodes = bsp_arena_alloc(&bsp->arena,
+            (bsp->node_count + count) * sizeof *hullnodes);
+    bsp->hull_roots = bsp_arena_alloc(&bsp->arena,
+            bsp->model_count * sizeof *bsp->hull_roots);
 
-    uint8_t *vislists;
+    for (int i = 0; i < bsp->node_count; i++) {
+        const bsp_cnode_t *cnode = &bsp->cnodes[i];
+        vec3_copy(hullnodes[i].normal, (float *)cnode->normal);
+        hullnodes[i].dist = cnode->dist;
+        hullnodes[i].type = cnode->type;
+        hullnodes[i].node = cnode->node;
+
+        for (int c = 0; c < 2; c++) {
+            int32_t child = cnode->children[c];
+            hullnodes[i].children[c] = child < 0 ?
+                    bsp->leaves[~child].type : child;
+        }
+    }
 
-    int leaf_count;
-    bsp_leaf_t *leaves;
+    bsp->hullnodes = hullnodes;
+    bsp->hull_depth = bsp->max_depth;
 
-    int plane_count;
-    bsp_plane_t *planes;
+    /*
+     * As for the compact tree, each child reference is pushed at most once,
+     * so 2 * count entries hold the stack of even a malformed hull. Each entry
+     * is a clip node and its depth.
+     */
+    int32_t *remap = malloc((count + 1) * sizeof *remap);
+    int32_t *stack = malloc((2 * count + 2) * sizeof *stack);
+    if (remap == NULL || stack == NULL) {
+        Engine.fatal("Couldn't allocate %d clip nodes.\n", count);
+    }
+    for (int i = 0; i < count; i++) {
+        remap[i] = -1;
+    }
 
-    int node_count;
-    bsp_node_t *nodes;
+    int32_t next = bsp->node_count;
+    for (int m = 0; m < bsp->model_count; m++) {
+        bsp->hull_roots[m][HULL_POINT] = bsp->node_count > 0 ?
+                bsp->cnode_roots[m] : BSP_LEAF_SOLID;
+
+        for (int h = 1; h < HULL_COUNT; h++) {
+            int32_t root = bsp->models[m].clip_index[h - 1];
+            if (count == 0) {
+                bsp->hull_roots[m][h] = BSP_LEAF_NORMAL;
+                continue;
+            }
+            if (root >= count) {
+                Engine.fatal("Model %d has an out of range root in hull %d.\n",
+                        m, h);
+            }
+
+            /* A hull with no nodes is stored as its contents */
+            if (root < 0 || remap[root] != -1) {
+                bsp->hull_roots[m][h] = root < 0 ? root : remap[root];
+                continue;
+            }
+
+            size_t depth = 0;
+            stack[depth++] = root;
+            stack[depth++] = 1;
+            while (depth > 0) {
+                int32_t level = stack[--depth];
+                int32_t i = stack[--depth];
+                if (remap[i] != -1) {
+                    Engine.fatal("Hull %d of model %d is not acyclic.\n", h,
+                            m);
+                }
+
+                bsp_load_hullnode_plane(&hullnodes[next],
+                        &bsp->planes[data[i].plane_index]);
+                hullnodes[next].node = i;
+                remap[i] = next++;
+
+                if (level > bsp->hull_depth) {
+                    bsp->hull_depth = level;
+                }
+
+                /* The back child goes on the stack first to be laid out last */
+                if (data[i].back >= 0) {
+                    stack[depth++] = data[i].back;
+                    stack[depth++] = level + 1;
+                }
+                if (data[i].front >= 0) {
+                    stack[depth++] = data[i].front;
+                    stack[depth++] = level + 1;
+                }
+            }
+
+            bsp->hull_roots[m][h] = remap[root];
+        }
+    }
 
-    int model_count;
-    bsp_model_t *models;
+    for (int32_t i = bsp->node_count; i < next; i++) {
+        const bspfile_clipnode_t *clipnode = &data[hullnodes[i].node];
+        hullnodes[i].children[0] = clipnode->front < 0 ? clipnode->front :
+                remap[clipnode->front];
+        hullnodes[i].children[1] = clipnode->back < 0 ? clipnode->back :
+                remap[clipnode->back];
+    }
 
-} bsp_t;
+    free(stack);
+    free(remap);
+}
 
 /**
- * Returns a pointer to the leaf that contains \p point.
- * @param bsp The BSP structure to search
- * @param point The point to be matched with a leaf
- * @return The leaf containing \p point
+ * Checks that world face \p index can be built and returns its texture.
  */
-bsp_leaf_t *bsp_find_leaf_containing(bsp_t *bsp, vec3_t point)
+static int bsp_check_face(const bsp_t *bsp, int index)
 {
-    if (bsp == NULL) {
-        return NULL;
+    const bspfile_face_t *face = &bsp->faces[index];
+    if (face->edge_index < 0 ||
+            face->edge_index + face->edge_count > bsp->edgetable_count ||
+            face->texture_info_index >= bsp->texinfo_count) {
+        Engine.fatal("Face %d has out of range edges or texture mapping.\n",
+                index);
     }
 
-    bsp_node_t *node = bsp->nodes;
-    while (node->type == 0) {
-        if (vec3_dot(point, node->plane->normal) >= 0) {
-            node = node->front;
-        } else {
-            node = node->back;
+    for (int i = 0; i < face->edge_count; i++) {
+        int32_t edge = bsp->edgetable[face->edge_index + i];
+        if (edge == INT32_MIN || abs(edge) >= bsp->edge_count ||
+                bsp->edges[abs(edge)].endpoints[0] >= bsp->vertex_count ||
+                bsp->edges[abs(edge)].endpoints[1] >= bsp->vertex_count) {
+            Engine.fatal("Face %d has an out of range edge.\n", index);
         }
     }
 
-    return (bsp_leaf_t *)node;
+    uint32_t texture = bsp->texinfo[face->texture_info_index].texture_index;
+    if (texture >= (uint32_t)bsp->texture_count) {
+        Engine.fatal("Face %d has an out of range texture.\n", index);
+    }
+
+    return texture;
 }
 
 /**
- * Loads \p size bytes' worth of vertex data from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the vertices
- * @param data An array of vertices to be loaded
- * @param size The size in bytes of \p data
+ * Returns the texture space coordinates of \p position under \p texinfo in
+ * \p st. Double precision keeps lightmap extents stable on large maps.
  */
-void bsp_load_vertices(bsp_t *bsp, vec3_t *data, int size)
+static inline void bsp_texture_st(const bsp_texinfo_t *texinfo,
+        const float *position, double st[2])
 {
-    if (size % sizeof *data != 0) {
-        fputs("Vertex data has bad size.\n", stderr);
-        return;
-    }
-
-    int count = size / sizeof *data;
-    vec3_t *vertices = calloc(count, sizeof *vertices);
-
-    for (int i = 0; i < count; i++) {
-        vec3_copy(vertices[i], data[i]);
-    }
+    st[0] = (double)position[0] * texinfo->vector_u[0] +
+            (double)position[1] * texinfo->vector_u[1] +
+            (double)position[2] * texinfo->vector_u[2] + texinfo->offset_u;
+    st[1] = (double)position[0] * texinfo->vector_v[0] +
+            (double)position[1] * texinfo->vector_v[1] +
+            (double)position[2] * texinfo->vector_v[2] + texinfo->offset_v;
+}
 
-    bsp->vertex_count = count;
-    bsp->vertices = vertices;
+/**
+ * Returns the position of vertex \p i of \p face.
+ */
+static inline const float *bsp_face_vertex(const bsp_t *bsp,
+        const bspfile_face_t *face, int i)
+{
+    int32_t edge = bsp->edgetable[face->edge_index + i];
+    int vertex = edge >= 0 ? bsp->edges[edge].endpoints[0] :
+            bsp->edges[-edge].endpoints[1];
+    return bsp->vertices[vertex];
 }
 
 /**
- * Loads \p size bytes' worth of edges from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the edges
- * @param data An array of edges to be loaded
- * @param size The size in bytes of \p data
+ * Works out the extent of the lightmap of \p surface, as Quake does: it
+ * covers the face's range of s and t rounded out to whole luxels of 16
+ * texels. Special faces and faces whose lightmap is missing or cut short get
+ * none.
  */
-void bsp_load_edges(bsp_t *bsp, bspfile_edge_t *data, int size)
+static void bsp_surface_lightmap(const bsp_t *bsp, bsp_surface_t *surface)
 {
-    if (size % sizeof *data != 0) {
-        fputs("Edge data has bad size.\n", stderr);
-        return;
+    const bspfile_face_t *face = &bsp->faces[surface->face];
+    const bsp_texinfo_t *texinfo = &bsp->texinfo[face->texture_info_index];
+
+    double mins[2] = { INFINITY, INFINITY };
+    double maxs[2] = { -INFINITY, -INFINITY };
+    for (int i = 0; i < face->edge_count; i++) {
+        double st[2];
+        bsp_texture_st(texinfo, bsp_face_vertex(bsp, face, i), st);
+        for (int k = 0; k < 2; k++) {
+            if (st[k] < mins[k]) {
+                mins[k] = st[k];
+            }
+            if (st[k] > maxs[k]) {
+                maxs[k] = st[k];
+            }
+        }
     }
 
-    int count = size / sizeof *data;
-    bsp_edge_t *edges = calloc(count, sizeof *edges);
-
-    for (int i = 0; i < count; i++) {
-        edges[i].endpoints[0] = data[i].endpoints[0];
-        edges[i].endpoints[1] = data[i].endpoints[1];
+    int lo[2], size[2];
+    for (int k = 0; k < 2; k++) {
+        lo[k] = floor(mins[k] / 16.0);
+        size[k] = (int)ceil(maxs[k] / 16.0) - lo[k] + 1;
     }
 
-    bsp->edge_count = count;
-    bsp->edges = edges;
+    bool lit = !(texinfo->is_animated & BSP_TEXINFO_SPECIAL) &&
+            face->lightmap >= 0 && size[0] <= BSP_LIGHTMAP_PAGE_SIZE &&
+            size[1] <= BSP_LIGHTMAP_PAGE_SIZE &&
+            face->lightmap + size[0] * size[1] <= bsp->lightmap_size;
+    for (int k = 0; k < 2; k++) {
+        surface->lightmap_mins[k] = lit ? lo[k] : 0;
+        surface->lightmap_size[k] = lit ? size[k] : 0;
+    }
+    surface->lightmap = lit ? face->lightmap : -1;
+    surface->lightmap_page = -1;
+    surface->styles[0] = face->light_type;
+    surface->styles[1] = face->light_min;
+    surface->styles[2] = face->light[0];
+    surface->styles[3] = face->light[1];
 }
 
 /**
- * Loads \p size bytes' worth of edge indices from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the edge indices
- * @param data An array of edge indices to be loaded
- * @param size The size in bytes of \p data
+ * Orders surfaces by lightmap height, then width, tallest first, as the
+ * atlas packs best that way.
  */
-void bsp_load_edgetable(bsp_t *bsp, int *data, int size)
+static int bsp_compare_lightmaps(const void *a, const void *b)
 {
-    if (size % sizeof *data != 0) {
-        fputs("Edge list data has bad size.\n", stderr);
-        return;
-    }
-
-    int count = size / sizeof *data;
-    int *edgetable = calloc(count, sizeof *edgetable);
+    const bsp_surface_t *sa = *(const bsp_surface_t * const *)a;
+    const bsp_surface_t *sb = *(const bsp_surface_t * const *)b;
 
-    for (int i = 0; i < count; i++) {
-        edgetable[i] = data[i];
+    if (sa->lightmap_size[1] != sb->lightmap_size[1]) {
+        return sb->lightmap_size[1] - sa->lightmap_size[1];
     }
-
-    bsp->edgetable = edgetable;
+    if (sa->lightmap_size[0] != sb->lightmap_size[0]) {
+        return sb->lightmap_size[0] - sa->lightmap_size[0];
+    }
+    return sa->face - sb->face;
 }
 
 /**
- * Loads \p size bytes' worth of texture data from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the texture data
- * @param data A pointer to a texture header listing the textures
- * @param size The total size of all texture data
- *
- * TODO: It probably makes sense to send the textures to the GPU here so the
- * data doesn't need to be stored
+ * Packs the lightmaps of the surfaces of \p bsp into pages of
+ * BSP_LIGHTMAP_PAGE_SIZE squared luxels and copies each face's first light
+ * style into its place.
  */
-void bsp_load_textures(bsp_t *bsp, bspfile_texheader_t *data, int size)
+void bsp_pack_lightmaps(bsp_t *bsp)
 {
-    bsp_texture_t **textures = calloc(data->texture_count, sizeof *textures);
+    bsp_lightmap_pages_t *pages = &bsp->lightmap_pages;
+    pages->page_size = BSP_LIGHTMAP_PAGE_SIZE;
 
-    for (int i = 0; i < data->texture_count; i++) {
-        /*
-         * The reasoning for this is not clear, but some maps (e.g. e1m2)
-         * require it.
-         *
-         * TODO: find the reason for this and document it.
-         */
-        if (data->offsets[i] == -1) {
-            continue;
+    bsp_surface_t **order = malloc(bsp->surface_count * sizeof *order);
+    atlas_t *atlas = Atlas.create(BSP_LIGHTMAP_PAGE_SIZE);
+    if ((order == NULL && bsp->surface_count > 0) || atlas == NULL) {
+        Engine.fatal("Couldn't allocate lightmap atlas.\n");
+    }
+
+    int lit_count = 0;
+    for (int i = 0; i < bsp->surface_count; i++) {
+        if (bsp->surfaces[i].lightmap != -1) {
+            order[lit_count++] = &bsp->surfaces[i];
+        }
+    }
+    qsort(order, lit_count, sizeof *order, bsp_compare_lightmaps);
+
+    for (int i = 0; i < lit_count; i++) {
+        bsp_surface_t *surface = order[i];
+        int page, x, y;
+        if (!Atlas.add(atlas, surface->lightmap_size[0],
+                surface->lightmap_size[1], &page, &x, &y)) {
+            Engine.fatal("Couldn't place lightmap of face %d.\n",
+                    surface->face);
         }
 
-        bspfile_texture_t *texdata =
-                (bspfile_texture_t *)((uint8_t *)data + data->offsets[i]);
+        surface->lightmap_page = page;
+        surface->lightmap_x = x;
+        surface->lightmap_y = y;
+    }
+
+    size_t page_area = (size_t)BSP_LIGHTMAP_PAGE_SIZE * BSP_LIGHTMAP_PAGE_SIZE;
+    pages->page_count = Atlas.pageCount(atlas);
+    pages->luxel_count = Atlas.usedArea(atlas);
+    Atlas.free(atlas);
 
-        printf("Loading texture '%s'...\n", texdata->name);
+    uint8_t *data = calloc(pages->page_count, page_area);
+    if (data == NULL && pages->page_count > 0) {
+        Engine.fatal("Couldn't allocate %d lightmap pages.\n",
+                pages->page_count);
+    }
 
-        if (texdata->width % 16 != 0 || texdata->height % 16 != 0) {
-            Engine.fatal("Texture '%s' has illegal dimensions.\n", texdata->name);
+    for (int i = 0; i < lit_count; i++) {
+        const bsp_surface_t *surface = order[i];
+        const uint8_t *src = bsp->lightmaps + surface->lightmap;
+        uint8_t *dst = data + surface->lightmap_page * page_area +
+                surface->lightmap_y * BSP_LIGHTMAP_PAGE_SIZE +
+                surface->lightmap_x;
+
+        for (int row = 0; row < surface->lightmap_size[1]; row++) {
+            memcpy(dst, src, surface->lightmap_size[0]);
+            src += surface->lightmap_size[0];
+            dst += BSP_LIGHTMAP_PAGE_SIZE;
         }
+    }
 
-        /*
-         * Ratio of mipmap pixels to texture pixels:
-         * (8x8 + 4x4 + 2x2 + 1x1) / (8x8) = 85/64
-         */
-        int pixel_count = texdata->width * texdata->height * 85 / 64;
+    pages->pages = data;
+    bsp->lightmap_data = data;
+    free(order);
+}
 
-        textures[i] = calloc(1, sizeof **textures + pixel_count);
-        strncpy(textures[i]->name, texdata->name, 15);
-        textures[i]->width = texdata->width;
-        textures[i]->height = texdata->height;
-        textures[i]->offset_full = texdata->offset_full;
-        textures[i]->offset_half = texdata->offset_half;
-        textures[i]->offset_quarter = texdata->offset_quarter;
-        textures[i]->offset_eighth = texdata->offset_eighth;
+/**
+ * Orders surfaces by texture, then lightmap page, then their order in the
+ * file.
+ */
+static int bsp_compare_surfaces(const void *a, const void *b)
+{
+    const bsp_surface_t *sa = a;
+    const bsp_surface_t *sb = b;
 
-        memcpy(&textures[i] + sizeof **textures, texdata + sizeof texdata, pixel_count);
+    if (sa->texture != sb->texture) {
+        return sa->texture - sb->texture;
+    }
+    if (sa->lightmap_page != sb->lightmap_page) {
+        return sa->lightmap_page - sb->lightmap_page;
     }
+    return sa->face - sb->face;
 }
 
 /**
- * Loads \p size bytes of lightmap data from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the lightmap data
- * @param data An array of bytes containing lightmap data
- * @param size The size in bytes of \p data
+ * Appends the vertices and triangles of \p surface to the geometry of
+ * \p bsp. Texture coordinates are s and t over the texture's size, and
+ * lightmap coordinates map each vertex to the centre of its luxel in the
+ * surface's place in the lightmap pages.
  */
-void bsp_load_lightmaps(bsp_t *bsp, uint8_t *data, int size)
+static void bsp_build_surface(bsp_t *bsp, bsp_surface_t *surface,
+        bsp_vertex_t *vertices, uint32_t *indices)
 {
-    uint8_t *lightmaps = calloc(size, sizeof *data);
-    if (lightmaps == NULL) {
-        Engine.fatal("Lightmap allocation failed.\n");
+    const bspfile_face_t *face = &bsp->faces[surface->face];
+    const bsp_texinfo_t *texinfo = &bsp->texinfo[face->texture_info_index];
+    const bsp_texture_t *texture = &bsp->textures[surface->texture];
+
+    /* Missing textures are drawn with a 16x16 placeholder, as in Quake */
+    float width = texture->width > 0 ? texture->width : 16.0f;
+    float height = texture->height > 0 ? texture->height : 16.0f;
+
+    bool lit = surface->lightmap_page != -1;
+    const float corner[2] = {
+        surface->lightmap_x - surface->lightmap_mins[0] + 0.5f,
+        surface->lightmap_y - surface->lightmap_mins[1] + 0.5f
+    };
+
+    bsp_geometry_t *geometry = &bsp->geometry;
+    uint32_t first = geometry->vertex_count;
+    for (int i = 0; i < face->edge_count; i++) {
+        const float *position = bsp_face_vertex(bsp, face, i);
+        double st[2];
+        bsp_texture_st(texinfo, position, st);
+
+        bsp_vertex_t *out = &vertices[first + i];
+        vec3_copy(out->position, (float *)position);
+        out->st[0] = st[0] / width;
+        out->st[1] = st[1] / height;
+        for (int k = 0; k < 2; k++) {
+            out->lightmap_st[k] = lit ? (st[k] / 16.0 + corner[k]) /
+                    BSP_LIGHTMAP_PAGE_SIZE : 0.0f;
+        }
+    }
+
+    /* The face is convex, so a fan around its first vertex covers it */
+    uint32_t *out = &indices[geometry->index_count];
+    for (int i = 2; i < face->edge_count; i++) {
+        *out++ = first;
+        *out++ = first + i - 1;
+        *out++ = first + i;
     }
-    memcpy(lightmaps, data, size);
-    bsp->lightmaps = lightmaps;
+
+    surface->first_vertex = first;
+    surface->vertex_count = face->edge_count;
+    surface->first_index = geometry->index_count;
+    surface->index_count = 3 * (face->edge_count - 2);
+    geometry->vertex_count += surface->vertex_count;
+    geometry->index_count += surface->index_count;
 }
 
 /**
- * Loads \p size bytes of visibility data from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the visibility data
- * @param data An array of bytes containing visibility data
- * @param size The size in bytes of \p data
+ * Takes the world geometry of \p bsp and its lightmap pages from the map's
+ * entry in the derived cache.
+ * @return False if there is no complete geometry there
  */
-void bsp_load_vislists(bsp_t *bsp, uint8_t  *data, int size)
+static bool bsp_use_derived_geometry(bsp_t *bsp)
 {
-    uint8_t *vislists = calloc(size, sizeof *data);
-    if (vislists == NULL) {
-        Engine.fatal("Vislist allocation failed.\n");
+    const bsp_derived_counts_t *counts = bsp_derived_section(bsp,
+            BSP_DERIVED_COUNTS, sizeof *counts);
+    if (counts == NULL) {
+        return false;
     }
-    memcpy(vislists, data, size);
-    bsp->vislists = vislists;
+
+    size_t surface_count, vertex_count, index_count, batch_count;
+    const bsp_surface_t *surfaces = bsp_derived_array(bsp,
+            BSP_DERIVED_SURFACES, sizeof *surfaces, &surface_count);
+    const bsp_vertex_t *vertices = bsp_derived_array(bsp,
+            BSP_DERIVED_VERTICES, sizeof *vertices, &vertex_count);
+    const uint32_t *indices = bsp_derived_array(bsp, BSP_DERIVED_INDICES,
+            sizeof *indices, &index_count);
+    const bsp_batch_t *batches = bsp_derived_array(bsp, BSP_DERIVED_BATCHES,
+            sizeof *batches, &batch_count);
+    const uint8_t *pages = bsp_derived_section(bsp, BSP_DERIVED_LIGHTMAPS,
+            (size_t)counts->lightmap_page_count * BSP_LIGHTMAP_PAGE_SIZE *
+            BSP_LIGHTMAP_PAGE_SIZE);
+    if (surfaces == NULL || vertices == NULL || indices == NULL ||
+            batches == NULL || pages == NULL ||
+            surface_count > (size_t)bsp->face_count) {
+        return false;
+    }
+
+    bsp->surfaces = (bsp_surface_t *)surfaces;
+    bsp->surface_count = surface_count;
+    bsp->geometry = (bsp_geometry_t){
+        .vertex_count = vertex_count,
+        .vertices = vertices,
+        .index_count = index_count,
+        .indices = indices,
+        .batch_count = batch_count,
+        .batches = batches
+    };
+    bsp->lightmap_pages = (bsp_lightmap_pages_t){
+        .page_size = BSP_LIGHTMAP_PAGE_SIZE,
+        .page_count = counts->lightmap_page_count,
+        .pages = pages,
+        .luxel_count = counts->luxel_count
+    };
+
+    return true;
 }
 
 /**
- * Loads \p size bytes' worth of leaves from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the leaf data
- * @param data An array of leaves to be loaded
- * @param size The size in bytes of \p data
+ * Turns the faces of the world into triangle lists grouped by texture and
+ * lightmap page, packing their lightmaps into pages along the way.
  */
-void bsp_load_leaves(bsp_t *bsp, bspfile_leaf_t *data, int size)
+void bsp_build_geometry(bsp_t *bsp)
 {
-    if (size % sizeof *data != 0) {
-        fputs("Leaf data has bad size.\n", stderr);
+    if (bsp->model_count == 0) {
         return;
     }
 
-    int count = size / sizeof *data;
-    bsp_leaf_t *leaves = calloc(count, sizeof *leaves);
+    const bsp_model_t *world = &bsp->models[0];
+    if (world->face_index < 0 || world->face_count < 0 ||
+            world->face_index + world->face_count > bsp->face_count) {
+        Engine.fatal("The world has out of range faces.\n");
+    }
 
-    for (int i = 0; i < count; i++) {
-        leaves[i].id = i;
-        leaves[i].type = data[i].type;
+    if (bsp_use_derived_geometry(bsp)) {
+        return;
     }
 
-    bsp->leaves = leaves;
-}
+    size_t vertex_count = 0, index_count = 0;
+    int surface_count = 0;
+    for (int i = 0; i < world->face_count; i++) {
+        int face = world->face_index + i;
+        if (bsp->faces[face].edge_count < 3) {
+            continue;
+        }
 
-void bsp_load_planes(bsp_t *bsp, bspfile_plane_t *data, int size)
-{
-    if (size % sizeof *data != 0) {
-        fputs("Plane data has bad size.\n", stderr);
-        return;
+        bsp_check_face(bsp, face);
+        vertex_count += bsp->faces[face].edge_count;
+        index_count += 3 * (bsp->faces[face].edge_count - 2);
+        surface_count += 1;
     }
 
-    int count = size / sizeof *data;
-    bsp_plane_t *planes = calloc(count, sizeof *planes);
+    bsp->surfaces = bsp_arena_alloc(&bsp->arena,
+            surface_count * sizeof *bsp->surfaces);
+    bsp->surface_count = surface_count;
 
-    for (int i = 0; i < count; i++) {
-        vec3_copy(planes[i].normal, data[i].normal);
-        planes[i].offset = data[i].offset;
-        planes[i].type = data[i].type;
+    int next = 0;
+    for (int i = 0; i < world->face_count; i++) {
+        int face = world->face_index + i;
+        if (bsp->faces[face].edge_count < 3) {
+            continue;
+        }
+
+        bsp_surface_t *surface = &bsp->surfaces[next++];
+        surface->face = face;
+        surface->texture = bsp->texinfo[bsp->faces[face].texture_info_index]
+                .texture_index;
+        bsp_surface_lightmap(bsp, surface);
     }
 
-    bsp->planes = planes;
-}
+    bsp_pack_lightmaps(bsp);
+    qsort(bsp->surfaces, surface_count, sizeof *bsp->surfaces,
+            bsp_compare_surfaces);
 
-/**
- * Performs an iterative search on \p bsp to determine whether it contains any
- * cycles.
- * @param bsp A pointer to the BSP struct to be searched for cycles
- * @return True if the BSP contains a cycle, false otherwise
- *
- * TODO: The VLA is not a great way to do this -- should probably have static
- * allocation with the maximum node count.
- */
-bool bsp_contains_cycle(bsp_t *bsp)
-{
-    bool visited[bsp->node_count];
-    for (int i = 0; i < bsp->node_count; i++) {
-        visited[i] = false;
+    int batch_count = 0;
+    for (int i = 0; i < surface_count; i++) {
+        batch_count += i == 0 || bsp_compare_surfaces(&bsp->surfaces[i - 1],
+                &bsp->surfaces[i]) != 0 ? 1 : 0;
     }
 
-    for (int i = 0; i < bsp->node_count; i++) {
-        visited[i] = true;
-        bsp_node_t *node = &bsp->nodes[i];
-        if (node->front->type == 0 && visited[node->front->id]) {
-            return true;
+    bsp_vertex_t *vertices = bsp_arena_alloc(&bsp->arena,
+            vertex_count * sizeof *vertices);
+    uint32_t *indices = bsp_arena_alloc(&bsp->arena,
+            index_count * sizeof *indices);
+    bsp_batch_t *batches = bsp_arena_alloc(&bsp->arena,
+            batch_count * sizeof *batches);
+    bsp->geometry.vertices = vertices;
+    bsp->geometry.indices = indices;
+    bsp->geometry.batches = batches;
+
+    bsp_batch_t *batch = NULL;
+    for (int i = 0; i < surface_count; i++) {
+        bsp_surface_t *surface = &bsp->surfaces[i];
+        if (batch == NULL || batch->texture != surface->texture ||
+                batch->lightmap_page != surface->lightmap_page) {
+            batch = &batches[bsp->geometry.batch_count++];
+            batch->texture = surface->texture;
+            batch->lightmap_page = surface->lightmap_page;
+            batch->first_vertex = bsp->geometry.vertex_count;
+            batch->first_index = bsp->geometry.index_count;
         }
 
-        if (node->back->type == 0 && visited[node->back->id]) {
-            return true;
-        }
+        bsp_build_surface(bsp, surface, vertices, indices);
+        batch->vertex_count += surface->vertex_count;
+        batch->index_count += surface->index_count;
+    }
+}
+
+void bsp_load_models(bsp_t *bsp, const bspfile_model_t *data, int size)
+{
+    if (size % sizeof *data != 0) {
+        Engine.fatal("Model data has bad size.\n");
     }
 
-    return false;
+    bsp->model_count = size / sizeof *data;
+    bsp->models = data;
 }
 
 /**
- * Loads \p size bytes' worth of nodes from \p data into \p bsp.
- * @param bsp A pointer to the BSP struct in which to store the node data
- * @param data An array of nodes to be loaded
- * @param size The size in bytes of \p data
+ * Frees \p bsp and everything loaded into it.
  */
-void bsp_load_nodes(bsp_t *bsp, bspfile_node_t *data, int size)
+void bsp_free(bsp_t *bsp)
 {
-    /*
-     * Make sure size is of correct parity
-     */
-    if (size % sizeof *data != 0) {
-        fputs("Node data has bad size.\n", stderr);
+    if (bsp == NULL) {
         return;
     }
 
-    int count = size / sizeof *data;
-    bsp_node_t *nodes = calloc(count, sizeof *nodes);
+    PVS.free(bsp->pvs);
+    Entities.free(bsp->entities);
+    free(bsp->vis_row);
+    free(bsp->lightmap_data);
 
-    for (int i = 0; i < count; i++) {
-        nodes[i].id = i;
-        nodes[i].type = 0;
-        nodes[i].plane = &bsp->planes[i];
+    free(bsp->texture_pixels);
+    Derived.close(bsp->derived);
 
-        const int front = data[i].front;
-        if (front < 0) {
-            nodes[i].front = (bsp_node_t *)&bsp->leaves[~front];
-        } else {
-            nodes[i].front = &nodes[front];
-        }
+    /* Everything else lives in the arena, which starts with the BSP itself */
+    void *file_data = bsp->file_data;
+    free(bsp->arena.base);
+    free(file_data);
+}
 
-        const int back = data[i].back;
-        if (back < 0) {
-            nodes[i].back = (bsp_node_t *)&bsp->leaves[~back];
-        } else {
-            nodes[i].back = &nodes[back];
-        }
-    }
+/*
+ * The steps of loading a BSP, each a lump decoder or a structure built from
+ * several lumps. When more than one step is ready, the first in this order is
+ * started first, so the longest chains of dependent steps start early.
+ */
+enum {
+    BSP_STEP_TEXTURES,
+    BSP_STEP_VISLISTS,
+    BSP_STEP_LEAVES,
+    BSP_STEP_PLANES,
+    BSP_STEP_MODELS,
+    BSP_STEP_NODES,
+    BSP_STEP_CLIPNODES,
+    BSP_STEP_ENTITIES,
+    BSP_STEP_VERTICES,
+    BSP_STEP_EDGES,
+    BSP_STEP_EDGETABLE,
+    BSP_STEP_LIGHTMAPS,
+    BSP_STEP_TEXINFO,
+    BSP_STEP_FACES,
+    BSP_STEP_FACETABLE,
+    BSP_STEP_GEOMETRY,
+    BSP_STEP_COUNT
+};
 
-    bsp->node_count = count;
-    bsp->nodes = nodes;
+#define BSP_STEP(step) (1u << BSP_STEP_##step)
+
+_Static_assert(BSP_STEP_COUNT <= 32, "load steps must fit in a uint32_t");
 
-    if (bsp_contains_cycle(bsp)) {
-        free(bsp->nodes);
-        Engine.fatal("BSP tree is not acyclic.\n");
+/*
+ * The steps that each step has to wait for. Leaves point into the visibility
+ * lists, nodes link to leaves and planes and are laid out from each model's
+ * root, the hulls copy the compact tree and the leaves' contents, and the
+ * world geometry reads all of the face data and the textures' sizes.
+ */
+static const uint32_t bsp_step_after[BSP_STEP_COUNT] = {
+    [BSP_STEP_LEAVES] = BSP_STEP(VISLISTS),
+    [BSP_STEP_NODES] = BSP_STEP(LEAVES) | BSP_STEP(PLANES) | BSP_STEP(MODELS),
+    [BSP_STEP_CLIPNODES] = BSP_STEP(NODES) | BSP_STEP(LEAVES) |
+            BSP_STEP(PLANES) | BSP_STEP(MODELS),
+    [BSP_STEP_GEOMETRY] = BSP_STEP(VERTICES) | BSP_STEP(EDGES) |
+            BSP_STEP(EDGETABLE) | BSP_STEP(TEXTURES) | BSP_STEP(LIGHTMAPS) |
+            BSP_STEP(TEXINFO) | BSP_STEP(FACES) | BSP_STEP(MODELS)
+};
+
+typedef struct {
+    bsp_t *bsp;
+    void * const *elements;
+    const int *sizes;
+
+    /*
+     * The steps that have been started and those that have finished, as
+     * bits of BSP_STEP().
+     */
+    pthread_mutex_t lock;
+    uint32_t started;
+    uint32_t finished;
+} bsp_loader_t;
+
+/**
+ * Runs load step \p step of \p loader.
+ */
+static void bsp_run_step(const bsp_loader_t *loader, int step)
+{
+    bsp_t *bsp = loader->bsp;
+    void * const *elements = loader->elements;
+    const int *sizes = loader->sizes;
+
+    switch (step) {
+    case BSP_STEP_TEXTURES:
+        bsp_load_textures(bsp, elements[LUMP_TEXTURES], sizes[LUMP_TEXTURES]);
+        break;
+    case BSP_STEP_VISLISTS:
+        bsp_load_vislists(bsp, elements[LUMP_VISLISTS], sizes[LUMP_VISLISTS]);
+        break;
+    case BSP_STEP_LEAVES:
+        bsp_load_leaves(bsp, elements[LUMP_LEAVES], sizes[LUMP_LEAVES]);
+        break;
+    case BSP_STEP_PLANES:
+        bsp_load_planes(bsp, elements[LUMP_PLANES], sizes[LUMP_PLANES]);
+        break;
+    case BSP_STEP_MODELS:
+        bsp_load_models(bsp, elements[LUMP_MODELS], sizes[LUMP_MODELS]);
+        break;
+    case BSP_STEP_NODES:
+        bsp_load_nodes(bsp, elements[LUMP_NODES], sizes[LUMP_NODES]);
+        break;
+    case BSP_STEP_CLIPNODES:
+        bsp_load_clipnodes(bsp, elements[LUMP_CLIPNODES],
+                sizes[LUMP_CLIPNODES]);
+        break;
+    case BSP_STEP_ENTITIES:
+        /* A failure leaves the entities NULL for bsp_load() to report */
+        bsp->entities = Entities.parse(elements[LUMP_ENTITIES],
+                sizes[LUMP_ENTITIES]);
+        break;
+    case BSP_STEP_VERTICES:
+        bsp_load_vertices(bsp, elements[LUMP_VERTICES], sizes[LUMP_VERTICES]);
+        break;
+    case BSP_STEP_EDGES:
+        bsp_load_edges(bsp, elements[LUMP_EDGES], sizes[LUMP_EDGES]);
+        break;
+    case BSP_STEP_EDGETABLE:
+        bsp_load_edgetable(bsp, elements[LUMP_EDGETABLE],
+                sizes[LUMP_EDGETABLE]);
+        break;
+    case BSP_STEP_LIGHTMAPS:
+        bsp_load_lightmaps(bsp, elements[LUMP_LIGHTMAPS],
+                sizes[LUMP_LIGHTMAPS]);
+        break;
+    case BSP_STEP_TEXINFO:
+        bsp_load_texinfo(bsp, elements[LUMP_TEXINFO], sizes[LUMP_TEXINFO]);
+        break;
+    case BSP_STEP_FACES:
+        bsp_load_faces(bsp, elements[LUMP_FACES], sizes[LUMP_FACES]);
+        break;
+    case BSP_STEP_FACETABLE:
+        bsp_load_facetable(bsp, elements[LUMP_FACETABLE],
+                sizes[LUMP_FACETABLE]);
+        break;
+    case BSP_STEP_GEOMETRY:
+        bsp_build_geometry(bsp);
+        break;
     }
 }
 
-void bsp_load_models(bsp_t *bsp, bspfile_model_t *data, int size)
+/**
+ * Claims a step of \p loader that has not been started and whose
+ * dependencies have all finished. Must be called with the loader's lock held.
+ * @return The step, or -1 if none is ready
+ */
+static int bsp_claim_step(bsp_loader_t *loader)
 {
-    if (size % sizeof *data != 0) {
-        Engine.fatal("Model data has bad size.\n");
+    for (int step = 0; step < BSP_STEP_COUNT; step++) {
+        uint32_t bit = 1u << step;
+        if ((loader->started & bit) == 0 &&
+                (bsp_step_after[step] & ~loader->finished) == 0) {
+            loader->started |= bit;
+            return step;
+        }
     }
 
-    int count = size / sizeof *data;
-    bsp_model_t *models = calloc(count, sizeof *models);
+    return -1;
+}
 
-    for (int i = 0; i < count; i++) {
-        models[i] = data[i];
+/**
+ * Runs load steps on the worker pool. There is one job per step, but a job
+ * runs whatever steps are ready rather than a particular one, and keeps going
+ * as long as there are any. A job that finds none ready returns at once, and
+ * the job that finishes a step's last dependency goes on to run the step, so
+ * no job ever waits on another and every step has run by the time the batch
+ * is done.
+ */
+void bsp_load_step(void *ctx, size_t index)
+{
+    (void)index;
+    bsp_loader_t *loader = ctx;
+
+    pthread_mutex_lock(&loader->lock);
+    for (int step; (step = bsp_claim_step(loader)) != -1; ) {
+        pthread_mutex_unlock(&loader->lock);
+        bsp_run_step(loader, step);
+        pthread_mutex_lock(&loader->lock);
+        loader->finished |= 1u << step;
     }
-
-    bsp->models = models;
+    pthread_mutex_unlock(&loader->lock);
 }
 
 /**
  * Loads a BSP tree from the map file indicated by \p path.
+ *
+ * The BSP takes its own copy of the file, so that freeing it gives back all
+ * of the memory the map took. Lumps whose file layout is already usable are
+ * not copied again: the BSP points straight into the file data. Everything
+ * derived from the file is carved out of a single arena sized before any lump
+ * is decoded. Lumps are decoded on the worker pool, each as soon as the lumps
+ * it needs are.
+ *
+ * If the cvar derived_path is set, the decoded textures, world geometry,
+ * lightmap pages, compact tree and hulls are saved to the derived cache after
+ * the map is first loaded, and later loads of the same file map them from
+ * there rather than deriving them again.
+ *
  * @param path The path of the BSP file to be loaded
  * @return A fully populated BSP tree representing the map
  */
 bsp_t *bsp_load(const char *path)
 {
-    void *bsp_data = File.readFile(path);
+    uint64_t trace = Trace.begin();
+    size_t bsp_size;
+    void *bsp_data = File.copyFile(path, &bsp_size);
+    if (bsp_data == NULL) {
+        return NULL;
+    }
+
+    if (bsp_size < sizeof (bspfile_header_t)) {
+        Engine.error("'%s' is too small to be a BSP file.\n", path);
+        free(bsp_data);
+        return NULL;
+    }
 
     /*
      * Calculate pointers to and sizes of each lump
@@ -459,38 +2122,164 @@ bsp_t *bsp_load(const char *path)
     int   sizes[LUMP_COUNT];
     bspfile_header_t *header = (bspfile_header_t *)bsp_data;
     for (int i = 0; i < LUMP_COUNT; i++) {
-        elements[i] = (uint8_t *)bsp_data + header->lumps[i].offset;
-        sizes[i] = header->lumps[i].size;
+        const bspfile_lump_t *lump = &header->lumps[i];
+        if (lump->offset < 0 || lump->size < 0 ||
+                (size_t)lump->offset + lump->size > bsp_size) {
+            Engine.error("Lump %d of '%s' is out of bounds.\n", i, path);
+            free(bsp_data);
+            return NULL;
+        }
+
+        elements[i] = (uint8_t *)bsp_data + lump->offset;
+        sizes[i] = lump->size;
+    }
+
+    size_t arena_size = bsp_arena_size(elements, sizes);
+    uint8_t *arena = calloc(1, arena_size);
+    if (arena == NULL) {
+        Engine.error("Couldn't allocate %zu bytes for '%s'.\n", arena_size,
+                path);
+        free(bsp_data);
+        return NULL;
+    }
+
+    bsp_t *bsp = (bsp_t *)arena;
+    bsp->arena.base = arena;
+    bsp->arena.used = sizeof *bsp;
+    bsp->arena.capacity = arena_size;
+    bsp->file_data = bsp_data;
+    bsp->file_size = bsp_size;
+
+    uint64_t hash;
+    bool keyed = File.contentHash(path, &hash);
+    if (keyed) {
+        bsp->derived = Derived.open("bsp", hash, bsp_derived_variant(),
+                BSP_DERIVED_SECTIONS);
     }
 
-    bsp_t *bsp = calloc(1, sizeof *bsp);
+    for (int i = 0; i < LUMP_COUNT; i++) {
+        elements[i] = bsp_lump_view(bsp, i, elements[i], sizes[i]);
+    }
 
     /*
-     * The order is arbitrary since the BSP tree is not actually read until it
-     * is fully loaded, but this order ensures that there are no dangling
-     * pointers just in case.
-     *
-     * TODO: combine surface loading into one function?
+     * Steps run concurrently wherever bsp_step_after allows, so the loaders
+     * must only touch the parts of the BSP they depend on or fill in.
      */
-    bsp_load_vertices(bsp, elements[LUMP_VERTICES], sizes[LUMP_VERTICES]);
-    bsp_load_edges(bsp, elements[LUMP_EDGES], sizes[LUMP_EDGES]);
-    bsp_load_edgetable(bsp, elements[LUMP_EDGETABLE], sizes[LUMP_EDGETABLE]);
-    bsp_load_textures(bsp, elements[LUMP_TEXTURES], sizes[LUMP_TEXTURES]);
-    bsp_load_lightmaps(bsp, elements[LUMP_LIGHTMAPS], sizes[LUMP_LIGHTMAPS]);
-    // bsp_load_texinfo(bsp, elements[LUMP_TEXINFO], sizes[LUMP_TEXINFO]);
-    // bsp_load_faces(bsp, elements[LUMP_FACES], sizes[LUMP_FACES]);
-    // bsp_load_facetable(bsp, elements[LUMP_FACETABLE], sizes[LUMP_FACETABLE]);
-    bsp_load_vislists(bsp, elements[LUMP_VISLISTS], sizes[LUMP_VISLISTS]);
-    bsp_load_leaves(bsp, elements[LUMP_LEAVES], sizes[LUMP_LEAVES]);
-    bsp_load_planes(bsp, elements[LUMP_PLANES], sizes[LUMP_PLANES]);
-    bsp_load_nodes(bsp, elements[LUMP_NODES], sizes[LUMP_NODES]);
-    // bsp_load_clipnodes(bsp, elements[LUMP_CLIPNODES], sizes[LUMP_CLIPNODES]);
-    // bsp_load_entities(bsp, elements[LUMP_ENTITIES], sizes[LUMP_ENTITIES]);
-    bsp_load_models(bsp, elements[LUMP_MODELS], sizes[LUMP_MODELS]);
+    bsp_loader_t loader = {
+        .bsp = bsp,
+        .elements = elements,
+        .sizes = sizes,
+        .started = 0,
+        .finished = 0
+    };
+    pthread_mutex_init(&loader.lock, NULL);
+    Jobs.run(BSP_STEP_COUNT, bsp_load_step, &loader);
+    pthread_mutex_destroy(&loader.lock);
+
+    if (bsp->entities == NULL) {
+        Engine.error("Couldn't parse the entities of '%s'.\n", path);
+        bsp_free(bsp);
+        return NULL;
+    }
+
+    bsp->vis_leaf = -1;
+    bsp->pvs = PVS.create(bsp);
+    if (bsp->pvs == NULL) {
+        bsp_free(bsp);
+        return NULL;
+    }
+
+    bsp->vis_row = calloc(PVS.rowWords(bsp->pvs), sizeof *bsp->vis_row);
+    if (bsp->vis_row == NULL) {
+        Engine.error("Couldn't allocate visibility row for '%s'.\n", path);
+        bsp_free(bsp);
+        return NULL;
+    }
+
+    if (keyed && bsp->derived == NULL) {
+        bsp_save_derived(bsp, hash);
+    }
+
+    Trace.end(trace, TRACE_BSP_LOAD, path,
+            bsp->derived != NULL ? "derived" : NULL, bsp_size, false);
+    return bsp;
+}
+
+/**
+ * Returns the number of bytes of memory held by \p bsp, including its copy of
+ * the map file and its mapped entry in the derived cache.
+ */
+size_t bsp_size(const bsp_t *bsp)
+{
+    size_t size = bsp->arena.capacity + bsp->file_size;
+    if (bsp->lightmap_data != NULL) {
+        size += (size_t)bsp->lightmap_pages.page_count *
+                bsp->lightmap_pages.page_size * bsp->lightmap_pages.page_size;
+    }
+
+    size += bsp->texture_pixel_size;
+
+    if (bsp->derived != NULL) {
+        size += Derived.size(bsp->derived);
+    }
+
+    if (bsp->entities != NULL) {
+        size += Entities.size(bsp->entities);
+    }
+
+    return size;
+}
+
+void *bsp_cache_load(const char *path, size_t *size)
+{
+    bsp_t *bsp = bsp_load(path);
+    if (bsp != NULL) {
+        *size = bsp_size(bsp);
+    }
 
     return bsp;
 }
 
+void bsp_cache_free(void *bsp)
+{
+    bsp_free(bsp);
+}
+
+static const cache_loader_t bsp_cache_loader = {
+    .name = "bsp",
+    .trace_kind = TRACE_BSP_LOAD,
+    .load = bsp_cache_load,
+    .free = bsp_cache_free
+};
+
+/**
+ * Returns a handle to the BSP tree of the map file at \p path through the
+ * asset cache, loading it only if it is not already cached. The tree is
+ * retrieved with Cache.get() and must not be freed by the caller; pass the
+ * handle to Cache.release() when done with it instead.
+ * @param path The path of the BSP file to be loaded
+ * @return A handle to the BSP tree, or NULL on error
+ */
+cache_handle_t *bsp_acquire(const char *path)
+{
+    return Cache.acquire(&bsp_cache_loader, path);
+}
+
 const struct bsp_namespace BSP = {
-    .load = bsp_load
+    .load = bsp_load,
+    .acquire = bsp_acquire,
+    .free = bsp_free,
+    .findLeaf = bsp_find_leaf,
+    .findLeaves = bsp_find_leaves,
+    .pointContents = bsp_point_contents,
+    .pvs = bsp_pvs,
+    .markVisible = bsp_mark_visible,
+    .leafVisible = bsp_leaf_visible,
+    .nodeVisible = bsp_node_visible,
+    .cull = bsp_cull,
+    .geometry = bsp_geometry,
+    .lightmapPages = bsp_lightmap_pages,
+    .textureCount = bsp_texture_count,
+    .texture = bsp_texture,
+    .entities = bsp_entities
 };
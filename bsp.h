@@ -17,10 +17,36 @@
 #ifndef BSP_H
 #define BSP_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "cache.h"
+#include "entities.h"
+
 #define BSP_VERSION (29)
 
+/*
+ * Contents of the space inside a leaf
+ */
+#define BSP_LEAF_NORMAL (-1)
+#define BSP_LEAF_SOLID  (-2)
+#define BSP_LEAF_WATER  (-3)
+#define BSP_LEAF_ACID   (-4)
+#define BSP_LEAF_LAVA   (-5)
+#define BSP_LEAF_SKY    (-6)
+
+/*
+ * Plane types. The first three are perpendicular to the X, Y and Z axes; the
+ * rest are merely closest to them.
+ */
+#define BSP_PLANE_X    (0)
+#define BSP_PLANE_Y    (1)
+#define BSP_PLANE_Z    (2)
+#define BSP_PLANE_ANYX (3)
+#define BSP_PLANE_ANYY (4)
+#define BSP_PLANE_ANYZ (5)
+
 typedef float vec3_t[3];
 
 enum {
@@ -91,6 +117,12 @@ typedef struct {
     uint16_t endpoints[2];
 } bspfile_edge_t;
 
+/*
+ * Set in a texinfo's is_animated field for liquid and sky textures, which
+ * warp or scroll and have no lightmap.
+ */
+#define BSP_TEXINFO_SPECIAL (1)
+
 typedef struct {
     vec3_t vector_u;
     float  offset_u;
@@ -104,7 +136,7 @@ typedef struct {
     uint16_t plane_index;
     uint16_t is_backface;
     int32_t  edge_index;
-    int32_t  edge_count;
+    uint16_t edge_count;
     uint16_t texture_info_index;
     uint8_t  light_type;
     uint8_t  light_min;
@@ -134,7 +166,23 @@ typedef struct {
     uint32_t offset_quarter;
     uint32_t offset_eighth;
 } bspfile_texture_t;
-typedef bspfile_texture_t bsp_texture_t;
+
+#define BSP_MIP_LEVELS (4)
+
+/*
+ * A texture as loaded. Each mip level is half the width and height of the
+ * one before. Pixels are RGBA, or palette indices if the cvar
+ * bsp_indexedtextures is set when the map is loaded, as given by
+ * bytes_per_pixel. A texture missing from the map has a width and height of
+ * 0 and no pixels.
+ */
+typedef struct {
+    char name[16];
+    uint32_t width;
+    uint32_t height;
+    int bytes_per_pixel;
+    const uint8_t *mips[BSP_MIP_LEVELS];
+} bsp_texture_t;
 
 typedef struct {
     /*
@@ -197,9 +245,101 @@ typedef struct {
 } bspfile_clipnode_t;
 
 typedef struct bsp_s bsp_t;
+typedef struct pvs_s pvs_t;
+
+/*
+ * The size in luxels of the square pages that world lightmaps are packed
+ * into.
+ */
+#define BSP_LIGHTMAP_PAGE_SIZE (512)
+
+/*
+ * A vertex of the static world geometry. Texture coordinates are in units of
+ * the texture's size, and lightmap coordinates are in units of the size of a
+ * lightmap page.
+ */
+typedef struct {
+    vec3_t position;
+    float st[2];
+    float lightmap_st[2];
+} bsp_vertex_t;
+
+/*
+ * A run of world faces that share a texture and a lightmap page, drawn as
+ * index_count indices starting at first_index. The indices refer to the whole
+ * vertex array, but only to the vertex_count vertices starting at
+ * first_vertex. The lightmap page is -1 for faces without lightmaps.
+ */
+typedef struct {
+    int texture;
+    int lightmap_page;
+    uint32_t first_vertex;
+    uint32_t vertex_count;
+    uint32_t first_index;
+    uint32_t index_count;
+} bsp_batch_t;
+
+/*
+ * The lightmaps of the world's faces, packed into page_count pages of
+ * page_size by page_size luxels, one byte of brightness each. Each face's
+ * lightmap holds its first light style. luxel_count is how many luxels the
+ * lightmaps cover, for working out how full the pages are.
+ */
+typedef struct {
+    int page_size;
+    int page_count;
+    const uint8_t *pages;
+    size_t luxel_count;
+} bsp_lightmap_pages_t;
+
+typedef struct {
+    size_t vertex_count;
+    const bsp_vertex_t *vertices;
+    size_t index_count;
+    const uint32_t *indices;
+    size_t batch_count;
+    const bsp_batch_t *batches;
+} bsp_geometry_t;
+
+#define BSP_MAX_FRUSTUM_PLANES (6)
+
+/*
+ * A view frustum in the space of the model being culled. The planes face
+ * inward: a point p is inside plane i if dot(normal, p) >= dist.
+ */
+typedef struct {
+    vec3_t origin;
+    int plane_count;
+    struct {
+        vec3_t normal;
+        float dist;
+    } planes[BSP_MAX_FRUSTUM_PLANES];
+} bsp_frustum_t;
+
+/*
+ * Called for each leaf that survives culling, with the leaf's index.
+ */
+typedef void (*bsp_leaf_fn_t)(int leaf, void *ctx);
 
 extern const struct bsp_namespace {
     bsp_t *(* const load)(const char *path);
+    cache_handle_t *(* const acquire)(const char *path);
+    void (* const free)(bsp_t *bsp);
+    int (* const findLeaf)(const bsp_t *bsp, const vec3_t point);
+    void (* const findLeaves)(const bsp_t *bsp, const float *x, const float *y,
+            const float *z, size_t count, int *leaves, int *contents);
+    int (* const pointContents)(const bsp_t *bsp, const vec3_t point);
+    pvs_t *(* const pvs)(const bsp_t *bsp);
+    void (* const markVisible)(bsp_t *bsp, const vec3_t camera);
+    bool (* const leafVisible)(const bsp_t *bsp, int leaf);
+    bool (* const nodeVisible)(const bsp_t *bsp, int node);
+    size_t (* const cull)(const bsp_t *bsp, int model,
+            const bsp_frustum_t *frustum, bsp_leaf_fn_t fn, void *ctx);
+    const bsp_geometry_t *(* const geometry)(const bsp_t *bsp);
+    const bsp_lightmap_pages_t *(* const lightmapPages)(const bsp_t *bsp);
+    int (* const textureCount)(const bsp_t *bsp);
+    const bsp_texture_t *(* const texture)(const bsp_t *bsp, int index);
+    const entities_t *(* const entities)(const bsp_t *bsp);
 } BSP;
 
 #endif
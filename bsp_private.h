@@ -0,0 +1,347 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BSP_PRIVATE_H
+#define BSP_PRIVATE_H
+
+/*
+ * Runtime representation of a loaded BSP, shared by the modules that work on
+ * its internals. Everything else goes through the BSP namespace.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bsp.h"
+#include "derived.h"
+#include "entities.h"
+#include "hull.h"
+#include "vecmath.h"
+
+/*
+ * Lumps whose file layout matches the runtime layout are used in place, so
+ * these are the same types as their bspfile_* counterparts.
+ */
+typedef bspfile_edge_t bsp_edge_t;
+typedef bspfile_plane_t bsp_plane_t;
+
+struct bsp_node_s;
+
+/*
+ * Leaves and nodes begin with the same fields, so that a child pointer can
+ * refer to either and be told apart by its type.
+ */
+typedef struct {
+    int id;
+
+    /*
+     * This indicates the behavior of space inside this leaf. See the BSP_LEAF_*
+     * definitions in bsp.h.
+     */
+    int type;
+
+    /*
+     * The frame when this leaf was last marked visible by BSP.markVisible().
+     * If this equals the BSP's vis_frame, this leaf is potentially visible.
+     */
+    uint32_t last_visited;
+
+    struct bsp_node_s *parent;
+
+    /*
+     * The bounding box of this leaf.
+     */
+    vec3_t mins;
+    vec3_t maxs;
+
+    /*
+     * A pointer to this leaf's compressed visibility list.
+     */
+    const uint8_t *vislist;
+} bsp_leaf_t;
+
+/*
+ * Internal representation of a node in a BSP tree
+ */
+typedef struct bsp_node_s {
+    int id;
+
+    /*
+     * This field is the same as the bspfile_node_t's plane_index field, kept
+     * here solely to determine if this is a node or a leaf.
+     */
+    int type;
+
+    /*
+     * The frame when this node was last marked visible by BSP.markVisible().
+     * If this equals the BSP's vis_frame, some leaf below this node is
+     * potentially visible and its children need to be examined.
+     */
+    uint32_t last_visited;
+
+    /*
+     * The node above this one, or NULL for the root of a model's tree.
+     */
+    struct bsp_node_s *parent;
+
+    /*
+     * The bounding box of everything below this node.
+     */
+    vec3_t mins;
+    vec3_t maxs;
+
+    /*
+     * A direct pointer to this node's plane is stored to avoid having to index
+     * into the BSP's plane array for every node every frame.
+     */
+    const bsp_plane_t *plane;
+
+    struct bsp_node_s *front;
+    struct bsp_node_s *back;
+} bsp_node_t;
+
+/*
+ * Node of the compact tree used for point queries. Nodes are stored in
+ * depth-first order, so the front child of a node usually follows it in
+ * memory, and each carries its own plane so a descent touches nothing else.
+ */
+typedef struct {
+    vec3_t normal;
+    float dist;
+
+    /*
+     * The type of the plane. If this is below BSP_PLANE_ANYX, the plane is
+     * perpendicular to the axis of that index and the normal is not needed.
+     */
+    int32_t type;
+
+    /*
+     * The front and back children as indices into the compact node array. A
+     * negative value is the bitwise negation of a leaf index, as in
+     * bspfile_node_t.
+     */
+    int32_t children[2];
+
+    /*
+     * Index of the same node in the BSP's node array.
+     */
+    int32_t node;
+} bsp_cnode_t;
+
+/* The batch lookup addresses nodes as runs of eight 32-bit fields */
+_Static_assert(sizeof (bsp_cnode_t) == 8 * sizeof (int32_t),
+        "bsp_cnode_t must be 32 bytes");
+
+/*
+ * Node of a collision hull. Hull 0 is a copy of the compact tree, index for
+ * index, and the clip nodes of hulls 1 and 2 follow it in the same array,
+ * laid out depth-first from each model's roots in the same way.
+ */
+typedef struct {
+    vec3_t normal;
+    float dist;
+    int32_t type;
+
+    /*
+     * The front and back children as indices into the hull node array. A
+     * negative value is the contents of the space on that side, one of the
+     * BSP_LEAF_* values.
+     */
+    int32_t children[2];
+
+    /*
+     * Index of the same node in the BSP's node array for hull 0, or in the
+     * file's clip node array for hulls 1 and 2.
+     */
+    int32_t node;
+} bsp_hullnode_t;
+
+_Static_assert(sizeof (bsp_hullnode_t) == 8 * sizeof (int32_t),
+        "bsp_hullnode_t must be 32 bytes");
+
+typedef bspfile_texinfo_t bsp_texinfo_t;
+
+/*
+ * A world face as built into the static geometry. Surfaces are sorted into the
+ * order of the batches, so the surfaces of a batch are contiguous and so are
+ * their vertices and indices.
+ */
+typedef struct {
+    /*
+     * Index of the face in the face lump.
+     */
+    int face;
+    int texture;
+
+    uint32_t first_vertex;
+    uint32_t vertex_count;
+    uint32_t first_index;
+    uint32_t index_count;
+
+    /*
+     * The corner of the face's lightmap in texture space, in luxels of 16
+     * texels, and its size in luxels. The size is 0 if the face has no
+     * lightmap.
+     */
+    int16_t lightmap_mins[2];
+    int16_t lightmap_size[2];
+
+    /*
+     * The offset of the face's lightmaps in the lightmap lump, or -1, and the
+     * light styles that select them.
+     */
+    int32_t lightmap;
+    uint8_t styles[4];
+
+    /*
+     * The page of the lightmap pages the face's lightmap was packed into, or
+     * -1 if it has none, and the corner of its place there.
+     */
+    int16_t lightmap_page;
+    uint16_t lightmap_x;
+    uint16_t lightmap_y;
+} bsp_surface_t;
+
+/*
+ * A bump allocator over one block sized before loading begins. The BSP struct
+ * is the first thing carved out of it, so freeing the BSP frees the arena.
+ */
+typedef struct {
+    uint8_t *base;
+    size_t used;
+    size_t capacity;
+} bsp_arena_t;
+
+typedef struct bsp_s {
+    bsp_arena_t arena;
+
+    /*
+     * The map's entry in the derived cache, if it had one when it was loaded.
+     * Whatever was found there is used in place of deriving it again, so the
+     * arrays below may point into this as well as into the arena.
+     */
+    derived_t *derived;
+
+    /*
+     * The contents of the map file, of file_size bytes, which belong to the
+     * BSP. Lumps that can be used as they are on disk point into this.
+     */
+    void *file_data;
+    size_t file_size;
+
+    int vertex_count;
+    const vec3_t *vertices;
+
+    int edge_count;
+    const bsp_edge_t *edges;
+
+    int edgetable_count;
+    const int32_t *edgetable;
+
+    /*
+     * Decoded pixels of every texture live in one block apart from the
+     * arena, of texture_pixel_size bytes; indexed pixels point into the file
+     * data instead, and pixels from the derived cache into that.
+     */
+    int texture_count;
+    bsp_texture_t *textures;
+    uint8_t *texture_pixels;
+    size_t texture_pixel_size;
+
+    int lightmap_size;
+    const uint8_t *lightmaps;
+
+    int texinfo_count;
+    const bsp_texinfo_t *texinfo;
+
+    int face_count;
+    const bspfile_face_t *faces;
+
+    int facetable_count;
+    const uint16_t *facetable;
+
+    /*
+     * The world's faces turned into triangles. The geometry's arrays and the
+     * surfaces live in the arena. The lightmap pages are held in
+     * lightmap_data unless they were mapped from the derived cache.
+     */
+    int surface_count;
+    bsp_surface_t *surfaces;
+    bsp_geometry_t geometry;
+    bsp_lightmap_pages_t lightmap_pages;
+    uint8_t *lightmap_data;
+
+    int vislist_size;
+    const uint8_t *vislists;
+
+    int leaf_count;
+    bsp_leaf_t *leaves;
+
+    int plane_count;
+    const bsp_plane_t *planes;
+
+    int node_count;
+    bsp_node_t *nodes;
+
+    /*
+     * The compact tree holds node_count nodes. cnode_roots gives the index
+     * of the root of each model's tree in it, starting with the world.
+     */
+    bsp_cnode_t *cnodes;
+    int32_t *cnode_roots;
+
+    /*
+     * The number of nodes on the longest path from a root to a leaf.
+     */
+    int max_depth;
+
+    int model_count;
+    const bsp_model_t *models;
+
+    /*
+     * The collision hulls of every model. hull_roots gives the index of the
+     * root of each of a model's hulls in hullnodes, or the contents of the
+     * whole hull if it has no nodes.
+     */
+    int clipnode_count;
+    bsp_hullnode_t *hullnodes;
+    int32_t (*hull_roots)[HULL_COUNT];
+
+    /*
+     * The number of nodes on the longest path from a root to a leaf in any
+     * hull.
+     */
+    int hull_depth;
+
+    /*
+     * The entities are parsed in place, so their keys and values point into
+     * the file data like the lumps above.
+     */
+    entities_t *entities;
+
+    pvs_t *pvs;
+
+    /*
+     * State of the last visibility pass: the leaf the camera was in, or -1
+     * before the first pass, the stamp given to everything it marked, and a
+     * buffer for the PVS row of the camera leaf.
+     */
+    int vis_leaf;
+    uint32_t vis_frame;
+    uint64_t *vis_row;
+} bsp_t;
+
+#endif
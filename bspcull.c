@@ -0,0 +1,193 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * @file bspcull.c
+ *
+ * Replays a recorded camera path through a map and reports what the
+ * visibility pass and frustum culling cost per frame. The path is a text file
+ * with one camera per line, given as "x y z pitch yaw" in map units and
+ * degrees; blank lines and lines starting with '#' are skipped. Each camera
+ * gets a 90 by 73.74 degree frustum, Quake's default at 4:3.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bsp.h"
+#include "engine.h"
+#include "file.h"
+#include "vecmath.h"
+
+#define BSPCULL_MAX_LINE_LEN (256)
+#define BSPCULL_FOV_X        (90.0f)
+#define BSPCULL_FOV_Y        (73.74f)
+
+typedef struct {
+    vec3_t origin;
+    float pitch;
+    float yaw;
+} bspcull_camera_t;
+
+double bspcull_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void bspcull_count(int leaf, void *ctx)
+{
+    (void)leaf;
+    (void)ctx;
+}
+
+/**
+ * Reads the camera path at \p path into a new array.
+ * @return The cameras, with their number in \p count
+ */
+bspcull_camera_t *bspcull_read_path(const char *path, size_t *count)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        Engine.fatal("Couldn't open camera path '%s'.\n", path);
+    }
+
+    size_t capacity = 256;
+    bspcull_camera_t *cameras = malloc(capacity * sizeof *cameras);
+    *count = 0;
+
+    char line[BSPCULL_MAX_LINE_LEN];
+    while (fgets(line, sizeof line, fp) != NULL) {
+        bspcull_camera_t camera;
+        if (line[0] == '#' || sscanf(line, "%f %f %f %f %f", &camera.origin[0],
+                &camera.origin[1], &camera.origin[2], &camera.pitch,
+                &camera.yaw) != 5) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            cameras = realloc(cameras, capacity * sizeof *cameras);
+        }
+        if (cameras == NULL) {
+            Engine.fatal("Couldn't allocate camera path.\n");
+        }
+        cameras[(*count)++] = camera;
+    }
+
+    fclose(fp);
+    return cameras;
+}
+
+/**
+ * Sets \p frustum to the view from \p camera, with the four side planes
+ * facing inward.
+ */
+void bspcull_frustum(const bspcull_camera_t *camera, bsp_frustum_t *frustum)
+{
+    const float rad = (float)M_PI / 180.0f;
+    float cp = cosf(camera->pitch * rad), sp = sinf(camera->pitch * rad);
+    float cy = cosf(camera->yaw * rad), sy = sinf(camera->yaw * rad);
+
+    /* Quake's axes: yaw turns about Z and positive pitch looks down */
+    vec3_t forward = { cp * cy, cp * sy, -sp };
+    vec3_t right = { sy, -cy, 0.0f };
+    vec3_t up = { sp * cy, sp * sy, cp };
+
+    float sx = sinf(BSPCULL_FOV_X * 0.5f * rad);
+    float cx = cosf(BSPCULL_FOV_X * 0.5f * rad);
+    float sv = sinf(BSPCULL_FOV_Y * 0.5f * rad);
+    float cv = cosf(BSPCULL_FOV_Y * 0.5f * rad);
+
+    const float *side[4] = { right, right, up, up };
+    const float sign[4] = { 1.0f, -1.0f, 1.0f, -1.0f };
+    const float s[4] = { sx, sx, sv, sv };
+    const float c[4] = { cx, cx, cv, cv };
+
+    vec3_copy(frustum->origin, (float *)camera->origin);
+    frustum->plane_count = 4;
+    for (int i = 0; i < 4; i++) {
+        for (int k = 0; k < 3; k++) {
+            frustum->planes[i].normal[k] = forward[k] * s[i] +
+                    sign[i] * side[i][k] * c[i];
+        }
+        frustum->planes[i].dist = vec3_dot(frustum->planes[i].normal,
+                frustum->origin);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        printf("Usage: %s [game-dir] [map] [camera-path]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    File.addDirToPath(argv[1]);
+    bsp_t *bsp = BSP.load(argv[2]);
+    if (bsp == NULL) {
+        Engine.fatal("Couldn't load '%s'.\n", argv[2]);
+    }
+
+    size_t camera_count;
+    bspcull_camera_t *cameras = bspcull_read_path(argv[3], &camera_count);
+    if (camera_count == 0) {
+        Engine.fatal("No cameras in '%s'.\n", argv[3]);
+    }
+
+    double mark_total = 0.0, cull_total = 0.0, cull_max = 0.0;
+    size_t pvs_leaves = 0, drawn_leaves = 0;
+    for (size_t i = 0; i < camera_count; i++) {
+        Engine.incFrameCount();
+
+        bsp_frustum_t frustum;
+        bspcull_frustum(&cameras[i], &frustum);
+
+        double t0 = bspcull_now();
+        BSP.markVisible(bsp, frustum.origin);
+        double t1 = bspcull_now();
+        drawn_leaves += BSP.cull(bsp, 0, &frustum, bspcull_count, NULL);
+        double t2 = bspcull_now();
+
+        mark_total += t1 - t0;
+        cull_total += t2 - t1;
+        if (t2 - t1 > cull_max) {
+            cull_max = t2 - t1;
+        }
+
+        /* The same walk without planes counts what the PVS alone lets in */
+        frustum.plane_count = 0;
+        pvs_leaves += BSP.cull(bsp, 0, &frustum, bspcull_count, NULL);
+    }
+
+    printf("%zu frames\n", camera_count);
+    printf("visibility pass: %.2f us/frame\n", mark_total * 1e6 / camera_count);
+    printf("frustum cull:    %.2f us/frame (max %.2f us)\n",
+            cull_total * 1e6 / camera_count, cull_max * 1e6);
+    printf("leaves:          %.1f in PVS, %.1f after culling (%.1f%%)\n",
+            (double)pvs_leaves / camera_count,
+            (double)drawn_leaves / camera_count,
+            pvs_leaves > 0 ? 100.0 * drawn_leaves / pvs_leaves : 0.0);
+
+    free(cameras);
+    BSP.free(bsp);
+    File.shutdown();
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file bspinfo.c
+ *
+ * Loads a map and reports how long that took and what was built from it: the
+ * static world geometry and its batches, how many lightmap pages the world's
+ * lightmaps were packed into and how full they are, and how many entities the
+ * map has.
+ *
+ * Given a directory for the derived cache, the map is loaded a second time
+ * once the first load has filled the cache, and both times are reported. The
+ * first load is cold unless the cache already held the map.
+ *
+ * Lumps are decoded on the worker pool, whose size is reported with the load
+ * times. Given a thread count, the pool is capped through the cvar
+ * jobs_threads, so that load times can be compared across thread counts; pass
+ * - as the derived directory to set a thread count without the cache.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bsp.h"
+#include "cvar.h"
+#include "engine.h"
+#include "entities.h"
+#include "file.h"
+#include "jobs.h"
+
+double bspinfo_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 5) {
+        printf("Usage: %s [game-dir] [map] [derived-dir] [threads]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    bool derived = argc >= 4 && strcmp(argv[3], "-") != 0;
+    if (derived) {
+        Cvar.addString("derived_path", argv[3], false);
+    }
+
+    if (argc == 5) {
+        long threads = strtol(argv[4], NULL, 0);
+        if (threads <= 0) {
+            Engine.fatal("Thread count must be positive.\n");
+        }
+        Cvar.addNumber("jobs_threads", threads, false);
+    }
+
+    File.addDirToPath(argv[1]);
+
+    double t0 = bspinfo_now();
+    bsp_t *bsp = BSP.load(argv[2]);
+    double load_time = bspinfo_now() - t0;
+    if (bsp == NULL) {
+        Engine.fatal("Couldn't load '%s'.\n", argv[2]);
+    }
+
+    double cached_time = 0.0;
+    if (derived) {
+        BSP.free(bsp);
+
+        t0 = bspinfo_now();
+        bsp = BSP.load(argv[2]);
+        cached_time = bspinfo_now() - t0;
+        if (bsp == NULL) {
+            Engine.fatal("Couldn't reload '%s'.\n", argv[2]);
+        }
+    }
+
+    const bsp_geometry_t *geometry = BSP.geometry(bsp);
+    const bsp_lightmap_pages_t *lightmaps = BSP.lightmapPages(bsp);
+    const entities_t *entities = BSP.entities(bsp);
+
+    int pair_count = 0;
+    for (int i = 0; i < Entities.count(entities); i++) {
+        pair_count += Entities.get(entities, i)->pair_count;
+    }
+
+    size_t page_area = (size_t)lightmaps->page_size * lightmaps->page_size;
+    size_t total_area = lightmaps->page_count * page_area;
+
+    printf("load:      %.2f ms\n", load_time * 1e3);
+    if (derived) {
+        printf("cached:    %.2f ms\n", cached_time * 1e3);
+    }
+    printf("workers:   %zu, plus the loading thread\n", Jobs.workerCount());
+    printf("geometry:  %zu vertices, %zu triangles in %zu batches\n",
+            geometry->vertex_count, geometry->index_count / 3,
+            geometry->batch_count);
+    printf("lightmaps: %d pages of %dx%d, %zu luxels (%.1f%% full)\n",
+            lightmaps->page_count, lightmaps->page_size, lightmaps->page_size,
+            lightmaps->luxel_count,
+            total_area > 0 ? 100.0 * lightmaps->luxel_count / total_area : 0.0);
+    printf("entities:  %d entities, %d keys (%zu bytes)\n",
+            Entities.count(entities), pair_count, Entities.size(entities));
+
+    BSP.free(bsp);
+    File.shutdown();
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file bspleaf.c
+ *
+ * Measures leaf lookups against a map's world tree. BSP.findLeaf, which walks
+ * the compact node array, is timed against a walk of the linked nodes the
+ * compact array was built from. Two point streams are used: random points
+ * anywhere in the world's bounds, and a coherent stream that wanders through
+ * them in short steps, as a moving entity's position would. Both walks must
+ * agree on every point's leaf.
+ *
+ * The same points are also looked up as one batch with BSP.findLeaves, which
+ * must agree with BSP.findLeaf on every leaf and with BSP.pointContents on
+ * every point's contents. The batch takes eight points per step when bsp.c is
+ * built with AVX2 and one otherwise, so the tool should be run from both
+ * builds; it reports which one it was built as.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bsp.h"
+#include "bsp_private.h"
+#include "engine.h"
+#include "file.h"
+#include "vecmath.h"
+
+#define BSPLEAF_DEFAULT_COUNT (1000000)
+#define BSPLEAF_STEP_LENGTH   (8.0f)
+#define BSPLEAF_RUNS          (5)
+
+#ifdef __AVX2__
+#define BSPLEAF_BUILD "AVX2"
+#else
+#define BSPLEAF_BUILD "portable"
+#endif
+
+/*
+ * The points of one stream and the results of each way of looking them up.
+ */
+typedef struct {
+    size_t count;
+    vec3_t *points;
+
+    /* The points again as separate arrays of coordinates, for findLeaves */
+    float *x;
+    float *y;
+    float *z;
+
+    int *compact;
+    int *linked;
+    int *batch;
+    int *point_contents;
+    int *batch_contents;
+} bspleaf_queries_t;
+
+double bspleaf_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+float bspleaf_random(float min, float max)
+{
+    return min + (float)rand() / RAND_MAX * (max - min);
+}
+
+/**
+ * Returns the index of the world leaf of \p bsp containing \p point, found by
+ * following the front and back pointers of the linked nodes.
+ */
+int bspleaf_linked(const bsp_t *bsp, const vec3_t point)
+{
+    const bsp_node_t *node = &bsp->nodes[bsp->models[0].bsp_index];
+    while (node->type == 0) {
+        float dist = vec3_dot(point, node->plane->normal) -
+                node->plane->offset;
+        node = dist >= 0.0f ? node->front : node->back;
+    }
+
+    return ((const bsp_leaf_t *)node)->id;
+}
+
+/**
+ * Fills \p queries with points inside the world's bounds. If \p coherent is
+ * set, each point is a short random step from the last, clamped to the
+ * bounds; otherwise the points are independent.
+ */
+void bspleaf_make_points(const bsp_t *bsp, bool coherent,
+        bspleaf_queries_t *queries)
+{
+    const bsp_node_t *root = &bsp->nodes[bsp->models[0].bsp_index];
+    vec3_t *points = queries->points;
+    for (size_t i = 0; i < queries->count; i++) {
+        for (int k = 0; k < 3; k++) {
+            float min = root->mins[k], max = root->maxs[k];
+            if (!coherent || i == 0) {
+                points[i][k] = bspleaf_random(min, max);
+                continue;
+            }
+
+            float next = points[i - 1][k] +
+                    bspleaf_random(-BSPLEAF_STEP_LENGTH, BSPLEAF_STEP_LENGTH);
+            points[i][k] = next < min ? min : next > max ? max : next;
+        }
+
+        queries->x[i] = points[i][0];
+        queries->y[i] = points[i][1];
+        queries->z[i] = points[i][2];
+    }
+}
+
+/**
+ * Keeps the shorter of \p best and the time since \p t0, counting \p best
+ * as unset on the first run.
+ */
+double bspleaf_best(double best, double t0, int run)
+{
+    double t = bspleaf_now() - t0;
+    return run == 0 || t < best ? t : best;
+}
+
+/**
+ * Counts the points of \p queries on which \p a and \p b differ, printing
+ * the first such point.
+ */
+size_t bspleaf_compare(const char *name, const bspleaf_queries_t *queries,
+        const char *a_name, const int *a, const char *b_name, const int *b)
+{
+    size_t mismatches = 0;
+    for (size_t i = 0; i < queries->count; i++) {
+        if (a[i] != b[i]) {
+            if (mismatches == 0) {
+                const float *point = queries->points[i];
+                fprintf(stderr, "%s point %zu (%g %g %g): %s gave %d, %s "
+                        "gave %d\n", name, i, point[0], point[1], point[2],
+                        a_name, a[i], b_name, b[i]);
+            }
+            mismatches += 1;
+        }
+    }
+
+    return mismatches;
+}
+
+/**
+ * Looks up the points of \p queries with BSP.findLeaf, the linked walk and
+ * BSP.findLeaves, keeping the best of BSPLEAF_RUNS runs of each, and prints
+ * their times per lookup.
+ * @return The number of results on which the lookups disagree
+ */
+size_t bspleaf_run(const bsp_t *bsp, const char *name,
+        bspleaf_queries_t *queries)
+{
+    size_t count = queries->count;
+    const vec3_t *points = (const vec3_t *)queries->points;
+    double compact_best = 0.0, linked_best = 0.0, batch_best = 0.0;
+    for (int run = 0; run < BSPLEAF_RUNS; run++) {
+        double t0 = bspleaf_now();
+        for (size_t i = 0; i < count; i++) {
+            queries->compact[i] = BSP.findLeaf(bsp, points[i]);
+        }
+        compact_best = bspleaf_best(compact_best, t0, run);
+
+        t0 = bspleaf_now();
+        for (size_t i = 0; i < count; i++) {
+            queries->linked[i] = bspleaf_linked(bsp, points[i]);
+        }
+        linked_best = bspleaf_best(linked_best, t0, run);
+
+        t0 = bspleaf_now();
+        BSP.findLeaves(bsp, queries->x, queries->y, queries->z, count,
+                queries->batch, NULL);
+        batch_best = bspleaf_best(batch_best, t0, run);
+    }
+
+    size_t mismatches = bspleaf_compare(name, queries, "findLeaf",
+            queries->compact, "linked walk", queries->linked);
+    mismatches += bspleaf_compare(name, queries, "findLeaf", queries->compact,
+            "findLeaves", queries->batch);
+
+    /* Contents are checked outside the timed runs, which look up leaves only */
+    BSP.findLeaves(bsp, queries->x, queries->y, queries->z, count,
+            queries->batch, queries->batch_contents);
+    for (size_t i = 0; i < count; i++) {
+        queries->point_contents[i] = BSP.pointContents(bsp, points[i]);
+    }
+    mismatches += bspleaf_compare(name, queries, "pointContents",
+            queries->point_contents, "findLeaves", queries->batch_contents);
+
+    printf("%-8s ns/lookup: %7.2f findLeaf, %7.2f linked, %7.2f findLeaves; "
+            "%zu mismatches\n", name, compact_best / count * 1e9,
+            linked_best / count * 1e9, batch_best / count * 1e9, mismatches);
+    return mismatches;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s [game-dir] [map] [query-count]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    long count = argc == 4 ? strtol(argv[3], NULL, 0) :
+            BSPLEAF_DEFAULT_COUNT;
+    if (count <= 0) {
+        Engine.fatal("Query count must be positive.\n");
+    }
+
+    File.addDirToPath(argv[1]);
+    bsp_t *bsp = BSP.load(argv[2]);
+    if (bsp == NULL) {
+        Engine.fatal("Couldn't load '%s'.\n", argv[2]);
+    }
+    if (bsp->node_count == 0 || bsp->model_count == 0) {
+        Engine.fatal("'%s' has no world tree.\n", argv[2]);
+    }
+
+    bspleaf_queries_t queries = {
+        .count = count,
+        .points = malloc(count * sizeof *queries.points),
+        .x = malloc(count * sizeof *queries.x),
+        .y = malloc(count * sizeof *queries.y),
+        .z = malloc(count * sizeof *queries.z),
+        .compact = malloc(count * sizeof *queries.compact),
+        .linked = malloc(count * sizeof *queries.linked),
+        .batch = malloc(count * sizeof *queries.batch),
+        .point_contents = malloc(count * sizeof *queries.point_contents),
+        .batch_contents = malloc(count * sizeof *queries.batch_contents),
+    };
+    if (queries.points == NULL || queries.x == NULL || queries.y == NULL ||
+            queries.z == NULL || queries.compact == NULL ||
+            queries.linked == NULL || queries.batch == NULL ||
+            queries.point_contents == NULL ||
+            queries.batch_contents == NULL) {
+        Engine.fatal("Couldn't allocate %ld queries.\n", count);
+    }
+
+    printf("%d nodes, %d leaves, depth %d, %s build\n", bsp->node_count,
+            bsp->leaf_count, bsp->max_depth, BSPLEAF_BUILD);
+
+    srand(1);
+    size_t mismatches = 0;
+    bspleaf_make_points(bsp, true, &queries);
+    mismatches += bspleaf_run(bsp, "coherent", &queries);
+    bspleaf_make_points(bsp, false, &queries);
+    mismatches += bspleaf_run(bsp, "random", &queries);
+
+    free(queries.batch_contents);
+    free(queries.point_contents);
+    free(queries.batch);
+    free(queries.linked);
+    free(queries.compact);
+    free(queries.z);
+    free(queries.y);
+    free(queries.x);
+    free(queries.points);
+    BSP.free(bsp);
+    File.shutdown();
+    exit(mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
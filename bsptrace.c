@@ -0,0 +1,151 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file bsptrace.c
+ *
+ * Measures trace throughput against a map's world hulls. Traces start at
+ * random open points inside the map's extent and run in random directions,
+ * either a tick's worth of movement or the length of a hitscan shot. Each set
+ * is run one trace at a time and then as one batch, and the traces per second
+ * of both are reported for every hull.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bsp.h"
+#include "engine.h"
+#include "file.h"
+#include "hull.h"
+
+#define BSPTRACE_DEFAULT_COUNT (100000)
+#define BSPTRACE_EXTENT        (4096.0f)
+#define BSPTRACE_MOVE_LENGTH   (64.0f)
+#define BSPTRACE_SHOT_LENGTH   (2048.0f)
+#define BSPTRACE_MAX_TRIES     (64)
+
+double bsptrace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+float bsptrace_random(float scale)
+{
+    return ((float)rand() / RAND_MAX * 2.0f - 1.0f) * scale;
+}
+
+/**
+ * Fills \p queries with \p count traces through hull \p hull of the world of
+ * \p bsp, each at most \p length units long. Starts are kept out of solid
+ * space where possible, as a moving entity's would be.
+ */
+void bsptrace_make_queries(const bsp_t *bsp, int hull, float length,
+        hull_query_t *queries, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        hull_query_t *query = &queries[i];
+        query->model = 0;
+        query->hull = hull;
+
+        for (int tries = 0; tries < BSPTRACE_MAX_TRIES; tries++) {
+            for (int k = 0; k < 3; k++) {
+                query->start[k] = bsptrace_random(BSPTRACE_EXTENT);
+            }
+            if (Hull.pointContents(bsp, 0, hull, query->start) !=
+                    BSP_LEAF_SOLID) {
+                break;
+            }
+        }
+
+        for (int k = 0; k < 3; k++) {
+            query->end[k] = query->start[k] + bsptrace_random(length);
+        }
+    }
+}
+
+/**
+ * Runs \p queries singly and as a batch and prints the rates of both.
+ */
+void bsptrace_run(const bsp_t *bsp, const char *name,
+        const hull_query_t *queries, size_t count, hull_trace_t *traces)
+{
+    double t0 = bsptrace_now();
+    for (size_t i = 0; i < count; i++) {
+        Hull.trace(bsp, queries[i].model, queries[i].hull, queries[i].start,
+                queries[i].end, &traces[i]);
+    }
+    double single = bsptrace_now() - t0;
+
+    t0 = bsptrace_now();
+    Hull.traceBatch(bsp, queries, count, traces);
+    double batch = bsptrace_now() - t0;
+
+    size_t hits = 0, startsolid = 0;
+    for (size_t i = 0; i < count; i++) {
+        hits += traces[i].fraction < 1.0f;
+        startsolid += traces[i].startsolid;
+    }
+
+    printf("hull %d %-5s %8.2f Mtraces/s single, %8.2f Mtraces/s batch "
+            "(%.1f%% hit, %.1f%% start solid)\n", queries[0].hull, name,
+            single > 0.0 ? count / single * 1e-6 : 0.0,
+            batch > 0.0 ? count / batch * 1e-6 : 0.0,
+            100.0 * hits / count, 100.0 * startsolid / count);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s [game-dir] [map] [trace-count]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    long count = argc == 4 ? strtol(argv[3], NULL, 0) :
+            BSPTRACE_DEFAULT_COUNT;
+    if (count <= 0) {
+        Engine.fatal("Trace count must be positive.\n");
+    }
+
+    File.addDirToPath(argv[1]);
+    bsp_t *bsp = BSP.load(argv[2]);
+    if (bsp == NULL) {
+        Engine.fatal("Couldn't load '%s'.\n", argv[2]);
+    }
+
+    hull_query_t *queries = malloc(count * sizeof *queries);
+    hull_trace_t *traces = malloc(count * sizeof *traces);
+    if (queries == NULL || traces == NULL) {
+        Engine.fatal("Couldn't allocate %ld traces.\n", count);
+    }
+
+    srand(1);
+    for (int hull = 0; hull < HULL_COUNT; hull++) {
+        bsptrace_make_queries(bsp, hull, BSPTRACE_MOVE_LENGTH, queries, count);
+        bsptrace_run(bsp, "move", queries, count, traces);
+        bsptrace_make_queries(bsp, hull, BSPTRACE_SHOT_LENGTH, queries, count);
+        bsptrace_run(bsp, "shot", queries, count, traces);
+    }
+
+    free(traces);
+    free(queries);
+    BSP.free(bsp);
+    File.shutdown();
+    exit(EXIT_SUCCESS);
+}
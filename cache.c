@@ -0,0 +1,376 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file cache.c
+ *
+ * A cache of loaded assets, keyed by asset type and the content hash of the
+ * file the asset is loaded from. Every path that resolves to one file, or to
+ * files with identical contents, shares one copy of the asset, and a path that
+ * resolves to a different file once the search path changes loads that file
+ * rather than returning the old asset. Each acquisition of an asset returns a
+ * reference-counted handle. Assets with no outstanding
+ * handles stay loaded in least-recently-released order, and the oldest are
+ * freed whenever the cache grows past its budget. The budget is the cvar
+ * cache_budget in MiB, or CACHE_DEFAULT_BUDGET if that is unset.
+ *
+ * Keys are found with File.contentHash, which keeps only the hash, and
+ * loaders read the files they keep with File.copyFile, so the file system
+ * holds nothing for a cached asset and the budget bounds all of the memory
+ * the unreferenced assets take.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "cvar.h"
+#include "engine.h"
+#include "file.h"
+#include "trace.h"
+
+#define CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+#define CACHE_MAX_PATH_LEN   (128)
+
+typedef struct cache_entry_s {
+    const cache_loader_t *loader;
+
+    /** The content hash of the file the asset was loaded from. */
+    uint64_t key;
+    uint32_t hash;
+
+    /** The path the asset was first loaded through, for messages. */
+    char     path[CACHE_MAX_PATH_LEN];
+
+    void    *asset;
+    size_t   size;
+
+    /** The number of handles to this entry that have not been released. */
+    size_t   refs;
+
+    /** The next entry in the same bucket. */
+    struct cache_entry_s *next;
+
+    /**
+     * Neighbours in the LRU list while \p refs is zero, with \p newer toward
+     * the most recently released entry.
+     */
+    struct cache_entry_s *older;
+    struct cache_entry_s *newer;
+} cache_entry_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cache_entry_t **cache_buckets = NULL;
+static size_t cache_bucket_mask = 0;
+static size_t cache_count = 0;
+
+/** The total size in bytes of every cached asset. */
+static size_t cache_bytes = 0;
+
+/** The ends of the LRU list of unreferenced entries. */
+static cache_entry_t *cache_oldest = NULL;
+static cache_entry_t *cache_newest = NULL;
+
+/** Returns the budget in bytes for unreferenced assets. */
+size_t cache_budget()
+{
+    float mib = Cvar.getNumber("cache_budget");
+    if (mib <= 0.0f) {
+        return CACHE_DEFAULT_BUDGET;
+    }
+
+    return (size_t)(mib * 1024.0f * 1024.0f);
+}
+
+/** Returns the bucket hash of \p key mixed with the loader it is cached for. */
+static inline uint32_t cache_hash(const cache_loader_t *loader, uint64_t key)
+{
+    return (uint32_t)(key ^ (key >> 32)) ^
+            (uint32_t)((uintptr_t)loader * 2654435761u);
+}
+
+/**
+ * Returns the entry for the file with content hash \p key loaded by
+ * \p loader, or NULL if there is none. Must be called with the lock held.
+ */
+cache_entry_t *cache_find(const cache_loader_t *loader, uint64_t key,
+        uint32_t hash)
+{
+    if (cache_buckets == NULL) {
+        return NULL;
+    }
+
+    cache_entry_t *entry = cache_buckets[hash & cache_bucket_mask];
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->loader == loader &&
+                entry->key == key) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Doubles the number of buckets and redistributes every entry. Must be called
+ * with the lock held.
+ */
+void cache_grow()
+{
+    size_t old_count = cache_buckets == NULL ? 0 : cache_bucket_mask + 1;
+    size_t count = old_count == 0 ? 64 : 2 * old_count;
+    cache_entry_t **buckets = calloc(count, sizeof *buckets);
+    if (buckets == NULL) {
+        Engine.fatal("Failed to allocate asset cache.\n");
+    }
+
+    for (size_t i = 0; i < old_count; i++) {
+        cache_entry_t *entry = cache_buckets[i];
+        while (entry != NULL) {
+            cache_entry_t *next = entry->next;
+            entry->next = buckets[entry->hash & (count - 1)];
+            buckets[entry->hash & (count - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(cache_buckets);
+    cache_buckets = buckets;
+    cache_bucket_mask = count - 1;
+}
+
+/** Removes \p entry from the LRU list. Must be called with the lock held. */
+void cache_unlink(cache_entry_t *entry)
+{
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache_oldest = entry->newer;
+    }
+
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        cache_newest = entry->older;
+    }
+
+    entry->older = NULL;
+    entry->newer = NULL;
+}
+
+/**
+ * Removes unreferenced entries from the cache, oldest first, until the cache
+ * holds no more than \p budget bytes or no unreferenced entries remain, and
+ * returns them as a list linked through \p newer. Must be called with the
+ * lock held; the returned assets are freed after it is dropped.
+ */
+cache_entry_t *cache_evict(size_t budget)
+{
+    cache_entry_t *evicted = NULL;
+    while (cache_bytes > budget && cache_oldest != NULL) {
+        cache_entry_t *entry = cache_oldest;
+        cache_unlink(entry);
+
+        cache_entry_t **link = &cache_buckets[entry->hash & cache_bucket_mask];
+        while (*link != entry) {
+            link = &(*link)->next;
+        }
+        *link = entry->next;
+
+        cache_bytes -= entry->size;
+        cache_count -= 1;
+        entry->newer = evicted;
+        evicted = entry;
+    }
+
+    return evicted;
+}
+
+/** Frees the assets in a list returned by cache_evict(). */
+void cache_free_evicted(cache_entry_t *evicted)
+{
+    while (evicted != NULL) {
+        cache_entry_t *next = evicted->newer;
+        evicted->loader->free(evicted->asset);
+        free(evicted);
+        evicted = next;
+    }
+}
+
+/**
+ * Returns a handle to the asset at \p path, loading it with \p loader if it
+ * is not already cached. The asset stays loaded at least until the handle is
+ * passed to cache_release(). Every request is traced, misses with the time
+ * taken to load the asset.
+ * @param loader The type of asset to be loaded
+ * @param path The path of the asset relative to the root of the search path
+ * @return A handle to the asset, or NULL if it could not be loaded
+ */
+cache_handle_t *cache_acquire(const cache_loader_t *loader, const char *path)
+{
+    uint64_t trace = Trace.begin();
+    uint64_t key;
+    if (!File.contentHash(path, &key)) {
+        Trace.end(trace, loader->trace_kind, path, "cache", 0, false);
+        return NULL;
+    }
+    uint32_t hash = cache_hash(loader, key);
+
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *entry = cache_find(loader, key, hash);
+    if (entry != NULL) {
+        if (entry->refs++ == 0) {
+            cache_unlink(entry);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        Trace.end(trace, loader->trace_kind, path, "cache", entry->size, true);
+        return entry;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    /* Load without the lock so that other assets can be served meanwhile */
+    size_t size = 0;
+    void *asset = loader->load(path, &size);
+    if (asset == NULL) {
+        Trace.end(trace, loader->trace_kind, path, "cache", 0, false);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+
+    /* Another thread may have loaded the same asset in the meantime */
+    entry = cache_find(loader, key, hash);
+    if (entry != NULL) {
+        if (entry->refs++ == 0) {
+            cache_unlink(entry);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        loader->free(asset);
+        Trace.end(trace, loader->trace_kind, path, "cache", entry->size,
+                false);
+        return entry;
+    }
+
+    entry = calloc(1, sizeof *entry);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        Engine.error("Failed to allocate cache entry for '%s'.\n", path);
+        loader->free(asset);
+        Trace.end(trace, loader->trace_kind, path, "cache", 0, false);
+        return NULL;
+    }
+
+    entry->loader = loader;
+    entry->key = key;
+    snprintf(entry->path, sizeof entry->path, "%s", path);
+    entry->hash = hash;
+    entry->asset = asset;
+    entry->size = size;
+    entry->refs = 1;
+
+    if (cache_buckets == NULL || cache_count + 1 > cache_bucket_mask + 1) {
+        cache_grow();
+    }
+    entry->next = cache_buckets[hash & cache_bucket_mask];
+    cache_buckets[hash & cache_bucket_mask] = entry;
+    cache_count += 1;
+    cache_bytes += size;
+
+    cache_entry_t *evicted = cache_evict(cache_budget());
+    pthread_mutex_unlock(&cache_lock);
+
+    cache_free_evicted(evicted);
+    Trace.end(trace, loader->trace_kind, path, "cache", size, false);
+    return entry;
+}
+
+/**
+ * Returns the asset referred to by \p handle.
+ */
+void *cache_get(const cache_handle_t *handle)
+{
+    return handle->asset;
+}
+
+/**
+ * Releases \p handle. Once an asset has no outstanding handles, it may be
+ * freed at any time to keep the cache within its budget.
+ */
+void cache_release(cache_handle_t *handle)
+{
+    if (handle == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (handle->refs == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        Engine.error("Asset '%s' released more times than acquired.\n",
+                handle->path);
+        return;
+    }
+
+    handle->refs -= 1;
+    if (handle->refs == 0) {
+        handle->older = cache_newest;
+        if (cache_newest != NULL) {
+            cache_newest->newer = handle;
+        } else {
+            cache_oldest = handle;
+        }
+        cache_newest = handle;
+    }
+
+    cache_entry_t *evicted = cache_evict(cache_budget());
+    pthread_mutex_unlock(&cache_lock);
+
+    cache_free_evicted(evicted);
+}
+
+/**
+ * Frees every asset that has no outstanding handles, regardless of budget.
+ */
+void cache_flush()
+{
+    pthread_mutex_lock(&cache_lock);
+    cache_entry_t *evicted = cache_evict(0);
+    pthread_mutex_unlock(&cache_lock);
+
+    cache_free_evicted(evicted);
+}
+
+/**
+ * Returns the total size in bytes of every cached asset, referenced or not.
+ */
+size_t cache_usage()
+{
+    pthread_mutex_lock(&cache_lock);
+    size_t bytes = cache_bytes;
+    pthread_mutex_unlock(&cache_lock);
+    return bytes;
+}
+
+const struct cache_namespace Cache = {
+    .acquire = cache_acquire,
+    .get = cache_get,
+    .release = cache_release,
+    .flush = cache_flush,
+    .usage = cache_usage
+};
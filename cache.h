@@ -0,0 +1,51 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+#include "trace.h"
+
+typedef struct cache_entry_s cache_handle_t;
+
+/**
+ * Describes how to load and free one type of asset. \p load returns the
+ * asset at a path and sets \p size to the number of bytes it occupies, or
+ * returns NULL on error. Any file data the asset keeps must be its own, read
+ * with File.copyFile, and counted in \p size, so that the cache's budget
+ * covers it and freeing the asset gives it back. \p free may be called on
+ * whichever thread acquires or releases an asset, so it must not need any
+ * particular thread.
+ */
+typedef struct {
+    const char  *name;
+    trace_kind_t trace_kind;
+    void *(*load)(const char *path, size_t *size);
+    void (*free)(void *asset);
+} cache_loader_t;
+
+extern const struct cache_namespace {
+    cache_handle_t *(* const acquire)(const cache_loader_t *loader,
+            const char *path);
+    void *(* const get)(const cache_handle_t *handle);
+    void (* const release)(cache_handle_t *handle);
+    void (* const flush)();
+    size_t (* const usage)();
+} Cache;
+
+#endif
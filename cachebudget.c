@@ -0,0 +1,164 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file cachebudget.c
+ *
+ * Checks that the asset cache keeps memory within its budget. Every map that
+ * matches a pattern is acquired through the cache and released again, one
+ * after another, so that once the maps add up to more than the budget each
+ * release evicts older ones. After every release, the cache's usage must be
+ * within the budget, and the anonymous memory of the process must not have
+ * grown since the maps were mounted by more than the budget plus
+ * CACHEBUDGET_SLACK. File data kept anywhere but in the cached assets shows
+ * up as growth the budget doesn't cover.
+ *
+ * The maps should add up to several times the budget, or nothing is evicted.
+ */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsp.h"
+#include "cache.h"
+#include "cvar.h"
+#include "engine.h"
+#include "file.h"
+
+#define CACHEBUDGET_DEFAULT_PATTERN "maps/*.bsp"
+#define CACHEBUDGET_PASSES          (2)
+
+/* Room for the allocator's own overhead and fragmentation, in kilobytes */
+#define CACHEBUDGET_SLACK           (8 * 1024)
+
+typedef struct {
+    char **paths;
+    size_t path_count;
+    size_t path_bytes;
+} cachebudget_t;
+
+void cachebudget_add_path(const char *path, size_t size, void *ctx)
+{
+    cachebudget_t *maps = ctx;
+    maps->paths[maps->path_count] = strdup(path);
+    if (maps->paths[maps->path_count] == NULL) {
+        Engine.fatal("Couldn't allocate path '%s'.\n", path);
+    }
+    maps->path_count += 1;
+    maps->path_bytes += size;
+}
+
+/**
+ * Returns the anonymous resident memory of this process in kilobytes, which
+ * leaves out pages of mapped files, or 0 if it can't be read.
+ */
+size_t cachebudget_anon()
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    char line[256];
+    size_t kb = 0;
+    while (fgets(line, sizeof line, fp) != NULL) {
+        if (sscanf(line, "RssAnon: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+
+    return kb;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s [game-dir] [budget-MiB] [pattern]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * Keep large blocks in mappings of their own, so that freeing an asset
+     * gives its memory back to the system rather than leaving it in the heap.
+     */
+    mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+
+    Cvar.addNumber("cache_budget", strtof(argv[2], NULL), false);
+    const char *pattern = argc == 4 ? argv[3] : CACHEBUDGET_DEFAULT_PATTERN;
+
+    File.addDirToPath(argv[1]);
+    size_t count = File.list(pattern, NULL, NULL);
+    if (count == 0) {
+        Engine.fatal("No files match '%s' in '%s'.\n", pattern, argv[1]);
+    }
+
+    cachebudget_t maps = { .paths = calloc(count, sizeof *maps.paths) };
+    if (maps.paths == NULL) {
+        Engine.fatal("Couldn't allocate %zu paths.\n", count);
+    }
+    File.list(pattern, cachebudget_add_path, &maps);
+
+    size_t budget = Cvar.getNumber("cache_budget") * 1024.0f * 1024.0f;
+    size_t limit = budget / 1024 + CACHEBUDGET_SLACK;
+    size_t base = cachebudget_anon();
+    size_t max_usage = 0;
+    size_t max_growth = 0;
+    size_t failures = 0;
+
+    for (int pass = 0; pass < CACHEBUDGET_PASSES; pass++) {
+        for (size_t i = 0; i < maps.path_count; i++) {
+            cache_handle_t *handle = BSP.acquire(maps.paths[i]);
+            if (handle == NULL) {
+                Engine.error("Couldn't load '%s'.\n", maps.paths[i]);
+                failures += 1;
+                continue;
+            }
+            Cache.release(handle);
+
+            size_t usage = Cache.usage();
+            size_t anon = cachebudget_anon();
+            size_t growth = anon > base ? anon - base : 0;
+            if (usage > budget || growth > limit) {
+                fprintf(stderr, "over budget after '%s': cache %zu kB, "
+                        "growth %zu kB\n", maps.paths[i], usage / 1024,
+                        growth);
+                failures += 1;
+            }
+
+            max_usage = usage > max_usage ? usage : max_usage;
+            max_growth = growth > max_growth ? growth : max_growth;
+        }
+    }
+
+    fprintf(stderr, "%zu maps (%zu kB) loaded %d times, budget %zu kB\n",
+            maps.path_count, maps.path_bytes / 1024, CACHEBUDGET_PASSES,
+            budget / 1024);
+    fprintf(stderr, "peak cache usage %zu kB, peak growth %zu kB (limit %zu "
+            "kB)\n", max_usage / 1024, max_growth, limit);
+    fprintf(stderr, "%zu failures\n", failures);
+
+    Cache.flush();
+    for (size_t i = 0; i < maps.path_count; i++) {
+        free(maps.paths[i]);
+    }
+    free(maps.paths);
+    File.shutdown();
+
+    exit(failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -45,7 +45,6 @@ const cvar_t *cvar_find(const char *name)
 {
     for (cvar_t *var = cvars; var != NULL; var = var->next) {
         if (strcmp(name, var->name) == 0) {
-            printf("Found %s.\n", name);
             return var;
         }
     }
@@ -76,14 +75,14 @@ void cvar_add_string(const char *name, const char *val, bool save)
      * Copy cvar name
      */
     cvar_t *new_cvar = calloc(1, sizeof *new_cvar);
-    new_cvar->name = calloc(strlen(name), sizeof *new_cvar->name);
+    new_cvar->name = calloc(strlen(name) + 1, sizeof *new_cvar->name);
     strcpy(new_cvar->name, name);
 
     /*
      * Copy value
      */
     new_cvar->value_type = STRING;
-    new_cvar->value.string = calloc(strlen(val), sizeof *new_cvar->value.string);
+    new_cvar->value.string = calloc(strlen(val) + 1, sizeof *new_cvar->value.string);
     strcpy(new_cvar->value.string, val);
 
     new_cvar->save = save;
@@ -113,7 +112,7 @@ void cvar_add_number(const char *name, float val, bool save)
      * Copy cvar name
      */
     cvar_t *new_cvar = calloc(1, sizeof *new_cvar);
-    new_cvar->name = calloc(strlen(name), sizeof *new_cvar->name);
+    new_cvar->name = calloc(strlen(name) + 1, sizeof *new_cvar->name);
     strcpy(new_cvar->name, name);
 
     /*
@@ -135,7 +134,7 @@ const char *cvar_get_string(const char *name)
 {
     const cvar_t *var = cvar_find(name);
 
-    if (var->value_type == STRING) {
+    if (var != NULL && var->value_type == STRING) {
         return var->value.string;
     }
 
@@ -146,7 +145,7 @@ float cvar_get_number(const char *name)
 {
     const cvar_t *var = cvar_find(name);
 
-    if (var->value_type == NUMBER) {
+    if (var != NULL && var->value_type == NUMBER) {
         return var->value.number;
     }
 
@@ -0,0 +1,384 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file derived.c
+ *
+ * An on-disk cache of what the engine derives from its assets, so that a
+ * later run can map the result instead of deriving it again.
+ *
+ * Each cached asset is one file in the directory named by the cvar
+ * derived_path, and the cache is off if that is not set. The file's name is
+ * made from the kind of asset, the content hash of its source and a variant
+ * for any settings that change what is derived, and its header repeats all of
+ * these along with DERIVED_VERSION. After the header comes a table of
+ * sections, each a flat block aligned for any type, and each with its own
+ * checksum. A file is checked against its key and every checksum when it is
+ * opened; one that fails is deleted so that it will be written again.
+ *
+ * Files are written under a unique temporary name and renamed into place, so a
+ * reader never sees one half written, even with several threads or runs saving
+ * the same asset at once.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cvar.h"
+#include "derived.h"
+#include "engine.h"
+#include "utils.h"
+
+#define DERIVED_MAGIC      "RDRV"
+#define DERIVED_BYTE_ORDER (0x01020304)
+
+/*
+ * Sections start on multiples of this many bytes from the start of the file,
+ * which mmap() places on a page boundary.
+ */
+#define DERIVED_ALIGN (64)
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+
+    /*
+     * DERIVED_BYTE_ORDER as written by the machine that made the file, so
+     * that a cache shared with a machine of the other byte order is rejected.
+     */
+    uint32_t byte_order;
+    uint32_t section_count;
+    char kind[DERIVED_MAX_KIND + 1];
+    uint64_t hash;
+    uint64_t variant;
+
+    /*
+     * The size of the whole file, and the checksum of its section table.
+     */
+    uint64_t size;
+    uint64_t table_checksum;
+} derived_header_t;
+
+_Static_assert(sizeof (derived_header_t) == 64,
+        "derived_header_t must be 64 bytes");
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+} derived_entry_t;
+
+struct derived_s {
+    const uint8_t *base;
+    size_t size;
+    int section_count;
+    const derived_entry_t *entries;
+};
+
+/**
+ * Writes the path of the cache file for the given key into \p path, which is
+ * \p size bytes long.
+ * @return False if the cache is off or the key is unusable
+ */
+static bool derived_path(char *path, size_t size, const char *kind,
+        uint64_t hash, uint64_t variant)
+{
+    const char *dir = Cvar.getString("derived_path");
+    if (dir == NULL || dir[0] == '\0') {
+        return false;
+    }
+
+    if (strlen(kind) > DERIVED_MAX_KIND) {
+        Engine.error("Derived asset kind '%s' is too long.\n", kind);
+        return false;
+    }
+
+    int length = snprintf(path, size, "%s/%s-%016llx-%016llx.drv", dir, kind,
+            (unsigned long long)hash, (unsigned long long)variant);
+    return length > 0 && (size_t)length < size;
+}
+
+static inline uint64_t derived_align(uint64_t offset)
+{
+    return (offset + DERIVED_ALIGN - 1) & ~(uint64_t)(DERIVED_ALIGN - 1);
+}
+
+/**
+ * Checks the \p size bytes of the cache file at \p base against the key it was
+ * opened with.
+ * @return The file's section table, or NULL if the file is stale or damaged
+ */
+static const derived_entry_t *derived_validate(const uint8_t *base,
+        size_t size, const char *kind, uint64_t hash, uint64_t variant,
+        int section_count)
+{
+    const derived_header_t *header = (const derived_header_t *)base;
+    if (size < sizeof *header ||
+            memcmp(header->magic, DERIVED_MAGIC, sizeof header->magic) != 0 ||
+            header->version != DERIVED_VERSION ||
+            header->byte_order != DERIVED_BYTE_ORDER ||
+            strncmp(header->kind, kind, sizeof header->kind) != 0 ||
+            header->hash != hash || header->variant != variant ||
+            header->size != size ||
+            header->section_count != (uint32_t)section_count) {
+        return NULL;
+    }
+
+    size_t table_size = section_count * sizeof (derived_entry_t);
+    if (size - sizeof *header < table_size) {
+        return NULL;
+    }
+
+    const derived_entry_t *entries =
+            (const derived_entry_t *)(base + sizeof *header);
+    if (Utils.hashData(entries, table_size) != header->table_checksum) {
+        return NULL;
+    }
+
+    for (int i = 0; i < section_count; i++) {
+        const derived_entry_t *entry = &entries[i];
+        if (entry->offset % DERIVED_ALIGN != 0 || entry->offset > size ||
+                entry->size > size - entry->offset ||
+                Utils.hashData(base + entry->offset, entry->size) !=
+                entry->checksum) {
+            return NULL;
+        }
+    }
+
+    return entries;
+}
+
+/**
+ * Opens the cached asset of kind \p kind derived from source data with the
+ * content hash \p hash, under the settings summed up by \p variant. The file
+ * is mapped read-only and checked in full before it is returned.
+ * @param kind The kind of asset, such as "bsp"
+ * @param hash The content hash of the data the asset was derived from
+ * @param variant A value that changes with any setting that changes what is
+ * derived, or 0
+ * @param section_count The number of sections the asset must have
+ * @return The cached asset, or NULL if there is none or the cache is off
+ */
+derived_t *derived_open(const char *kind, uint64_t hash, uint64_t variant,
+        int section_count)
+{
+    char path[PATH_MAX];
+    if (!derived_path(path, sizeof path, kind, hash, variant)) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    /* The mapping holds its own reference to the file */
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        Engine.error("Failed to map derived asset '%s'.\n", path);
+        return NULL;
+    }
+
+    const derived_entry_t *entries = derived_validate(base, st.st_size, kind,
+            hash, variant, section_count);
+    if (entries == NULL) {
+        Engine.error("Discarding stale derived asset '%s'.\n", path);
+        munmap(base, st.st_size);
+        unlink(path);
+        return NULL;
+    }
+
+    derived_t *derived = malloc(sizeof *derived);
+    if (derived == NULL) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    derived->base = base;
+    derived->size = st.st_size;
+    derived->section_count = section_count;
+    derived->entries = entries;
+    return derived;
+}
+
+/**
+ * Writes \p fp out to \p offset with zeros, from where it is at \p position.
+ * @return False on a write error
+ */
+static bool derived_pad(FILE *fp, uint64_t position, uint64_t offset)
+{
+    static const uint8_t zeros[DERIVED_ALIGN];
+    return fwrite(zeros, 1, offset - position, fp) == offset - position;
+}
+
+/**
+ * Saves an asset to the cache under the key it will later be opened with. An
+ * asset already cached under the same key is replaced.
+ * @param kind The kind of asset, such as "bsp"
+ * @param hash The content hash of the data the asset was derived from
+ * @param variant A value that changes with any setting that changes what is
+ * derived, or 0
+ * @param sections The sections of the asset, in order
+ * @param section_count The number of sections in \p sections
+ * @return True if the asset was saved, false if the cache is off or on error
+ */
+bool derived_save(const char *kind, uint64_t hash, uint64_t variant,
+        const derived_section_t *sections, int section_count)
+{
+    char path[PATH_MAX];
+    char temp[PATH_MAX + 8];
+    if (!derived_path(path, sizeof path, kind, hash, variant)) {
+        return false;
+    }
+    snprintf(temp, sizeof temp, "%s.XXXXXX", path);
+
+    derived_entry_t *entries = calloc(section_count, sizeof *entries);
+    if (entries == NULL) {
+        return false;
+    }
+
+    uint64_t offset = derived_align(sizeof (derived_header_t) +
+            section_count * sizeof *entries);
+    for (int i = 0; i < section_count; i++) {
+        entries[i].offset = offset;
+        entries[i].size = sections[i].size;
+        entries[i].checksum = Utils.hashData(sections[i].data,
+                sections[i].size);
+        offset = derived_align(offset + sections[i].size);
+    }
+
+    derived_header_t header = {
+        .magic = DERIVED_MAGIC,
+        .version = DERIVED_VERSION,
+        .byte_order = DERIVED_BYTE_ORDER,
+        .section_count = section_count,
+        .hash = hash,
+        .variant = variant,
+        .size = section_count > 0 ? entries[section_count - 1].offset +
+                entries[section_count - 1].size : offset,
+        .table_checksum = Utils.hashData(entries,
+                section_count * sizeof *entries)
+    };
+    strncpy(header.kind, kind, DERIVED_MAX_KIND);
+
+    /* The directory may not exist yet; if it can't, mkstemp() says so */
+    const char *dir = Cvar.getString("derived_path");
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        Engine.error("Couldn't create '%s'.\n", dir);
+    }
+
+    /* A unique name, so that threads saving the same key don't collide */
+    int fd = mkstemp(temp);
+    if (fd == -1) {
+        Engine.error("Couldn't write derived asset '%s'.\n", path);
+        free(entries);
+        return false;
+    }
+
+    /* mkstemp() makes the file private, which the other files aren't */
+    fchmod(fd, 0644);
+
+    FILE *fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        Engine.error("Couldn't write derived asset '%s'.\n", path);
+        close(fd);
+        unlink(temp);
+        free(entries);
+        return false;
+    }
+
+    uint64_t position = sizeof header + section_count * sizeof *entries;
+    bool ok = fwrite(&header, sizeof header, 1, fp) == 1 &&
+            fwrite(entries, sizeof *entries, section_count, fp) ==
+            (size_t)section_count;
+    for (int i = 0; ok && i < section_count; i++) {
+        ok = derived_pad(fp, position, entries[i].offset) &&
+                (sections[i].size == 0 ||
+                fwrite(sections[i].data, 1, sections[i].size, fp) ==
+                sections[i].size);
+        position = entries[i].offset + sections[i].size;
+    }
+    free(entries);
+
+    if (fclose(fp) != 0 || !ok || rename(temp, path) != 0) {
+        Engine.error("Couldn't write derived asset '%s'.\n", path);
+        unlink(temp);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Returns section \p index of \p derived and sets \p size to its size in
+ * bytes. The section is aligned for any type and stays mapped until
+ * \p derived is closed.
+ */
+const void *derived_section(const derived_t *derived, int index, size_t *size)
+{
+    if (index < 0 || index >= derived->section_count) {
+        *size = 0;
+        return NULL;
+    }
+
+    *size = derived->entries[index].size;
+    return derived->base + derived->entries[index].offset;
+}
+
+/**
+ * Returns the number of bytes of \p derived that are mapped.
+ */
+size_t derived_size(const derived_t *derived)
+{
+    return derived->size;
+}
+
+void derived_close(derived_t *derived)
+{
+    if (derived == NULL) {
+        return;
+    }
+
+    munmap((void *)derived->base, derived->size);
+    free(derived);
+}
+
+const struct derived_namespace Derived = {
+    .open = derived_open,
+    .save = derived_save,
+    .section = derived_section,
+    .size = derived_size,
+    .close = derived_close
+};
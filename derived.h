@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef DERIVED_H
+#define DERIVED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The version of the engine's derived data. This is part of the key of every
+ * cached asset, so it must be bumped whenever the layout or meaning of
+ * anything that is cached changes.
+ */
+#define DERIVED_VERSION (1)
+
+/*
+ * The longest kind of asset, such as "bsp", that can be cached.
+ */
+#define DERIVED_MAX_KIND (15)
+
+typedef struct derived_s derived_t;
+
+/*
+ * One flat block of a cached asset. Sections must not hold pointers: anything
+ * that refers to another part of the asset does so by index or offset, so the
+ * file can be mapped at any address and used as it is.
+ */
+typedef struct {
+    const void *data;
+    size_t size;
+} derived_section_t;
+
+extern const struct derived_namespace {
+    derived_t *(* const open)(const char *kind, uint64_t hash,
+            uint64_t variant, int section_count);
+    bool (* const save)(const char *kind, uint64_t hash, uint64_t variant,
+            const derived_section_t *sections, int section_count);
+    const void *(* const section)(const derived_t *derived, int index,
+            size_t *size);
+    size_t (* const size)(const derived_t *derived);
+    void (* const close)(derived_t *derived);
+} Derived;
+
+#endif
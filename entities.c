@@ -0,0 +1,512 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file entities.c
+ *
+ * Parses the text of a map's entities, a list of brace-enclosed blocks of
+ * quoted key/value pairs:
+ *
+ *     {
+ *     "classname" "light"
+ *     "origin" "128 -64 32"
+ *     }
+ *
+ * The text is read once, front to back, and nothing in it is copied: every key
+ * and value is a view of the text, which must outlive the parsed entities.
+ * All the pairs of all the entities share one array, and the entities another,
+ * so parsing a map costs a handful of allocations however many entities it
+ * has. Entities are then indexed by classname and by targetname in a hash
+ * table whose buckets each hold a run of one array of entity indices.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "entities.h"
+#include "utils.h"
+
+enum {
+    ENTITIES_TOKEN_END,
+    ENTITIES_TOKEN_STRING,
+    ENTITIES_TOKEN_OPEN,
+    ENTITIES_TOKEN_CLOSE,
+    ENTITIES_TOKEN_ERROR
+};
+
+typedef struct {
+    const char *start;
+    const char *p;
+    const char *end;
+} entities_lexer_t;
+
+/*
+ * The entities whose field has a given value are the count indices starting
+ * at first in the index's list array. A bucket is empty if its name is NULL.
+ */
+typedef struct {
+    entity_string_t name;
+    uint32_t hash;
+    int field;
+    int first;
+    int count;
+} entities_bucket_t;
+
+struct entities_s {
+    int entity_count;
+    int entity_capacity;
+    entity_t *entities;
+
+    int pair_count;
+    int pair_capacity;
+    entity_pair_t *pairs;
+
+    /*
+     * bucket_count is a power of two, or 0 if no entity has a classname or a
+     * targetname.
+     */
+    size_t bucket_count;
+    entities_bucket_t *buckets;
+    int *lists;
+    int list_count;
+};
+
+/**
+ * Returns the line of the text being read by \p lexer that \p p is on, for
+ * error messages.
+ */
+static int entities_line(const entities_lexer_t *lexer, const char *p)
+{
+    int line = 1;
+    for (const char *c = lexer->start; c < p; c++) {
+        line += *c == '\n';
+    }
+
+    return line;
+}
+
+/**
+ * Reads the next token from \p lexer. Quake's tokenizer rules are followed:
+ * anything up to a space is whitespace, comments run from // to the end of the
+ * line, and a null character ends the text.
+ * @param lexer The lexer to read from
+ * @param token Set to the text of the token if it is a string
+ * @return One of the ENTITIES_TOKEN_* values
+ */
+static int entities_next(entities_lexer_t *lexer, entity_string_t *token)
+{
+    const char *p = lexer->p;
+    const char *end = lexer->end;
+
+    for (;;) {
+        while (p < end && *p != '\0' && (unsigned char)*p <= ' ') {
+            p++;
+        }
+        if (end - p >= 2 && p[0] == '/' && p[1] == '/') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+            continue;
+        }
+        break;
+    }
+
+    if (p == end || *p == '\0') {
+        lexer->p = p;
+        return ENTITIES_TOKEN_END;
+    }
+
+    if (*p == '{' || *p == '}') {
+        lexer->p = p + 1;
+        return *p == '{' ? ENTITIES_TOKEN_OPEN : ENTITIES_TOKEN_CLOSE;
+    }
+
+    if (*p == '"') {
+        const char *close = memchr(p + 1, '"', end - (p + 1));
+        if (close == NULL) {
+            Engine.error("Unterminated string on line %d of entities.\n",
+                    entities_line(lexer, p));
+            return ENTITIES_TOKEN_ERROR;
+        }
+
+        token->data = p + 1;
+        token->length = close - (p + 1);
+        lexer->p = close + 1;
+        return ENTITIES_TOKEN_STRING;
+    }
+
+    const char *word = p;
+    while (p < end && (unsigned char)*p > ' ' && *p != '{' && *p != '}' &&
+            *p != '"') {
+        p++;
+    }
+
+    token->data = word;
+    token->length = p - word;
+    lexer->p = p;
+    return ENTITIES_TOKEN_STRING;
+}
+
+/**
+ * Makes room for at least one more element of \p size bytes in the array at
+ * \p array, which holds \p count of \p capacity elements, doubling it if it
+ * is full.
+ * @return False if memory runs out
+ */
+static bool entities_reserve(void **array, int *capacity, int count,
+        size_t size)
+{
+    if (count < *capacity) {
+        return true;
+    }
+
+    int new_capacity = *capacity > 0 ? 2 * *capacity : 64;
+    void *grown = realloc(*array, new_capacity * size);
+    if (grown == NULL) {
+        return false;
+    }
+
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+static inline bool entities_equal(entity_string_t a, const char *b,
+        size_t length)
+{
+    return a.length == length && memcmp(a.data, b, length) == 0;
+}
+
+static inline uint32_t entities_hash(int field, const char *name,
+        size_t length)
+{
+    return Utils.hashString(name, length) + (uint32_t)field * 0x9e3779b9u;
+}
+
+/**
+ * Returns the bucket of \p entities for the entities whose field \p field is
+ * \p name, of \p length characters. If there is none, it is created when
+ * \p insert is true and NULL is returned otherwise.
+ */
+static entities_bucket_t *entities_bucket(entities_t *entities, int field,
+        const char *name, size_t length, bool insert)
+{
+    if (entities->bucket_count == 0) {
+        return NULL;
+    }
+
+    uint32_t hash = entities_hash(field, name, length);
+    size_t mask = entities->bucket_count - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        entities_bucket_t *bucket = &entities->buckets[i];
+        if (bucket->name.data == NULL) {
+            if (!insert) {
+                return NULL;
+            }
+
+            bucket->name.data = name;
+            bucket->name.length = length;
+            bucket->hash = hash;
+            bucket->field = field;
+            return bucket;
+        }
+
+        if (bucket->hash == hash && bucket->field == field &&
+                entities_equal(bucket->name, name, length)) {
+            return bucket;
+        }
+    }
+}
+
+/**
+ * Returns the field \p field of \p entity, as stored by the entity.
+ */
+static inline entity_string_t entities_field(const entity_t *entity,
+        int field)
+{
+    return field == ENTITIES_CLASSNAME ? entity->classname :
+            entity->targetname;
+}
+
+/**
+ * Indexes the entities of \p entities by classname and targetname. The
+ * buckets are counted first so that each one's entities can be laid out
+ * contiguously in the list array, in the order they appear in the text.
+ * @return False if memory runs out
+ */
+static bool entities_build_index(entities_t *entities)
+{
+    int named = 0;
+    for (int i = 0; i < entities->entity_count; i++) {
+        for (int field = 0; field < ENTITIES_FIELDS; field++) {
+            named += entities_field(&entities->entities[i], field).length > 0;
+        }
+    }
+
+    if (named == 0) {
+        return true;
+    }
+
+    /* Keep the table at most half full so probes stay short */
+    size_t bucket_count = 16;
+    while (bucket_count < 2 * (size_t)named) {
+        bucket_count *= 2;
+    }
+
+    entities->buckets = calloc(bucket_count, sizeof *entities->buckets);
+    entities->lists = malloc(named * sizeof *entities->lists);
+    if (entities->buckets == NULL || entities->lists == NULL) {
+        return false;
+    }
+    entities->bucket_count = bucket_count;
+    entities->list_count = named;
+
+    for (int i = 0; i < entities->entity_count; i++) {
+        for (int field = 0; field < ENTITIES_FIELDS; field++) {
+            entity_string_t name = entities_field(&entities->entities[i],
+                    field);
+            if (name.length > 0) {
+                entities_bucket(entities, field, name.data, name.length,
+                        true)->count += 1;
+            }
+        }
+    }
+
+    int first = 0;
+    for (size_t i = 0; i < bucket_count; i++) {
+        entities->buckets[i].first = first;
+        first += entities->buckets[i].count;
+        entities->buckets[i].count = 0;
+    }
+
+    for (int i = 0; i < entities->entity_count; i++) {
+        for (int field = 0; field < ENTITIES_FIELDS; field++) {
+            entity_string_t name = entities_field(&entities->entities[i],
+                    field);
+            if (name.length > 0) {
+                entities_bucket_t *bucket = entities_bucket(entities, field,
+                        name.data, name.length, false);
+                entities->lists[bucket->first + bucket->count++] = i;
+            }
+        }
+    }
+
+    return true;
+}
+
+void entities_free(entities_t *entities)
+{
+    if (entities == NULL) {
+        return;
+    }
+
+    free(entities->entities);
+    free(entities->pairs);
+    free(entities->buckets);
+    free(entities->lists);
+    free(entities);
+}
+
+/**
+ * Looks up the value of \p key in \p entity. If the key is given more than
+ * once, the last value wins, as it does when Quake spawns the entity.
+ * @param entity The entity to look in
+ * @param key The null-terminated key to look up
+ * @param value Set to the value of \p key if it is found
+ * @return Whether \p entity has the key \p key
+ */
+bool entities_value(const entity_t *entity, const char *key,
+        entity_string_t *value)
+{
+    size_t length = strlen(key);
+    for (int i = entity->pair_count - 1; i >= 0; i--) {
+        if (entities_equal(entity->pairs[i].key, key, length)) {
+            *value = entity->pairs[i].value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Parses the \p size bytes of entity text at \p data. The text is not copied
+ * and must stay in place for as long as the entities are used.
+ * @param data The entity text, which need not be null-terminated
+ * @param size The size of the text in bytes
+ * @return The parsed entities, or NULL on error
+ */
+entities_t *entities_parse(const char *data, size_t size)
+{
+    entities_t *entities = calloc(1, sizeof *entities);
+    if (entities == NULL) {
+        Engine.error("Couldn't allocate entities.\n");
+        return NULL;
+    }
+
+    entities_lexer_t lexer = { data, data, data + size };
+    entity_string_t key, value;
+    int token;
+
+    while ((token = entities_next(&lexer, &key)) != ENTITIES_TOKEN_END) {
+        if (token != ENTITIES_TOKEN_OPEN) {
+            if (token != ENTITIES_TOKEN_ERROR) {
+                Engine.error("Expected '{' on line %d of entities.\n",
+                        entities_line(&lexer, lexer.p));
+            }
+            entities_free(entities);
+            return NULL;
+        }
+
+        int first_pair = entities->pair_count;
+        while ((token = entities_next(&lexer, &key)) ==
+                ENTITIES_TOKEN_STRING) {
+            token = entities_next(&lexer, &value);
+            if (token != ENTITIES_TOKEN_STRING) {
+                if (token != ENTITIES_TOKEN_ERROR) {
+                    Engine.error("Key without value on line %d of "
+                            "entities.\n", entities_line(&lexer, lexer.p));
+                }
+                entities_free(entities);
+                return NULL;
+            }
+
+            if (!entities_reserve((void **)&entities->pairs,
+                    &entities->pair_capacity, entities->pair_count,
+                    sizeof *entities->pairs)) {
+                Engine.error("Couldn't allocate entity keys.\n");
+                entities_free(entities);
+                return NULL;
+            }
+
+            entities->pairs[entities->pair_count++] =
+                    (entity_pair_t){ key, value };
+        }
+
+        if (token != ENTITIES_TOKEN_CLOSE) {
+            if (token != ENTITIES_TOKEN_ERROR) {
+                Engine.error("Unfinished entity on line %d of entities.\n",
+                        entities_line(&lexer, lexer.p));
+            }
+            entities_free(entities);
+            return NULL;
+        }
+
+        if (!entities_reserve((void **)&entities->entities,
+                &entities->entity_capacity, entities->entity_count,
+                sizeof *entities->entities)) {
+            Engine.error("Couldn't allocate entities.\n");
+            entities_free(entities);
+            return NULL;
+        }
+
+        /* Pairs may still move as the array grows, so only count them here */
+        entity_t *entity = &entities->entities[entities->entity_count++];
+        memset(entity, 0, sizeof *entity);
+        entity->pair_count = entities->pair_count - first_pair;
+    }
+
+    const entity_pair_t *pairs = entities->pairs;
+    for (int i = 0; i < entities->entity_count; i++) {
+        entity_t *entity = &entities->entities[i];
+        entity->pairs = pairs;
+        pairs += entity->pair_count;
+
+        entities_value(entity, "classname", &entity->classname);
+        entities_value(entity, "targetname", &entity->targetname);
+    }
+
+    if (!entities_build_index(entities)) {
+        Engine.error("Couldn't allocate entity index.\n");
+        entities_free(entities);
+        return NULL;
+    }
+
+    return entities;
+}
+
+/**
+ * Returns the number of bytes of memory held by \p entities, not counting
+ * the text they were parsed from.
+ */
+size_t entities_size(const entities_t *entities)
+{
+    return sizeof *entities +
+            entities->entity_capacity * sizeof *entities->entities +
+            entities->pair_capacity * sizeof *entities->pairs +
+            entities->bucket_count * sizeof *entities->buckets +
+            entities->list_count * sizeof *entities->lists;
+}
+
+int entities_count(const entities_t *entities)
+{
+    return entities->entity_count;
+}
+
+/**
+ * Returns entity \p index of \p entities, in the order of the text, or NULL if
+ * there is no such entity. Entity 0 is the world.
+ */
+const entity_t *entities_get(const entities_t *entities, int index)
+{
+    if (index < 0 || index >= entities->entity_count) {
+        return NULL;
+    }
+
+    return &entities->entities[index];
+}
+
+/**
+ * Finds the entities of \p entities whose field \p field is \p name.
+ * @param entities The entities to search
+ * @param field ENTITIES_CLASSNAME or ENTITIES_TARGETNAME
+ * @param name The name to look for, which need not be null-terminated
+ * @param length The length of \p name
+ * @param count Set to the number of entities found
+ * @return The indices of the entities found, in the order of the text, or
+ * NULL if there are none
+ */
+const int *entities_find(const entities_t *entities, int field,
+        const char *name, size_t length, int *count)
+{
+    *count = 0;
+    if (field < 0 || field >= ENTITIES_FIELDS || length == 0) {
+        return NULL;
+    }
+
+    const entities_bucket_t *bucket = entities_bucket((entities_t *)entities,
+            field, name, length, false);
+    if (bucket == NULL) {
+        return NULL;
+    }
+
+    *count = bucket->count;
+    return &entities->lists[bucket->first];
+}
+
+const struct entities_namespace Entities = {
+    .parse = entities_parse,
+    .free = entities_free,
+    .size = entities_size,
+    .count = entities_count,
+    .get = entities_get,
+    .value = entities_value,
+    .find = entities_find
+};
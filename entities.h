@@ -0,0 +1,70 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ENTITIES_H
+#define ENTITIES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Fields that entities are indexed by
+ */
+#define ENTITIES_CLASSNAME  (0)
+#define ENTITIES_TARGETNAME (1)
+#define ENTITIES_FIELDS     (2)
+
+/*
+ * A string in the entity text, which is not null-terminated. A quoted string
+ * is always followed by its closing quote, so it can be handed to strtof()
+ * and the like as it is.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+} entity_string_t;
+
+typedef struct {
+    entity_string_t key;
+    entity_string_t value;
+} entity_pair_t;
+
+/*
+ * The key/value pairs of one entity, in the order they were written. The
+ * classname and targetname are empty if the entity has none.
+ */
+typedef struct {
+    int pair_count;
+    const entity_pair_t *pairs;
+    entity_string_t classname;
+    entity_string_t targetname;
+} entity_t;
+
+typedef struct entities_s entities_t;
+
+extern const struct entities_namespace {
+    entities_t *(* const parse)(const char *data, size_t size);
+    void (* const free)(entities_t *entities);
+    size_t (* const size)(const entities_t *entities);
+    int (* const count)(const entities_t *entities);
+    const entity_t *(* const get)(const entities_t *entities, int index);
+    bool (* const value)(const entity_t *entity, const char *key,
+            entity_string_t *value);
+    const int *(* const find)(const entities_t *entities, int field,
+            const char *name, size_t length, int *count);
+} Entities;
+
+#endif
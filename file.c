@@ -1,73 +1,460 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "aio.h"
+#include "cvar.h"
 #include "engine.h"
 #include "file.h"
 #include "pak.h"
+#include "trace.h"
+#include "utils.h"
 
-#define FILE_MAX_PATH_LEN (128)
+#define FILE_MAX_PATH_LEN   (128)
+#define FILE_LOAD_LOCK_COUNT (64)
 
-typedef struct paklist_s {
-    const pak_t *pak;
-    struct paklist_s *next;
-} paklist_t;
+/** An archive or directory that has been added to the search path. */
+typedef struct searchpath_s {
+    /**
+     * The PAK archive mounted here, or NULL if this is a directory. The
+     * search path owns its archives and closes them in file_shutdown().
+     */
+    pak_t *pak;
 
-static paklist_t *pak_list= NULL;
+    /** The directory mounted here, or NULL if this is a PAK archive. */
+    char *dir;
 
-void file_list_path()
+    struct searchpath_s *next;
+} searchpath_t;
+
+/**
+ * A file visible through the search path. Only the highest-precedence source
+ * for each path is kept, so resolving a path never has to consider more than
+ * one archive or directory.
+ *
+ * Everything but \p data and \p content_hash is fixed once the entry is
+ * published in a mount table.
+ */
+typedef struct {
+    /** The path of this file relative to the root of the search path. */
+    char *path;
+
+    /** The hash of \p path, as computed by Utils.hashString. */
+    uint32_t hash;
+
+    /** The size in bytes of this file. */
+    size_t size;
+
+    /** The search path entry this file is provided by. */
+    const searchpath_t *source;
+
+    /** The index of this file in \p source's PAK directory, if any. */
+    size_t pak_index;
+
+    /**
+     * The contents of this file once it has been loaded, or NULL. This may be
+     * shared with other entries that have identical contents. Only written
+     * by file_publish(), and read with an atomic load.
+     */
+    const void *data;
+
+    /**
+     * The hash of this file's contents, as computed by Utils.hashData. Valid
+     * once \p hashed is set, and never written again after that.
+     */
+    uint64_t content_hash;
+
+    /**
+     * Whether \p content_hash has been computed. This is set before \p data
+     * is, but may also be set for a file whose contents were never kept. Only
+     * written by file_set_hash(), and read with an atomic load.
+     */
+    bool hashed;
+} file_entry_t;
+
+/**
+ * A snapshot of the search path and the merged index over it. A table is
+ * never modified once published: mounting builds a new table and swaps it
+ * in, so lookups take no locks and always see a consistent search path.
+ */
+typedef struct file_table_s {
+    /** The most recently added search path entry. */
+    searchpath_t *search_path;
+
+    file_entry_t **entries;
+    size_t entry_count;
+    size_t entry_capacity;
+
+    /**
+     * Open-addressing hash table over \p entries. Each slot holds an index
+     * into \p entries plus one, so that zero marks an empty slot.
+     */
+    uint32_t *index;
+    size_t index_mask;
+
+    /**
+     * \p entries ordered by path, for listing. Built and published
+     * atomically the first time the table is listed.
+     */
+    file_entry_t **sorted;
+
+    /**
+     * The table this one replaced. Readers may still hold it, so it is kept
+     * until file_shutdown().
+     */
+    struct file_table_s *retired;
+} file_table_t;
+
+/** The current mount table, read with an atomic load. */
+static file_table_t *file_table = NULL;
+
+/** Serializes changes to the search path. */
+static pthread_mutex_t file_mount_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Every entry ever created, including those overridden in later tables, for
+ * file_shutdown(). Only touched with \p file_mount_lock held.
+ */
+static file_entry_t **entry_pool = NULL;
+static size_t entry_pool_count = 0;
+static size_t entry_pool_capacity = 0;
+
+/**
+ * Serialize the first load of each entry. An entry's lock is chosen by its
+ * path hash, so different files rarely contend.
+ */
+static pthread_mutex_t file_load_locks[FILE_LOAD_LOCK_COUNT] = {
+    [0 ... FILE_LOAD_LOCK_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/**
+ * Open-addressing hash table over the loaded entries that hold the shared
+ * copy of their contents, keyed on content hash. NULL marks an empty slot.
+ * Guarded by \p file_content_lock.
+ */
+static pthread_mutex_t file_content_lock = PTHREAD_MUTEX_INITIALIZER;
+static file_entry_t **content_index = NULL;
+static size_t content_index_mask = 0;
+static size_t content_count = 0;
+
+/** Returns the current mount table, or NULL if nothing is mounted. */
+static inline file_table_t *file_current_table()
+{
+    return __atomic_load_n(&file_table, __ATOMIC_ACQUIRE);
+}
+
+void file_list_path(const file_table_t *table)
 {
-    if (pak_list == NULL) {
+    if (table == NULL || table->search_path == NULL) {
         Engine.error("No files in path.\n");
+        return;
     }
-    for (paklist_t *node = pak_list; node != NULL; node = node->next) {
-        PAK.print(node->pak);
+    for (searchpath_t *node = table->search_path; node != NULL;
+            node = node->next) {
+        if (node->pak != NULL) {
+            PAK.print(node->pak);
+        } else {
+            puts(node->dir);
+        }
     }
 }
 
 /**
- * Adds the PAK archive pointed to by \p pak to the engine's search path.
- * @parak pak The PAK archive to be added
+ * Returns the slot in \p table's index that holds \p path, or the empty slot
+ * where it would be inserted.
+ * @param table The mount table to be searched
+ * @param path The path to be found
+ * @param hash The hash of \p path, as computed by Utils.hashString
+ */
+size_t file_find_slot(const file_table_t *table, const char *path,
+        uint32_t hash)
+{
+    size_t slot = hash & table->index_mask;
+    while (table->index[slot] != 0) {
+        const file_entry_t *entry = table->entries[table->index[slot] - 1];
+        if (entry->hash == hash &&
+                strncmp(entry->path, path, FILE_MAX_PATH_LEN) == 0) {
+            break;
+        }
+        slot = (slot + 1) & table->index_mask;
+    }
+
+    return slot;
+}
+
+/**
+ * Doubles the size of \p table's index and reinserts every entry.
  */
-void file_add_pak_to_path(const pak_t *pak)
+void file_grow_index(file_table_t *table)
 {
-    paklist_t *node = calloc(1, sizeof *node);
+    size_t slots = table->index == NULL ? 1024 : 2 * (table->index_mask + 1);
+    uint32_t *index = calloc(slots, sizeof *index);
+    if (index == NULL) {
+        Engine.fatal("Failed to allocate search path index.\n");
+    }
+
+    free(table->index);
+    table->index = index;
+    table->index_mask = slots - 1;
+
+    for (size_t i = 0; i < table->entry_count; i++) {
+        size_t slot = table->entries[i]->hash & table->index_mask;
+        while (table->index[slot] != 0) {
+            slot = (slot + 1) & table->index_mask;
+        }
+        table->index[slot] = i + 1;
+    }
+}
+
+/**
+ * Returns a new, unpublished mount table holding the same search path and
+ * entries as \p old, which may be NULL, for a mount to add to.
+ */
+file_table_t *file_copy_table(const file_table_t *old)
+{
+    file_table_t *table = calloc(1, sizeof *table);
+    if (table == NULL) {
+        Engine.fatal("Failed to allocate search path.\n");
+    }
+
+    if (old == NULL) {
+        return table;
+    }
+
+    table->search_path = old->search_path;
+    table->entry_count = old->entry_count;
+    table->entry_capacity = old->entry_count;
+    if (old->index == NULL) {
+        return table;
+    }
+
+    table->entries = calloc(old->entry_count, sizeof *table->entries);
+    table->index_mask = old->index_mask;
+    table->index = calloc(old->index_mask + 1, sizeof *table->index);
+    if ((table->entries == NULL && old->entry_count > 0) ||
+            table->index == NULL) {
+        Engine.fatal("Failed to allocate search path.\n");
+    }
+
+    memcpy(table->entries, old->entries,
+            old->entry_count * sizeof *table->entries);
+    memcpy(table->index, old->index,
+            (old->index_mask + 1) * sizeof *table->index);
+    return table;
+}
+
+/**
+ * Makes \p source the provider of the file at \p path in \p table, overriding
+ * any source added earlier. Tables that are already published keep the entry
+ * they had.
+ * @param table The unpublished mount table to be added to
+ * @param path The path of the file relative to the root of the search path
+ * @param size The size in bytes of the file
+ * @param source The search path entry providing the file
+ * @param pak_index The index of the file in \p source's PAK directory, if any
+ */
+void file_add_entry(file_table_t *table, const char *path, size_t size,
+        const searchpath_t *source, size_t pak_index)
+{
+    /* Keep the load factor at or below one half */
+    if (table->index == NULL ||
+            2 * (table->entry_count + 1) > table->index_mask + 1) {
+        file_grow_index(table);
+    }
+
+    if (entry_pool_count == entry_pool_capacity) {
+        size_t capacity = entry_pool_capacity == 0 ? 512 :
+                2 * entry_pool_capacity;
+        file_entry_t **grown = realloc(entry_pool, capacity * sizeof *grown);
+        if (grown == NULL) {
+            Engine.fatal("Failed to allocate search path entries.\n");
+        }
+        entry_pool = grown;
+        entry_pool_capacity = capacity;
+    }
+
+    file_entry_t *entry = calloc(1, sizeof *entry);
+    if (entry == NULL) {
+        Engine.fatal("Failed to allocate search path entry.\n");
+    }
+    entry_pool[entry_pool_count++] = entry;
+
+    entry->path = strndup(path, FILE_MAX_PATH_LEN);
+    entry->hash = Utils.hashString(path, FILE_MAX_PATH_LEN);
+    entry->size = size;
+    entry->source = source;
+    entry->pak_index = pak_index;
+
+    size_t slot = file_find_slot(table, path, entry->hash);
+    if (table->index[slot] != 0) {
+        table->entries[table->index[slot] - 1] = entry;
+        return;
+    }
+
+    if (table->entry_count == table->entry_capacity) {
+        size_t capacity = table->entry_capacity < 512 ? 512 :
+                2 * table->entry_capacity;
+        file_entry_t **grown = realloc(table->entries,
+                capacity * sizeof *grown);
+        if (grown == NULL) {
+            Engine.fatal("Failed to allocate search path entries.\n");
+        }
+        table->entries = grown;
+        table->entry_capacity = capacity;
+    }
+
+    table->entries[table->entry_count] = entry;
+    table->index[slot] = ++table->entry_count;
+}
+
+/**
+ * Adds a search path entry for \p pak or \p dir to the front of \p table's
+ * search path and returns it.
+ */
+searchpath_t *file_new_searchpath(file_table_t *table, pak_t *pak,
+        const char *dir)
+{
+    searchpath_t *node = calloc(1, sizeof *node);
+    if (node == NULL) {
+        Engine.fatal("Failed to allocate search path entry.\n");
+    }
+
     node->pak = pak;
-    node->next = pak_list;
-    pak_list = node;
+    node->dir = dir == NULL ? NULL : strdup(dir);
+    node->next = table->search_path;
+    table->search_path = node;
+
+    return node;
+}
+
+/**
+ * Adds the PAK archive pointed to by \p pak to \p table's search path, which
+ * takes ownership of it. Files in \p pak override files with the same path
+ * added earlier.
+ * @param table The unpublished mount table to be added to
+ * @param pak The PAK archive to be added
+ */
+void file_add_pak_to_path(file_table_t *table, pak_t *pak)
+{
+    const searchpath_t *node = file_new_searchpath(table, pak, NULL);
+    for (size_t i = 0; i < PAK.fileCount(pak); i++) {
+        /* Directory paths are not guaranteed to be null-terminated */
+        char path[PAK_MAX_PATH_LENGTH + 1] = { 0 };
+        strncpy(path, PAK.filePath(pak, i), PAK_MAX_PATH_LENGTH);
+        file_add_entry(table, path, PAK.fileSize(pak, i), node, i);
+    }
+}
+
+/**
+ * Recursively adds every regular file below \p rel in \p node's directory to
+ * \p table as a loose file provided by \p node.
+ */
+void file_add_loose_files(file_table_t *table, const searchpath_t *node,
+        const char *rel)
+{
+    char dir_path[FILE_MAX_PATH_LEN * 2];
+    snprintf(dir_path, sizeof dir_path, "%s/%s", node->dir, rel);
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        char path[FILE_MAX_PATH_LEN];
+        int len = snprintf(path, sizeof path, "%s%s%s", rel,
+                rel[0] == '\0' ? "" : "/", ent->d_name);
+        if (len < 0 || len >= FILE_MAX_PATH_LEN) {
+            continue;
+        }
+
+        char full_path[FILE_MAX_PATH_LEN * 2];
+        snprintf(full_path, sizeof full_path, "%s/%s", node->dir, path);
+
+        struct stat st;
+        if (stat(full_path, &st) != 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            file_add_loose_files(table, node, path);
+        } else if (S_ISREG(st.st_mode)) {
+            file_add_entry(table, path, st.st_size, node, 0);
+        }
+    }
+
+    closedir(dir);
 }
 
 /**
- * Adds the directory specified by \p path to the engine's search path.
+ * Adds the directory specified by \p path to the engine's search path. As in
+ * Quake, the PAK archives in the directory take precedence over its loose
+ * files, and higher-numbered archives take precedence over lower-numbered
+ * ones.
+ *
+ * Archives are mapped into memory unless the cvar fs_streampaks is nonzero, in
+ * which case they are streamed from disk a file at a time.
+ *
+ * This may be called while other threads are reading files. They see either
+ * the search path from before the call or the one after it, never a mix.
  * @param path The path to the directory to be added
  */
 void file_add_dir_to_path(const char *path)
 {
+    pthread_mutex_lock(&file_mount_lock);
+
+    file_table_t *old = file_current_table();
+    file_table_t *table = file_copy_table(old);
+    table->retired = old;
+
+    const searchpath_t *node = file_new_searchpath(table, NULL, path);
+    file_add_loose_files(table, node, "");
+
+    pak_t *(*open_pak)(const char *) = PAK.openMapped;
+    if (Cvar.getNumber("fs_streampaks") != 0.0f) {
+        open_pak = PAK.openStreamed;
+    }
+
     /* Search path for PAK archives and add them to the search path */
-    static char pak_path[FILE_MAX_PATH_LEN];
     for (int paknum = 0; ; paknum++) {
+        char pak_path[FILE_MAX_PATH_LEN];
+
         /* TODO: might want to check both upper- and lowercase */
         snprintf(pak_path, FILE_MAX_PATH_LEN, "%s/PAK%d.PAK", path, paknum);
-        pak_t *pak = PAK.open(pak_path);
+        pak_t *pak = open_pak(pak_path);
         if (pak == NULL) {
             break;
         }
 
-        file_add_pak_to_path(pak);
+        file_add_pak_to_path(table, pak);
     }
-    file_list_path();
+
+    __atomic_store_n(&file_table, table, __ATOMIC_RELEASE);
+    file_list_path(table);
+
+    pthread_mutex_unlock(&file_mount_lock);
 }
 
 /**
- * Loads the file with path \p path from the file system and returns a
- * null-terminated buffer containing its data.
- * @param path The path to the file in the file system.
- * @return The data contained in the file at \p path, or NULL on error.
- *
- * TODO: rename to distinguish from generic loading functions that load from
- * both FS and PAK archives
+ * Reads the whole of the file at \p path into a null-terminated buffer and
+ * sets \p size to its size in bytes.
+ * @return The data contained in the file at \p path, or NULL on error, in
+ * which case \p size is left alone
  */
-void *file_load_from_disk(const char *path)
+void *file_read_from_disk(const char *path, size_t *size)
 {
     FILE *fp = fopen(path, "rb");
     if (fp == NULL) {
@@ -75,11 +462,13 @@ void *file_load_from_disk(const char *path)
     }
 
     if (fseek(fp, 0, SEEK_END) != 0) {
+        fclose(fp);
         return NULL;
     }
 
     const long file_size = ftell(fp);
     if (file_size == -1) {
+        fclose(fp);
         return NULL;
     }
 
@@ -87,21 +476,674 @@ void *file_load_from_disk(const char *path)
 
     uint8_t *data = calloc(file_size, sizeof *data + 1);
     if (data == NULL) {
+        fclose(fp);
         return NULL;
     }
 
     const size_t read_size = fread(data, sizeof *data, file_size, fp);
     if ((long)read_size != file_size) {
+        free(data);
+        fclose(fp);
         return NULL;
     }
 
     fclose(fp);
     fp = NULL;
 
+    *size = file_size;
     return (void *)data;
 }
 
+/**
+ * Loads the file with path \p path from the file system and returns a
+ * null-terminated buffer containing its data. The request is traced whether
+ * or not it succeeds; a failed one is recorded with no bytes.
+ * @param path The path to the file in the file system.
+ * @return The data contained in the file at \p path, or NULL on error.
+ *
+ * TODO: rename to distinguish from generic loading functions that load from
+ * both FS and PAK archives
+ */
+void *file_load_from_disk(const char *path)
+{
+    uint64_t trace = Trace.begin();
+    size_t size = 0;
+    void *data = file_read_from_disk(path, &size);
+    Trace.end(trace, TRACE_DISK_LOAD, path, NULL, size, false);
+    return data;
+}
+
+/**
+ * Returns the entry for \p path in the current mount table, or NULL if there
+ * is none.
+ */
+file_entry_t *file_find_entry(const char *path)
+{
+    const file_table_t *table = file_current_table();
+    if (table == NULL || table->index == NULL) {
+        return NULL;
+    }
+
+    size_t slot = file_find_slot(table, path,
+            Utils.hashString(path, FILE_MAX_PATH_LEN));
+    if (table->index[slot] == 0) {
+        return NULL;
+    }
+
+    return table->entries[table->index[slot] - 1];
+}
+
+/**
+ * Doubles the size of the content index and reinserts every entry in it. Must
+ * be called with \p file_content_lock held.
+ */
+void file_grow_content_index()
+{
+    size_t old_slots = content_index == NULL ? 0 : content_index_mask + 1;
+    size_t slots = old_slots == 0 ? 1024 : 2 * old_slots;
+    file_entry_t **index = calloc(slots, sizeof *index);
+    if (index == NULL) {
+        Engine.fatal("Failed to allocate content index.\n");
+    }
+
+    for (size_t i = 0; i < old_slots; i++) {
+        file_entry_t *entry = content_index[i];
+        if (entry == NULL) {
+            continue;
+        }
+
+        size_t slot = entry->content_hash & (slots - 1);
+        while (index[slot] != NULL) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        index[slot] = entry;
+    }
+
+    free(content_index);
+    content_index = index;
+    content_index_mask = slots - 1;
+}
+
+/**
+ * Records \p content_hash as the hash of \p entry's contents, unless it has
+ * been recorded already. Must be called with \p file_content_lock held.
+ */
+void file_set_hash(file_entry_t *entry, uint64_t content_hash)
+{
+    if (__atomic_load_n(&entry->hashed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    entry->content_hash = content_hash;
+    __atomic_store_n(&entry->hashed, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Releases a copy of \p entry's contents that is not going to be published.
+ */
+void file_discard(const file_entry_t *entry, const void *data)
+{
+    if (entry->source->pak != NULL) {
+        PAK.release(entry->source->pak, entry->pak_index);
+    } else {
+        free((void *)data);
+    }
+}
+
+/**
+ * Makes \p data, a freshly loaded copy of \p entry's contents, visible to
+ * every reader of \p entry. The copy is hashed and checked against every
+ * loaded file; if an identical file was already loaded, \p entry shares its
+ * contents and the copy is released, so that only one copy is ever kept in
+ * memory. Otherwise \p entry's copy becomes the shared copy for any identical
+ * file loaded later.
+ *
+ * Several threads may load the same entry at once. The first to get here
+ * wins, and the others release their copies and use the winner's. Until it
+ * has been published, a copy of a PAK file may be released by another
+ * thread, so \p data must not be dereferenced before this is called.
+ * @param entry The entry whose contents were just loaded
+ * @param data The contents of \p entry
+ * @return The published contents of \p entry
+ */
+const void *file_publish(file_entry_t *entry, const void *data)
+{
+    pthread_mutex_t *lock =
+            &file_load_locks[entry->hash % FILE_LOAD_LOCK_COUNT];
+    pthread_mutex_lock(lock);
+
+    const void *published = __atomic_load_n(&entry->data, __ATOMIC_ACQUIRE);
+    if (published != NULL) {
+        pthread_mutex_unlock(lock);
+        if (data != published) {
+            file_discard(entry, data);
+        }
+        return published;
+    }
+
+    /*
+     * While the lock is held, no other reader of this entry can release its
+     * PAK copy, so the contents can be hashed and compared safely.
+     */
+    uint64_t content_hash = Utils.hashData(data, entry->size);
+    published = data;
+
+    pthread_mutex_lock(&file_content_lock);
+    if (content_index == NULL ||
+            2 * (content_count + 1) > content_index_mask + 1) {
+        file_grow_content_index();
+    }
+
+    size_t slot = content_hash & content_index_mask;
+    for (; content_index[slot] != NULL;
+            slot = (slot + 1) & content_index_mask) {
+        const file_entry_t *other = content_index[slot];
+        if (other->content_hash == content_hash &&
+                other->size == entry->size &&
+                memcmp(other->data, data, entry->size) == 0) {
+            published = other->data;
+            break;
+        }
+    }
+
+    file_set_hash(entry, content_hash);
+    __atomic_store_n(&entry->data, published, __ATOMIC_RELEASE);
+
+    if (published == data) {
+        content_index[slot] = entry;
+        content_count += 1;
+    }
+    pthread_mutex_unlock(&file_content_lock);
+    pthread_mutex_unlock(lock);
+
+    if (published != data) {
+        file_discard(entry, data);
+    }
+
+    return published;
+}
+
+/**
+ * Returns the contents of \p entry, loading them if necessary. The first load
+ * of each entry goes through file_publish(), so identical files share one
+ * copy. Later requests are traced here as hits, since they never reach the
+ * archive or the disk.
+ * @return The contents of \p entry, or NULL if they could not be read
+ */
+const void *file_load_entry(file_entry_t *entry)
+{
+    uint64_t trace = Trace.begin();
+    const void *data = __atomic_load_n(&entry->data, __ATOMIC_ACQUIRE);
+    if (data != NULL) {
+        if (entry->source->pak != NULL) {
+            Trace.end(trace, TRACE_PAK_LOAD, entry->path,
+                    PAK.path(entry->source->pak), entry->size, true);
+        } else {
+            Trace.end(trace, TRACE_DISK_LOAD, entry->path, entry->source->dir,
+                    entry->size, true);
+        }
+        return data;
+    }
+
+    if (entry->source->pak != NULL) {
+        data = PAK.loadFileAt(entry->source->pak, entry->pak_index);
+    } else {
+        char full_path[FILE_MAX_PATH_LEN * 2];
+        snprintf(full_path, sizeof full_path, "%s/%s", entry->source->dir,
+                entry->path);
+        data = file_load_from_disk(full_path);
+        if (data == NULL) {
+            Engine.error("Failed to read '%s'.\n", full_path);
+        }
+    }
+
+    if (data == NULL) {
+        return NULL;
+    }
+
+    return file_publish(entry, data);
+}
+
+/**
+ * Resolves \p path against the search path and returns the contents of the
+ * highest-precedence file with that path. The returned data remains owned by
+ * the file system and must not be freed. Safe to call from any thread.
+ * @param path The path of the file relative to the root of the search path
+ * @param size If not NULL, receives the size in bytes of the file
+ * @return The contents of the file, or NULL if no such file exists
+ */
+const void *file_read_file(const char *path, size_t *size)
+{
+    file_entry_t *entry = file_find_entry(path);
+    if (entry == NULL) {
+        Engine.error("'%s' not found in search path.\n", path);
+        return NULL;
+    }
+    if (size != NULL) {
+        *size = entry->size;
+    }
+
+    return file_load_entry(entry);
+}
+
+/**
+ * Reads a copy of \p entry's contents into a null-terminated buffer owned by
+ * the caller and sets \p size to its size in bytes. Unlike file_load_entry(),
+ * this leaves nothing loaded in the file system. The read is traced, as a hit
+ * if the contents were already in memory.
+ * @return The copy, or NULL if the file could not be read
+ */
+void *file_copy_entry(const file_entry_t *entry, size_t *size)
+{
+    uint64_t trace = Trace.begin();
+    const void *data = __atomic_load_n(&entry->data, __ATOMIC_ACQUIRE);
+    const pak_t *pak = entry->source->pak;
+
+    void *copy = NULL;
+    *size = 0;
+    if (data != NULL || pak != NULL) {
+        copy = calloc(entry->size + 1, 1);
+        if (copy == NULL) {
+            Engine.error("Failed to allocate memory for '%s'.\n", entry->path);
+        } else if (data != NULL) {
+            memcpy(copy, data, entry->size);
+        } else if (!PAK.readFileAt(pak, entry->pak_index, copy)) {
+            free(copy);
+            copy = NULL;
+        }
+
+        if (copy != NULL) {
+            *size = entry->size;
+        }
+    } else {
+        char full_path[FILE_MAX_PATH_LEN * 2];
+        snprintf(full_path, sizeof full_path, "%s/%s", entry->source->dir,
+                entry->path);
+        copy = file_read_from_disk(full_path, size);
+        if (copy == NULL) {
+            Engine.error("Failed to read '%s'.\n", full_path);
+        }
+    }
+
+    Trace.end(trace, pak != NULL ? TRACE_PAK_LOAD : TRACE_DISK_LOAD,
+            entry->path, pak != NULL ? PAK.path(pak) : entry->source->dir,
+            *size, data != NULL);
+    return copy;
+}
+
+/**
+ * Records the hash of \p entry's contents, which are \p data, if it is not
+ * known yet.
+ */
+void file_hash_copy(file_entry_t *entry, const void *data, size_t size)
+{
+    if (__atomic_load_n(&entry->hashed, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    uint64_t content_hash = Utils.hashData(data, size);
+    pthread_mutex_lock(&file_content_lock);
+    file_set_hash(entry, content_hash);
+    pthread_mutex_unlock(&file_content_lock);
+}
+
+/**
+ * Resolves \p path against the search path and returns a copy of the
+ * highest-precedence file with that path. Unlike file_read_file(), the copy
+ * belongs to the caller, who frees it when done with it, and the file system
+ * keeps nothing loaded; this is for callers such as the asset cache that must
+ * be able to give back the memory a file took. Safe to call from any thread.
+ * @param path The path of the file relative to the root of the search path
+ * @param size If not NULL, receives the size in bytes of the file
+ * @return A null-terminated copy of the file, or NULL if it could not be read
+ */
+void *file_copy_file(const char *path, size_t *size)
+{
+    file_entry_t *entry = file_find_entry(path);
+    if (entry == NULL) {
+        Engine.error("'%s' not found in search path.\n", path);
+        return NULL;
+    }
+
+    size_t copy_size;
+    void *copy = file_copy_entry(entry, &copy_size);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    /* The copy is at hand, so later calls to file_content_hash() are free */
+    file_hash_copy(entry, copy, copy_size);
+
+    if (size != NULL) {
+        *size = copy_size;
+    }
+
+    return copy;
+}
+
+/**
+ * Computes a hash of the contents of the file at \p path that is stable across
+ * runs, for use as a key by caches of data derived from the file. The first
+ * call for a file reads it, but the contents are not kept: only the hash is
+ * remembered.
+ * @param path The path of the file relative to the root of the search path
+ * @param hash Receives the hash of the file's contents
+ * @return True on success, false if the file could not be read
+ */
+bool file_content_hash(const char *path, uint64_t *hash)
+{
+    file_entry_t *entry = file_find_entry(path);
+    if (entry == NULL) {
+        Engine.error("'%s' not found in search path.\n", path);
+        return false;
+    }
+
+    if (!__atomic_load_n(&entry->hashed, __ATOMIC_ACQUIRE)) {
+        size_t size;
+        void *copy = file_copy_entry(entry, &size);
+        if (copy == NULL) {
+            return false;
+        }
+
+        file_hash_copy(entry, copy, size);
+        free(copy);
+    }
+
+    *hash = entry->content_hash;
+    return true;
+}
+
+/** A request from a batch whose data has to be read from disk. */
+typedef struct {
+    file_request_t *request;
+    file_entry_t   *entry;
+} file_pending_t;
+
+typedef struct {
+    file_done_fn_t done;
+    void          *ctx;
+} file_batch_t;
+
+/** Finishes a request once its read has completed. */
+void file_read_done(aio_read_t *read, void *ctx)
+{
+    const file_batch_t *batch = ctx;
+    file_pending_t *pending = read->user;
+    file_entry_t *entry = pending->entry;
+    file_request_t *request = pending->request;
+
+    const void *data;
+    if (entry->source->pak != NULL) {
+        data = PAK.finishRead(entry->source->pak, entry->pak_index, read);
+    } else {
+        close(read->fd);
+        data = read->buf;
+        if (!read->ok) {
+            Engine.error("Failed to read '%s'.\n", entry->path);
+            free(read->buf);
+            data = NULL;
+        }
+    }
+
+    request->data = data == NULL ? NULL : file_publish(entry, data);
+
+    if (batch->done != NULL) {
+        batch->done(request, batch->ctx);
+    }
+}
+
+/**
+ * Resolves and loads every file in \p requests, reading those that are not
+ * yet in memory together through AsyncIO rather than one at a time. \p done
+ * is called on the calling thread as each request completes, and this returns
+ * once all requests have completed. Each request's data is owned by the file
+ * system, as with file_read_file().
+ * @param requests The files to be loaded
+ * @param count The number of elements in \p requests
+ * @param done Called once for each request as it completes; may be NULL
+ * @param ctx Passed to every call of \p done
+ */
+void file_read_batch(file_request_t *requests, size_t count,
+        file_done_fn_t done, void *ctx)
+{
+    aio_read_t *reads = calloc(count, sizeof *reads);
+    file_pending_t *pending = calloc(count, sizeof *pending);
+    if (count > 0 && (reads == NULL || pending == NULL)) {
+        Engine.fatal("Failed to allocate read batch.\n");
+    }
+
+    size_t read_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        file_request_t *request = &requests[i];
+        request->data = NULL;
+        request->size = 0;
+
+        file_entry_t *entry = file_find_entry(request->path);
+        if (entry == NULL) {
+            Engine.error("'%s' not found in search path.\n", request->path);
+            if (done != NULL) {
+                done(request, ctx);
+            }
+            continue;
+        }
+        request->size = entry->size;
+
+        aio_read_t *read = &reads[read_count];
+        bool needs_read = false;
+        if (__atomic_load_n(&entry->data, __ATOMIC_ACQUIRE) != NULL) {
+            needs_read = false;
+        } else if (entry->source->pak != NULL) {
+            needs_read = PAK.prepareRead(entry->source->pak, entry->pak_index,
+                    read);
+        } else {
+            char full_path[FILE_MAX_PATH_LEN * 2];
+            snprintf(full_path, sizeof full_path, "%s/%s", entry->source->dir,
+                    entry->path);
+
+            read->fd = open(full_path, O_RDONLY);
+            read->buf = calloc(entry->size + 1, 1);
+            if (read->fd == -1 || read->buf == NULL) {
+                Engine.error("Failed to read '%s'.\n", full_path);
+                if (read->fd != -1) {
+                    close(read->fd);
+                }
+                free(read->buf);
+                if (done != NULL) {
+                    done(request, ctx);
+                }
+                continue;
+            }
+
+            read->offset = 0;
+            read->size = entry->size;
+            needs_read = true;
+        }
+
+        if (needs_read) {
+            pending[read_count].request = request;
+            pending[read_count].entry = entry;
+            read->user = &pending[read_count];
+            read_count += 1;
+        } else {
+            request->data = file_load_entry(entry);
+            if (done != NULL) {
+                done(request, ctx);
+            }
+        }
+    }
+
+    file_batch_t batch = { .done = done, .ctx = ctx };
+    AsyncIO.readAll(reads, read_count, file_read_done, &batch);
+
+    free(pending);
+    free(reads);
+}
+
+/** Orders entries by path. */
+int file_compare_entries(const void *a, const void *b)
+{
+    return strcmp((*(file_entry_t * const *)a)->path,
+            (*(file_entry_t * const *)b)->path);
+}
+
+/**
+ * Returns the sorted view of \p table, building it if this is the first time
+ * the table has been listed.
+ * @return The view, or NULL if it could not be allocated
+ */
+file_entry_t * const *file_sorted_view(file_table_t *table)
+{
+    file_entry_t **sorted = __atomic_load_n(&table->sorted, __ATOMIC_ACQUIRE);
+    if (sorted != NULL || table->entry_count == 0) {
+        return sorted;
+    }
+
+    sorted = calloc(table->entry_count, sizeof *sorted);
+    if (sorted == NULL) {
+        Engine.error("Failed to allocate sorted search path.\n");
+        return NULL;
+    }
+
+    memcpy(sorted, table->entries, table->entry_count * sizeof *sorted);
+    qsort(sorted, table->entry_count, sizeof *sorted, file_compare_entries);
+
+    /* Another thread may have built the same view in the meantime */
+    file_entry_t **expected = NULL;
+    if (!__atomic_compare_exchange_n(&table->sorted, &expected, sorted, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(sorted);
+        return expected;
+    }
+
+    return sorted;
+}
+
+/**
+ * Calls \p fn for every file in the search path whose path matches the glob
+ * \p pattern, in order of path, as with PAK.list. Each path is listed once,
+ * however many archives or directories provide it. File data is not touched.
+ * @param pattern The glob to be matched against each path
+ * @param fn Called with the path and size of each match; may be NULL
+ * @param ctx Passed to every call of \p fn
+ * @return The number of matching files
+ */
+size_t file_list(const char *pattern, file_list_fn_t fn, void *ctx)
+{
+    file_table_t *table = file_current_table();
+    if (table == NULL) {
+        return 0;
+    }
+
+    file_entry_t * const *sorted = file_sorted_view(table);
+    if (sorted == NULL) {
+        return 0;
+    }
+
+    size_t prefix_len = strcspn(pattern, "*?[\\");
+
+    /* Find the first path not less than the literal prefix */
+    size_t low = 0;
+    size_t high = table->entry_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(sorted[mid]->path, pattern, prefix_len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i = low; i < table->entry_count; i++) {
+        const file_entry_t *entry = sorted[i];
+        if (strncmp(entry->path, pattern, prefix_len) != 0) {
+            break;
+        }
+
+        if (fnmatch(pattern, entry->path, 0) == 0) {
+            if (fn != NULL) {
+                fn(entry->path, entry->size, ctx);
+            }
+            count += 1;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Removes everything from the search path, closing its PAK archives and
+ * freeing every file loaded through it. Must not be called while any other
+ * thread is using the file system, and invalidates all data it returned.
+ */
+void file_shutdown()
+{
+    pthread_mutex_lock(&file_mount_lock);
+
+    file_table_t *table = __atomic_exchange_n(&file_table, NULL,
+            __ATOMIC_ACQ_REL);
+
+    /* Loose files own their contents unless they share another file's */
+    for (size_t i = 0; i < entry_pool_count; i++) {
+        file_entry_t *entry = entry_pool[i];
+        if (entry->source->pak == NULL && entry->data != NULL) {
+            bool shared = false;
+            size_t slot = entry->content_hash & content_index_mask;
+            for (; content_index[slot] != NULL;
+                    slot = (slot + 1) & content_index_mask) {
+                if (content_index[slot] == entry) {
+                    shared = true;
+                    break;
+                }
+            }
+            if (shared) {
+                free((void *)entry->data);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < entry_pool_count; i++) {
+        free(entry_pool[i]->path);
+        free(entry_pool[i]);
+    }
+    free(entry_pool);
+    entry_pool = NULL;
+    entry_pool_count = 0;
+    entry_pool_capacity = 0;
+
+    free(content_index);
+    content_index = NULL;
+    content_index_mask = 0;
+    content_count = 0;
+
+    searchpath_t *node = table == NULL ? NULL : table->search_path;
+    while (node != NULL) {
+        searchpath_t *next = node->next;
+        PAK.close(node->pak);
+        free(node->dir);
+        free(node);
+        node = next;
+    }
+
+    while (table != NULL) {
+        file_table_t *retired = table->retired;
+        free(table->entries);
+        free(table->index);
+        free(table->sorted);
+        free(table);
+        table = retired;
+    }
+
+    pthread_mutex_unlock(&file_mount_lock);
+}
+
 const struct file_namespace File = {
     .addDirToPath = file_add_dir_to_path,
-    .loadFromDisk = file_load_from_disk
+    .loadFromDisk = file_load_from_disk,
+    .readFile = file_read_file,
+    .copyFile = file_copy_file,
+    .readBatch = file_read_batch,
+    .contentHash = file_content_hash,
+    .list = file_list,
+    .shutdown = file_shutdown
 };
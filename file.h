@@ -1,9 +1,37 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    /** The path of the file relative to the root of the search path. */
+    const char *path;
+
+    /** Receives the contents of the file, or NULL if it could not be read. */
+    const void *data;
+
+    /** Receives the size in bytes of the file. */
+    size_t size;
+} file_request_t;
+
+/** Called on the submitting thread as each request in a batch completes. */
+typedef void (*file_done_fn_t)(file_request_t *request, void *ctx);
+
+/** Called by File.list with each matching path and the size of its file. */
+typedef void (*file_list_fn_t)(const char *path, size_t size, void *ctx);
+
 extern const struct file_namespace {
     void (* const addDirToPath)(const char *path);
     void *(* const loadFromDisk)(const char *path);
+    const void *(* const readFile)(const char *path, size_t *size);
+    void *(* const copyFile)(const char *path, size_t *size);
+    void (* const readBatch)(file_request_t *requests, size_t count,
+            file_done_fn_t done, void *ctx);
+    bool (* const contentHash)(const char *path, uint64_t *hash);
+    size_t (* const list)(const char *pattern, file_list_fn_t fn, void *ctx);
+    void (* const shutdown)();
 } File;
 
 #endif
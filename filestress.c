@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file filestress.c
+ *
+ * Hammers the file and PAK layers from FILESTRESS_THREADS threads at once.
+ * Every thread looks up random paths from the search path, copying, reading
+ * and hashing each file, and now and then listing the search path and
+ * reading a batch of files. If a second directory is given, it is mounted
+ * while the threads are running, so lookups race with the mount table being
+ * replaced. Mounting only ever adds files, so every lookup must succeed, and
+ * the number of failures is reported along with the lookup rate.
+ *
+ * Every request is traced into a ring of only FILESTRESS_TRACE_RECORDS
+ * records, so that it wraps constantly, and the ring is dumped while the
+ * threads are running.
+ *
+ * Build it with -fsanitize=thread to check the layers for data races.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "engine.h"
+#include "file.h"
+#include "trace.h"
+
+#define FILESTRESS_THREADS         (16)
+#define FILESTRESS_DEFAULT_LOOKUPS (200000)
+#define FILESTRESS_BATCH_SIZE      (8)
+#define FILESTRESS_LIST_INTERVAL   (256)
+#define FILESTRESS_TRACE_RECORDS   (64)
+
+typedef struct {
+    char **paths;
+    size_t path_count;
+    size_t path_bytes;
+    size_t lookups;
+    size_t failures;
+} filestress_t;
+
+typedef struct {
+    filestress_t *stress;
+    unsigned seed;
+    size_t failures;
+    unsigned sum;
+} filestress_worker_t;
+
+double filestress_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void filestress_add_path(const char *path, size_t size, void *ctx)
+{
+    filestress_t *stress = ctx;
+    stress->paths[stress->path_count] = strdup(path);
+    if (stress->paths[stress->path_count] == NULL) {
+        Engine.fatal("Couldn't allocate path '%s'.\n", path);
+    }
+    stress->path_count += 1;
+    stress->path_bytes += size;
+}
+
+const char *filestress_pick(filestress_worker_t *worker)
+{
+    filestress_t *stress = worker->stress;
+    return stress->paths[rand_r(&worker->seed) % stress->path_count];
+}
+
+/**
+ * Looks up one path, copying its file, then reading it through the file
+ * system and checking that both agree, touching every page, and finally
+ * checking its content hash. Returns false if anything failed.
+ */
+bool filestress_lookup(filestress_worker_t *worker, const char *path)
+{
+    size_t copy_size = 0;
+    unsigned char *copy = File.copyFile(path, &copy_size);
+    if (copy == NULL) {
+        return false;
+    }
+
+    size_t size = 0;
+    const unsigned char *data = File.readFile(path, &size);
+    bool same = data != NULL && size == copy_size &&
+            memcmp(data, copy, size) == 0;
+    free(copy);
+    if (!same) {
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i += 4096) {
+        worker->sum += data[i];
+    }
+
+    uint64_t hash;
+    return File.contentHash(path, &hash);
+}
+
+void *filestress_run(void *ctx)
+{
+    filestress_worker_t *worker = ctx;
+    filestress_t *stress = worker->stress;
+
+    for (size_t i = 0; i < stress->lookups; i++) {
+        if (!filestress_lookup(worker, filestress_pick(worker))) {
+            worker->failures += 1;
+        }
+
+        if (i % FILESTRESS_LIST_INTERVAL != 0) {
+            continue;
+        }
+
+        if (File.list("*", NULL, NULL) < stress->path_count) {
+            worker->failures += 1;
+        }
+
+        file_request_t requests[FILESTRESS_BATCH_SIZE];
+        memset(requests, 0, sizeof requests);
+        for (int j = 0; j < FILESTRESS_BATCH_SIZE; j++) {
+            requests[j].path = filestress_pick(worker);
+        }
+        File.readBatch(requests, FILESTRESS_BATCH_SIZE, NULL, NULL);
+        for (int j = 0; j < FILESTRESS_BATCH_SIZE; j++) {
+            if (requests[j].data == NULL) {
+                worker->failures += 1;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4) {
+        printf("Usage: %s [game-dir] [mount-dir] [lookup-count]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    filestress_t stress = {
+        .lookups = argc == 4 ? strtoul(argv[3], NULL, 10) :
+                FILESTRESS_DEFAULT_LOOKUPS
+    };
+
+    File.addDirToPath(argv[1]);
+    size_t count = File.list("*", NULL, NULL);
+    if (count == 0) {
+        Engine.fatal("No files found in '%s'.\n", argv[1]);
+    }
+
+    stress.paths = calloc(count, sizeof *stress.paths);
+    if (stress.paths == NULL) {
+        Engine.fatal("Couldn't allocate %zu paths.\n", count);
+    }
+    File.list("*", filestress_add_path, &stress);
+
+    pthread_t threads[FILESTRESS_THREADS];
+    filestress_worker_t workers[FILESTRESS_THREADS];
+
+    Trace.start(FILESTRESS_TRACE_RECORDS);
+    double t0 = filestress_now();
+    for (int i = 0; i < FILESTRESS_THREADS; i++) {
+        workers[i] = (filestress_worker_t){ .stress = &stress, .seed = i + 1 };
+        if (pthread_create(&threads[i], NULL, filestress_run,
+                &workers[i]) != 0) {
+            Engine.fatal("Couldn't start thread %d.\n", i);
+        }
+    }
+
+    if (argc >= 3) {
+        File.addDirToPath(argv[2]);
+    }
+
+    if (!Trace.dumpCSV("/dev/null")) {
+        stress.failures += 1;
+    }
+
+    unsigned sum = 0;
+    for (int i = 0; i < FILESTRESS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        stress.failures += workers[i].failures;
+        sum += workers[i].sum;
+    }
+    double time = filestress_now() - t0;
+    Trace.stop();
+
+    size_t total = FILESTRESS_THREADS * stress.lookups;
+    fprintf(stderr, "%d threads, %zu paths (%zu bytes), %zu lookups in %.3f s "
+            "(%.0f per second, %u)\n", FILESTRESS_THREADS, stress.path_count,
+            stress.path_bytes, total, time, total / time, sum & 0xff);
+    fprintf(stderr, "%zu failures\n", stress.failures);
+
+    for (size_t i = 0; i < stress.path_count; i++) {
+        free(stress.paths[i]);
+    }
+    free(stress.paths);
+    File.shutdown();
+
+    exit(stress.failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file hull.c
+ *
+ * Point and trace queries against the collision hulls of a BSP's models.
+ *
+ * A trace is the line from its start to its end pushed through one hull. Where
+ * the line crosses a node's plane it is split in two, and the half on the
+ * side of the start is followed first, so leaves are reached in order along
+ * the line. The trace stops at the first solid leaf entered from a non-solid
+ * one, at the plane that was crossed to get there. Rather than recursing into
+ * each half as Quake does, the far halves wait on a stack holding at most one
+ * per level of the hull, so a trace costs no calls and touches no more memory
+ * than the nodes it visits.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bsp.h"
+#include "bsp_private.h"
+#include "hull.h"
+#include "jobs.h"
+#include "vecmath.h"
+
+/*
+ * Traces split lines this far short of each plane they cross, on the side of
+ * the start, so the point where a trace stops is never inside the plane.
+ */
+#define HULL_DIST_EPSILON (0.03125f)
+
+/*
+ * Batches are handed to the worker pool in runs of this many traces, and only
+ * once there are enough of them to be worth waking it.
+ */
+#define HULL_BATCH_CHUNK    (64)
+#define HULL_BATCH_PARALLEL (4 * HULL_BATCH_CHUNK)
+
+/*
+ * A part of a trace still to be followed, from fraction f1 at p1 to fraction
+ * f2 at p2, starting at hull node (or contents) node. plane is the node whose
+ * plane the part starts on, with back set if it starts behind it, or NULL if
+ * it starts where the trace does.
+ */
+typedef struct {
+    int32_t node;
+    float f1;
+    float f2;
+    vec3_t p1;
+    vec3_t p2;
+    const bsp_hullnode_t *plane;
+    bool back;
+} hull_segment_t;
+
+typedef struct {
+    const bsp_t *bsp;
+    const hull_query_t *queries;
+    size_t count;
+    hull_trace_t *traces;
+} hull_batch_t;
+
+/**
+ * Returns the root of hull \p hull of model \p model. An index that is out of
+ * range names an empty hull.
+ */
+static inline int32_t hull_root(const bsp_t *bsp, int model, int hull)
+{
+    if (model < 0 || model >= bsp->model_count || hull < 0 ||
+            hull >= HULL_COUNT) {
+        return BSP_LEAF_NORMAL;
+    }
+
+    return bsp->hull_roots[model][hull];
+}
+
+/**
+ * Returns the signed distance of \p point from the plane of \p node.
+ */
+static inline float hull_distance(const bsp_hullnode_t *node,
+        const vec3_t point)
+{
+    if (node->type < BSP_PLANE_ANYX) {
+        return point[node->type] - node->dist;
+    }
+
+    return vec3_dot((float *)point, (float *)node->normal) - node->dist;
+}
+
+/**
+ * Returns the contents of hull \p hull of model \p model at \p point.
+ * @param bsp The BSP containing the model
+ * @param model The index of the model, 0 being the world
+ * @param hull One of the HULL_* values
+ * @param point The point to be tested, in the model's space
+ * @return One of the BSP_LEAF_* values
+ */
+int hull_point_contents(const bsp_t *bsp, int model, int hull,
+        const vec3_t point)
+{
+    int32_t index = hull_root(bsp, model, hull);
+    while (index >= 0) {
+        const bsp_hullnode_t *node = &bsp->hullnodes[index];
+        if (hull_distance(node, point) >= 0.0f) {
+            index = node->children[0];
+        } else {
+            index = node->children[1];
+        }
+    }
+
+    return index;
+}
+
+/**
+ * Traces the line from \p start to \p end through hull \p hull of model
+ * \p model. For hulls 1 and 2 this sweeps the hull's box from \p start to
+ * \p end, with both being the positions of the box's origin.
+ *
+ * The trace stops on entering solid space from open space. A trace that
+ * starts in solid space is flagged as such and carries on until it leaves,
+ * so it can still hit whatever it meets after that; if it never leaves, it is
+ * also flagged as all solid.
+ *
+ * @param bsp The BSP containing the model
+ * @param model The index of the model, 0 being the world
+ * @param hull One of the HULL_* values
+ * @param start The start of the trace, in the model's space
+ * @param end The end of the trace, in the model's space
+ * @param trace Where the result is stored
+ */
+void hull_trace(const bsp_t *bsp, int model, int hull, const vec3_t start,
+        const vec3_t end, hull_trace_t *trace)
+{
+    memset(trace, 0, sizeof *trace);
+    trace->fraction = 1.0f;
+    vec3_copy(trace->endpos, (float *)end);
+    trace->contents = BSP_LEAF_NORMAL;
+    trace->allsolid = true;
+
+    hull_segment_t segment = {
+        .node = hull_root(bsp, model, hull),
+        .f1 = 0.0f,
+        .f2 = 1.0f,
+        .plane = NULL,
+        .back = false
+    };
+    vec3_copy(segment.p1, (float *)start);
+    vec3_copy(segment.p2, (float *)end);
+
+    /* Only far halves wait on the stack, one per level at most */
+    hull_segment_t stack[bsp->hull_depth + 1];
+    size_t depth = 0;
+    bool in_solid = false;
+
+    for (;;) {
+        while (segment.node >= 0) {
+            const bsp_hullnode_t *node = &bsp->hullnodes[segment.node];
+            float t1 = hull_distance(node, segment.p1);
+            float t2 = hull_distance(node, segment.p2);
+
+            if (t1 >= 0.0f && t2 >= 0.0f) {
+                segment.node = node->children[0];
+                continue;
+            }
+            if (t1 < 0.0f && t2 < 0.0f) {
+                segment.node = node->children[1];
+                continue;
+            }
+
+            /* Split short of the plane, on the side of the start */
+            int near = t1 < 0.0f;
+            float frac = near ? (t1 + HULL_DIST_EPSILON) / (t1 - t2) :
+                    (t1 - HULL_DIST_EPSILON) / (t1 - t2);
+            if (frac < 0.0f) {
+                frac = 0.0f;
+            } else if (frac > 1.0f) {
+                frac = 1.0f;
+            }
+
+            hull_segment_t *far = &stack[depth++];
+            far->node = node->children[!near];
+            far->f1 = segment.f1 + (segment.f2 - segment.f1) * frac;
+            far->f2 = segment.f2;
+            for (int i = 0; i < 3; i++) {
+                far->p1[i] = segment.p1[i] +
+                        (segment.p2[i] - segment.p1[i]) * frac;
+            }
+            vec3_copy(far->p2, segment.p2);
+            far->plane = node;
+            far->back = near;
+
+            segment.node = node->children[near];
+            segment.f2 = far->f1;
+            vec3_copy(segment.p2, far->p1);
+        }
+
+        if (segment.node == BSP_LEAF_SOLID) {
+            if (segment.plane == NULL) {
+                trace->startsolid = true;
+            } else if (!in_solid) {
+                const bsp_hullnode_t *plane = segment.plane;
+                float sign = segment.back ? -1.0f : 1.0f;
+
+                trace->fraction = segment.f1;
+                vec3_copy(trace->endpos, segment.p1);
+                vec3_scale(trace->normal, (float *)plane->normal, sign);
+                trace->dist = plane->dist * sign;
+                trace->contents = BSP_LEAF_SOLID;
+                return;
+            }
+            in_solid = true;
+        } else {
+            trace->allsolid = false;
+            in_solid = false;
+        }
+
+        trace->contents = segment.node;
+        if (depth == 0) {
+            return;
+        }
+        segment = stack[--depth];
+    }
+}
+
+void hull_trace_chunk(void *ctx, size_t index)
+{
+    const hull_batch_t *batch = ctx;
+
+    size_t start = index * HULL_BATCH_CHUNK;
+    size_t end = start + HULL_BATCH_CHUNK;
+    if (end > batch->count) {
+        end = batch->count;
+    }
+
+    for (size_t i = start; i < end; i++) {
+        const hull_query_t *query = &batch->queries[i];
+        hull_trace(batch->bsp, query->model, query->hull, query->start,
+                query->end, &batch->traces[i]);
+    }
+}
+
+/**
+ * Runs the \p count traces in \p queries, storing the result of each in the
+ * same position of \p traces. Large batches are spread over the worker pool.
+ * @param bsp The BSP containing the models
+ * @param queries The traces to run
+ * @param count The number of traces in \p queries
+ * @param traces Where the results are stored
+ */
+void hull_trace_batch(const bsp_t *bsp, const hull_query_t *queries,
+        size_t count, hull_trace_t *traces)
+{
+    hull_batch_t batch = {
+        .bsp = bsp,
+        .queries = queries,
+        .count = count,
+        .traces = traces
+    };
+
+    size_t chunks = (count + HULL_BATCH_CHUNK - 1) / HULL_BATCH_CHUNK;
+    if (count < HULL_BATCH_PARALLEL) {
+        for (size_t i = 0; i < chunks; i++) {
+            hull_trace_chunk(&batch, i);
+        }
+    } else {
+        Jobs.run(chunks, hull_trace_chunk, &batch);
+    }
+}
+
+const struct hull_namespace Hull = {
+    .pointContents = hull_point_contents,
+    .trace = hull_trace,
+    .traceBatch = hull_trace_batch
+};
@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HULL_H
+#define HULL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bsp.h"
+
+/*
+ * Collision hulls of a model. Hull 0 is the model's BSP tree, for points;
+ * hulls 1 and 2 are its clip nodes, whose planes have been pushed out so that
+ * tracing a point through them sweeps a box of the given size.
+ */
+#define HULL_POINT  (0) /* a point */
+#define HULL_PLAYER (1) /* -16 -16 -24 to 16 16 32 */
+#define HULL_LARGE  (2) /* -32 -32 -24 to 32 32 64 */
+#define HULL_COUNT  (3)
+
+/*
+ * A trace through one hull of one model, in the model's space.
+ */
+typedef struct {
+    int model;
+    int hull;
+    vec3_t start;
+    vec3_t end;
+} hull_query_t;
+
+typedef struct {
+    /*
+     * How far along the trace it got before hitting something, from 0 to 1.
+     * The trace reached its end if this is 1.
+     */
+    float fraction;
+
+    /*
+     * Where the trace stopped. On a hit this is just short of the plane that
+     * was hit, on the side the trace came from.
+     */
+    vec3_t endpos;
+
+    /*
+     * The plane that was hit, facing the side the trace came from, in the form
+     * dot(normal, p) = dist. Zero if nothing was hit.
+     */
+    vec3_t normal;
+    float dist;
+
+    /*
+     * BSP_LEAF_SOLID if something was hit, or else the contents at the end.
+     */
+    int contents;
+
+    /*
+     * Whether the trace started inside something solid, and whether it stayed
+     * inside solid space all the way.
+     */
+    bool startsolid;
+    bool allsolid;
+} hull_trace_t;
+
+extern const struct hull_namespace {
+    int (* const pointContents)(const bsp_t *bsp, int model, int hull,
+            const vec3_t point);
+    void (* const trace)(const bsp_t *bsp, int model, int hull,
+            const vec3_t start, const vec3_t end, hull_trace_t *trace);
+    void (* const traceBatch)(const bsp_t *bsp, const hull_query_t *queries,
+            size_t count, hull_trace_t *traces);
+} Hull;
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/** @file jobs.c */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cvar.h"
+#include "engine.h"
+#include "jobs.h"
+
+#define JOBS_MAX_WORKERS (64)
+
+/**
+ * A batch of work submitted through Jobs.run(). Batches are queued so that
+ * several threads, or a job that itself submits a batch, can use the pool at
+ * the same time.
+ */
+typedef struct jobs_batch_s {
+    jobs_fn_t fn;
+    void     *ctx;
+
+    /** The number of items in this batch. */
+    size_t    count;
+
+    /** The index of the next item to be handed out. */
+    size_t    next;
+
+    /** The number of items that have not finished running. */
+    size_t    pending;
+
+    struct jobs_batch_s *next_batch;
+} jobs_batch_t;
+
+static pthread_once_t jobs_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobs_done_cond = PTHREAD_COND_INITIALIZER;
+
+static jobs_batch_t *jobs_queue = NULL;
+static size_t jobs_worker_count = 0;
+
+/**
+ * Claims an item from the first batch in the queue that has any left, and
+ * removes batches from the queue once all of their items are claimed. Must be
+ * called with jobs_lock held.
+ * @param index Receives the index of the claimed item
+ * @return The batch the item belongs to, or NULL if the queue is empty
+ */
+jobs_batch_t *jobs_claim(size_t *index)
+{
+    jobs_batch_t *batch = jobs_queue;
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    *index = batch->next++;
+    if (batch->next == batch->count) {
+        jobs_queue = batch->next_batch;
+    }
+
+    return batch;
+}
+
+/**
+ * Runs item \p index of \p batch and marks it finished. Must be called with
+ * jobs_lock held; the lock is released while the item runs.
+ */
+void jobs_execute(jobs_batch_t *batch, size_t index)
+{
+    pthread_mutex_unlock(&jobs_lock);
+    batch->fn(batch->ctx, index);
+    pthread_mutex_lock(&jobs_lock);
+
+    batch->pending -= 1;
+    if (batch->pending == 0) {
+        pthread_cond_broadcast(&jobs_done_cond);
+    }
+}
+
+void *jobs_worker(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&jobs_lock);
+    for (;;) {
+        size_t index;
+        jobs_batch_t *batch = jobs_claim(&index);
+        if (batch == NULL) {
+            pthread_cond_wait(&jobs_work_cond, &jobs_lock);
+            continue;
+        }
+
+        jobs_execute(batch, index);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts one worker per online CPU, less one for the thread submitting work.
+ * If the cvar jobs_threads is set to 1 or more when the pool is first used,
+ * the pool is capped so that no more than that many threads, counting the
+ * submitting thread, work on a batch; 1 runs every job on the caller.
+ */
+void jobs_init()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = cpus > 1 ? (size_t)cpus - 1 : 1;
+
+    float threads = Cvar.getNumber("jobs_threads");
+    if (threads >= 1.0f && (size_t)threads - 1 < count) {
+        count = (size_t)threads - 1;
+    }
+    if (count > JOBS_MAX_WORKERS) {
+        count = JOBS_MAX_WORKERS;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, jobs_worker, NULL) != 0) {
+            Engine.error("Failed to start worker thread %zu.\n", i);
+            break;
+        }
+        pthread_detach(thread);
+        jobs_worker_count += 1;
+    }
+}
+
+/**
+ * Calls \p fn once for every index in [0, \p count) on the worker pool and
+ * returns once all calls have finished. The calling thread works on the
+ * batch as well, so this is safe to call from inside a job.
+ * @param count The number of items in the batch
+ * @param fn The function to be called for each item
+ * @param ctx The context passed to every call of \p fn
+ */
+void jobs_run(size_t count, jobs_fn_t fn, void *ctx)
+{
+    if (count == 0) {
+        return;
+    }
+
+    pthread_once(&jobs_once, jobs_init);
+
+    jobs_batch_t batch = {
+        .fn = fn,
+        .ctx = ctx,
+        .count = count,
+        .next = 0,
+        .pending = count,
+        .next_batch = NULL
+    };
+
+    pthread_mutex_lock(&jobs_lock);
+
+    jobs_batch_t **tail = &jobs_queue;
+    while (*tail != NULL) {
+        tail = &(*tail)->next_batch;
+    }
+    *tail = &batch;
+    pthread_cond_broadcast(&jobs_work_cond);
+
+    /* Help out with our own batch rather than sleeping on it */
+    while (batch.next < batch.count) {
+        size_t index = batch.next++;
+        if (batch.next == batch.count) {
+            for (tail = &jobs_queue; *tail != &batch;
+                    tail = &(*tail)->next_batch) {
+            }
+            *tail = batch.next_batch;
+        }
+        jobs_execute(&batch, index);
+    }
+
+    while (batch.pending > 0) {
+        pthread_cond_wait(&jobs_done_cond, &jobs_lock);
+    }
+
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+/**
+ * Returns the number of threads in the worker pool, not counting threads
+ * that submit work.
+ */
+size_t jobs_get_worker_count()
+{
+    pthread_once(&jobs_once, jobs_init);
+    return jobs_worker_count;
+}
+
+const struct jobs_namespace Jobs = {
+    .run = jobs_run,
+    .workerCount = jobs_get_worker_count
+};
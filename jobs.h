@@ -0,0 +1,33 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stddef.h>
+
+/**
+ * A function run by the worker pool. \p ctx is shared by every call in a
+ * batch and \p index identifies which item of the batch to process.
+ */
+typedef void (*jobs_fn_t)(void *ctx, size_t index);
+
+extern const struct jobs_namespace {
+    void (* const run)(size_t count, jobs_fn_t fn, void *ctx);
+    size_t (* const workerCount)();
+} Jobs;
+
+#endif
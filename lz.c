@@ -0,0 +1,289 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file lz.c
+ *
+ * A small byte-oriented LZ77 codec in the style of LZ4, used for compressed
+ * PAK archives. A block is a series of sequences, each made of:
+ *
+ * - a token byte whose high nibble is the literal count and whose low nibble
+ *   is the match length minus LZ_MIN_MATCH, where 15 in either nibble means
+ *   more length bytes follow (each adding up to 255, ending at the first byte
+ *   below 255);
+ * - the extra literal length bytes, then the literals themselves;
+ * - a 16-bit little-endian match offset and the extra match length bytes.
+ *
+ * The last sequence of a block has literals only and ends at the end of the
+ * block. The decoder checks every length and offset against both buffers, so
+ * a corrupt block fails to decode rather than reading or writing out of
+ * bounds.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH  (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS  (14)
+
+/**
+ * Returns the largest size that compressing \p size bytes can produce, for
+ * input that does not compress at all.
+ */
+size_t lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static inline uint32_t lz_hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Writes the extension bytes for a length whose nibble was saturated.
+ * @return The new output position, or NULL if \p end would be passed
+ */
+static uint8_t *lz_write_length(uint8_t *op, const uint8_t *end, size_t len)
+{
+    while (len >= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * Writes one sequence of \p lit_len literals starting at \p lit, followed by a
+ * match of \p match_len bytes at \p offset, or no match if \p match_len is 0.
+ * @return The new output position, or NULL if \p end would be passed
+ */
+static uint8_t *lz_write_sequence(uint8_t *op, const uint8_t *end,
+        const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    if (op >= end) {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    *token = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) |
+            (match_code < 15 ? match_code : 15));
+
+    if (lit_len >= 15 && (op = lz_write_length(op, end, lit_len - 15)) == NULL) {
+        return NULL;
+    }
+
+    if ((size_t)(end - op) < lit_len) {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    if (match_code >= 15 &&
+            (op = lz_write_length(op, end, match_code - 15)) == NULL) {
+        return NULL;
+    }
+
+    return op;
+}
+
+/**
+ * Compresses \p src_size bytes from \p src into \p dst.
+ * @param src The data to be compressed
+ * @param src_size The size in bytes of \p src
+ * @param dst The buffer to receive the compressed data
+ * @param dst_capacity The size in bytes of \p dst
+ * @return The size of the compressed data, or 0 if it does not fit in
+ * \p dst_capacity bytes. Passing a buffer of at least lz_bound(src_size)
+ * bytes guarantees success.
+ */
+size_t lz_compress(const void *src, size_t src_size, void *dst,
+        size_t dst_capacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t * const base = src;
+    const uint8_t * const in_end = base + src_size;
+    uint8_t *op = dst;
+    const uint8_t * const out_end = op + dst_capacity;
+
+    /* Positions plus one of the last occurrence of each hashed 4-byte run */
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof table);
+
+    const uint8_t *anchor = ip;
+    if (src_size >= LZ_MIN_MATCH) {
+        const uint8_t * const match_limit = in_end - LZ_MIN_MATCH;
+        while (ip <= match_limit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = lz_hash(seq);
+            size_t candidate = table[h];
+            table[h] = (uint32_t)(ip - base) + 1;
+
+            if (candidate == 0 ||
+                    (size_t)(ip - base) - (candidate - 1) > LZ_MAX_OFFSET ||
+                    lz_read32(base + candidate - 1) != seq) {
+                ip += 1;
+                continue;
+            }
+
+            const uint8_t *match = base + candidate - 1;
+            size_t len = LZ_MIN_MATCH;
+            while (ip + len < in_end && ip[len] == match[len]) {
+                len += 1;
+            }
+
+            op = lz_write_sequence(op, out_end, anchor, ip - anchor,
+                    ip - match, len);
+            if (op == NULL) {
+                return 0;
+            }
+
+            ip += len;
+            anchor = ip;
+        }
+    }
+
+    op = lz_write_sequence(op, out_end, anchor, in_end - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return op - (uint8_t *)dst;
+}
+
+/**
+ * Reads the extension bytes of a saturated length.
+ * @return False if the input ends first
+ */
+static bool lz_read_length(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+/**
+ * Decompresses the block of \p src_size bytes at \p src into \p dst, which
+ * must be exactly as large as the original data.
+ * @param src The compressed block
+ * @param src_size The size in bytes of \p src
+ * @param dst The buffer to receive the original data
+ * @param dst_size The size in bytes of the original data
+ * @return True on success, false if the block is corrupt
+ */
+bool lz_decompress(const void *src, size_t src_size, void *dst,
+        size_t dst_size)
+{
+    const uint8_t *ip = src;
+    const uint8_t * const in_end = ip + src_size;
+    uint8_t *op = dst;
+    uint8_t * const out = dst;
+    uint8_t * const out_end = op + dst_size;
+
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_read_length(&ip, in_end, &lit_len)) {
+            return false;
+        }
+        if ((size_t)(in_end - ip) < lit_len ||
+                (size_t)(out_end - op) < lit_len) {
+            return false;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        /* The final sequence carries literals only */
+        if (ip == in_end) {
+            break;
+        }
+
+        if (in_end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t match_len = token & 0x0f;
+        if (match_len == 15 && !lz_read_length(&ip, in_end, &match_len)) {
+            return false;
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - out) ||
+                (size_t)(out_end - op) < match_len) {
+            return false;
+        }
+
+        /* Matches may overlap their own output, so copy forward bytewise */
+        const uint8_t *match = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, match, match_len);
+            op += match_len;
+        } else {
+            for (size_t i = 0; i < match_len; i++) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op == out_end;
+}
+
+const struct lz_namespace LZ = {
+    .bound = lz_bound,
+    .compress = lz_compress,
+    .decompress = lz_decompress
+};
@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,8 +25,11 @@
 #include <GL/glew.h>
 #include "vecmath.h"
 
+#include "cache.h"
+#include "derived.h"
 #include "mdl.h"
 #include "file.h"
+#include "trace.h"
 
 #define MDL_MAGIC (0x4F504449)
 #define MDL_VERSION (6)
@@ -124,6 +128,34 @@ typedef struct mdl
     mdl_frame_t    *frames;
 } mdl_t;
 
+/*
+ * The OpenGL objects made for a model by model_send_to_opengl().
+ */
+typedef struct mdl_gl
+{
+    /*
+     * OpenGL ID of the buffer object where the model's frames are stored.
+     */
+    GLuint  vertex_buffer;
+
+    /*
+     * OpenGL ID of the buffer object where the model's texture coordinates
+     * are stored.
+     */
+    GLuint  texcoord_buffer;
+
+    /*
+     * An array of OpenGL texture objects containing the skins from the model.
+     */
+    int     texture_count;
+    GLuint *textures;
+
+    /*
+     * The next objects waiting to be deleted, once the model is freed.
+     */
+    struct mdl_gl *next;
+} mdl_gl_t;
+
 typedef struct mdl_model
 {
     /*
@@ -155,63 +187,51 @@ typedef struct mdl_model
      */
     float *frame_durations;
 
-    /*
-     * The index of the current or past frame. This is used to provide OpenGL
-     * the first set of vertices for interpolation.
-     */
-    int frame_index;
-
-    int next_frame_index;
-
-    /*
-     * The first and last frames of this mode's idle animation. This will play
-     * when no other animation is in progress.
-     */
-    int idle_first;
-    int idle_last;
-
-    /*
-     * The first and last frames of the model's current animation.
-     */
-    int anim_first;
-    int anim_last;
-
-    /*
-     * Determines whether or not the model's current animation should stop
-     * (like in death animations) or repeat (like in idle, walking, etc.).
-     */
-    bool anim_stop;
-
     int skin_count;
     int skin_width;
     int skin_height;
-    int skin_index;
     uint8_t *skins;
 
     float *texcoords;
 
     /*
-     * OpenGL ID of the buffer object where this model's frames are stored.
+     * The model's OpenGL objects, or NULL until it is sent to OpenGL.
      */
-    GLuint  vertex_buffer;
+    mdl_gl_t *gl;
 
     /*
-     * An array of OpenGL texture objects containing the skins from this model.
+     * The model's entry in the derived cache, if it was loaded from there. The
+     * frames, skins, texture coordinates and frame durations then point into
+     * it rather than being allocated.
      */
-    GLuint *textures;
-
-    /*
-     * OpenGL ID of the buffer object where this model's texture coordinates are
-     * stored.
-     */
-    GLuint  texcoord_buffer;
-
-    float position[3];
-    float rotation[3];
-    float scale[3];
+    derived_t *derived;
 }
 model_t;
 
+/*
+ * Sections of a model's entry in the derived cache
+ */
+enum {
+    MDL_DERIVED_COUNTS,
+    MDL_DERIVED_SKINS,
+    MDL_DERIVED_TEXCOORDS,
+    MDL_DERIVED_FRAMES,
+    MDL_DERIVED_NAMES,
+    MDL_DERIVED_DURATIONS,
+    MDL_DERIVED_SECTIONS
+};
+
+#define MDL_FRAME_NAME_SIZE (16)
+
+typedef struct mdl_derived_counts
+{
+    int32_t frame_count;
+    int32_t vertex_count;
+    int32_t skin_count;
+    int32_t skin_w;
+    int32_t skin_h;
+} mdl_derived_counts_t;
+
 bool mdl_header_valid(const mdl_header_t * const header)
 {
     if (header->magic != MDL_MAGIC) {
@@ -241,21 +261,172 @@ bool mdl_header_valid(const mdl_header_t * const header)
     return true;
 }
 
+/*
+ * Return section index of the given derived cache entry if it is exactly size
+ * bytes long, or NULL.
+ */
+static const void *mdl_derived_section(const derived_t *derived, int index,
+        size_t size)
+{
+    size_t actual;
+    const void *data = Derived.section(derived, index, &actual);
+    return actual == size ? data : NULL;
+}
+
+/*
+ * Fill in dest from its entry in the derived cache, which it takes ownership
+ * of. Return false, leaving dest untouched, if the entry is not complete.
+ */
+bool mdl_use_derived(model_t *dest, derived_t *derived)
+{
+    const mdl_derived_counts_t *counts = mdl_derived_section(derived,
+            MDL_DERIVED_COUNTS, sizeof *counts);
+    if (counts == NULL || counts->frame_count < 0 ||
+            counts->vertex_count < 0 || counts->skin_count < 0 ||
+            counts->skin_w < 0 || counts->skin_h < 0) {
+        return false;
+    }
+
+    size_t frame_count = counts->frame_count;
+    size_t vertex_count = counts->vertex_count;
+    size_t skin_bytes = 4 * (size_t)counts->skin_w * counts->skin_h;
+
+    const uint8_t *skins = mdl_derived_section(derived, MDL_DERIVED_SKINS,
+            counts->skin_count * skin_bytes);
+    const float *texcoords = mdl_derived_section(derived,
+            MDL_DERIVED_TEXCOORDS, 2 * vertex_count * sizeof *texcoords);
+    const float *frames = mdl_derived_section(derived, MDL_DERIVED_FRAMES,
+            3 * frame_count * vertex_count * sizeof *frames);
+    const char *names = mdl_derived_section(derived, MDL_DERIVED_NAMES,
+            frame_count * MDL_FRAME_NAME_SIZE);
+    const float *durations = mdl_derived_section(derived,
+            MDL_DERIVED_DURATIONS, frame_count * sizeof *durations);
+    if (skins == NULL || texcoords == NULL || frames == NULL ||
+            names == NULL || durations == NULL) {
+        return false;
+    }
+
+    char **frame_names = calloc(frame_count, sizeof *frame_names);
+    if (frame_names == NULL) {
+        return false;
+    }
+
+    for (size_t f = 0; f < frame_count; f++) {
+        const char *name = names + f * MDL_FRAME_NAME_SIZE;
+        int name_len = strnlen(name, MDL_FRAME_NAME_SIZE);
+        frame_names[f] = calloc(name_len + 1, sizeof **frame_names);
+        if (frame_names[f] == NULL) {
+            for (size_t g = 0; g < f; g++) {
+                free(frame_names[g]);
+            }
+            free(frame_names);
+            return false;
+        }
+        memcpy(frame_names[f], name, name_len);
+    }
+
+    dest->frame_count = frame_count;
+    dest->vertex_count = vertex_count;
+    dest->frames = (float *)frames;
+    dest->frame_names = frame_names;
+    dest->frame_durations = (float *)durations;
+
+    dest->skin_count = counts->skin_count;
+    dest->skin_width = counts->skin_w;
+    dest->skin_height = counts->skin_h;
+    dest->skins = (uint8_t *)skins;
+    dest->texcoords = (float *)texcoords;
+    dest->derived = derived;
+    return true;
+}
+
+/*
+ * Save everything derived from the MDL file with the given content hash to the
+ * derived cache.
+ */
+void mdl_save_derived(const model_t *model, uint64_t hash)
+{
+    mdl_derived_counts_t counts = {
+        .frame_count = model->frame_count,
+        .vertex_count = model->vertex_count,
+        .skin_count = model->skin_count,
+        .skin_w = model->skin_width,
+        .skin_h = model->skin_height
+    };
+
+    char *names = calloc(model->frame_count, MDL_FRAME_NAME_SIZE);
+    if (names == NULL && model->frame_count > 0) {
+        return;
+    }
+    for (int f = 0; f < model->frame_count; f++) {
+        strncpy(names + f * MDL_FRAME_NAME_SIZE, model->frame_names[f],
+                MDL_FRAME_NAME_SIZE);
+    }
+
+    size_t frame_count = model->frame_count;
+    size_t vertex_count = model->vertex_count;
+    const derived_section_t sections[MDL_DERIVED_SECTIONS] = {
+        [MDL_DERIVED_COUNTS] = { &counts, sizeof counts },
+        [MDL_DERIVED_SKINS] = { model->skins,
+                4 * (size_t)model->skin_count * model->skin_width *
+                model->skin_height },
+        [MDL_DERIVED_TEXCOORDS] = { model->texcoords,
+                2 * vertex_count * sizeof *model->texcoords },
+        [MDL_DERIVED_FRAMES] = { model->frames,
+                3 * frame_count * vertex_count * sizeof *model->frames },
+        [MDL_DERIVED_NAMES] = { names, frame_count * MDL_FRAME_NAME_SIZE },
+        [MDL_DERIVED_DURATIONS] = { model->frame_durations,
+                frame_count * sizeof *model->frame_durations }
+    };
+
+    Derived.save("mdl", hash, 0, sections, MDL_DERIVED_SECTIONS);
+    free(names);
+}
+
 model_t *model_from_mdl(const char *path)
 {
     model_t *dest = calloc(1, sizeof *dest);
 
-    uint8_t *mdl_data = File.readFile(path);
+    /*
+     * The model keeps nothing that points into the file, so it is read into a
+     * copy of its own that is freed once the model is built.
+     */
+    uint64_t trace = Trace.begin();
+    size_t mdl_size;
+    uint8_t *mdl_data = File.copyFile(path, &mdl_size);
     if (mdl_data == NULL) {
         perror(path);
+        free(dest);
         return NULL;
     }
 
     const mdl_header_t * const header = (mdl_header_t *)mdl_data;
     if (!mdl_header_valid(header)) {
+        free(mdl_data);
+        free(dest);
         return NULL;
     }
 
+    /*
+     * If the skins and frames have been expanded before, they are mapped from
+     * the derived cache rather than expanded again.
+     */
+    uint64_t hash;
+    bool keyed = File.contentHash(path, &hash);
+    if (keyed) {
+        derived_t *derived = Derived.open("mdl", hash, 0,
+                MDL_DERIVED_SECTIONS);
+        if (derived != NULL) {
+            if (mdl_use_derived(dest, derived)) {
+                Trace.end(trace, TRACE_MODEL_LOAD, path, "derived", mdl_size,
+                        false);
+                free(mdl_data);
+                return dest;
+            }
+            Derived.close(derived);
+        }
+    }
+
     const int skin_pixels = header->skin_w * header->skin_h;
     const int skin_bytes = skin_pixels * 4;
 
@@ -412,7 +583,7 @@ model_t *model_from_mdl(const char *path)
 
             int name_len = strnlen(single->name, 16);
             frame_names[f] = calloc(name_len + 1, sizeof **frame_names);
-            strncpy(frame_names[f], single->name, 16);
+            memcpy(frame_names[f], single->name, name_len);
 
             for (int tri = 0; tri < header->triangle_count; tri++) {
                 for (int vert = 0; vert < 3; vert++) {
@@ -442,15 +613,19 @@ model_t *model_from_mdl(const char *path)
     dest->frames = vertices;
     dest->frame_names = frame_names;
     dest->frame_durations = frame_durations;
-    dest->frame_index = 0;
 
     dest->skin_count = header->skin_count;
     dest->skin_width = header->skin_w;
     dest->skin_height = header->skin_h;
     dest->skins = skins;
-    dest->skin_index = 0;
     dest->texcoords = texcoords;
 
+    if (keyed) {
+        mdl_save_derived(dest, hash);
+    }
+
+    Trace.end(trace, TRACE_MODEL_LOAD, path, NULL, mdl_size, false);
+    free(mdl_data);
     return dest;
 }
 
@@ -467,20 +642,46 @@ int mdl_get_skin_size(const model_t *model)
     return 4 * model->skin_width * model->skin_height * sizeof *model->skins;
 }
 
+/*
+ * OpenGL objects of models that have been freed but not yet deleted. The asset
+ * cache may free a model on any thread, but its OpenGL objects can only be
+ * deleted on the thread that owns the context, so they wait here until
+ * model_delete_freed() is called there.
+ */
+static pthread_mutex_t mdl_gl_free_lock = PTHREAD_MUTEX_INITIALIZER;
+static mdl_gl_t *mdl_gl_freed = NULL;
+
+/*
+ * Upload the given model to OpenGL. Models are shared, so this does nothing if
+ * the model has been uploaded already. Must be called on the thread that owns
+ * the OpenGL context.
+ */
 void model_send_to_opengl(model_t *model)
 {
-    glGenBuffers(1, &model->vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, model->vertex_buffer);
+    if (model->gl != NULL) {
+        return;
+    }
+
+    mdl_gl_t *gl = calloc(1, sizeof *gl);
+    GLuint *textures = calloc(model->skin_count, sizeof *textures);
+    if (gl == NULL || (textures == NULL && model->skin_count > 0)) {
+        fputs("Failed to allocate OpenGL objects for model.\n", stderr);
+        exit(EXIT_FAILURE);
+    }
+    gl->textures = textures;
+    gl->texture_count = model->skin_count;
+
+    glGenBuffers(1, &gl->vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, gl->vertex_buffer);
     glBufferData(GL_ARRAY_BUFFER,
             model->frame_count * 3 * model->vertex_count * sizeof *model->frames,
             model->frames,
             GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    model->textures = calloc(model->skin_count, sizeof *model->textures);
-    glGenTextures(model->skin_count, model->textures);
+    glGenTextures(model->skin_count, gl->textures);
     for (int i = 0; i < model->skin_count; i++) {
-        glBindTexture(GL_TEXTURE_2D, model->textures[i]);
+        glBindTexture(GL_TEXTURE_2D, gl->textures[i]);
         vec4_t border_color = { 0.0f, 0.0f, 0.0f, 1.0f };
         glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border_color);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
@@ -492,33 +693,71 @@ void model_send_to_opengl(model_t *model)
                 model->skins + i * mdl_get_skin_size(model));
     }
 
-    glGenBuffers(1, &model->texcoord_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, model->texcoord_buffer);
+    glGenBuffers(1, &gl->texcoord_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, gl->texcoord_buffer);
     glBufferData(GL_ARRAY_BUFFER,
             model->vertex_count * 2 * sizeof *model->texcoords,
             model->texcoords,
             GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    model->gl = gl;
+}
+
+/*
+ * Delete the OpenGL objects of every model freed since the last call. Must be
+ * called on the thread that owns the OpenGL context, such as once a frame.
+ */
+void model_delete_freed()
+{
+    pthread_mutex_lock(&mdl_gl_free_lock);
+    mdl_gl_t *gl = mdl_gl_freed;
+    mdl_gl_freed = NULL;
+    pthread_mutex_unlock(&mdl_gl_free_lock);
+
+    while (gl != NULL) {
+        mdl_gl_t *next = gl->next;
+        glDeleteTextures(gl->texture_count, gl->textures);
+        glDeleteBuffers(1, &gl->vertex_buffer);
+        glDeleteBuffers(1, &gl->texcoord_buffer);
+        free(gl->textures);
+        free(gl);
+        gl = next;
+    }
+}
+
+/*
+ * Start the given instance of a model on its first frame and skin.
+ */
+void model_init_instance(model_instance_t *instance, const model_t *model)
+{
+    memset(instance, 0, sizeof *instance);
+    instance->model = model;
+    instance->scale[0] = 1.0f;
+    instance->scale[1] = 1.0f;
+    instance->scale[2] = 1.0f;
 }
 
-void model_draw(const model_t *model)
+void model_draw(const model_instance_t *instance)
 {
+    const model_t *model = instance->model;
+
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
     glEnableVertexAttribArray(2);
 
-    glBindBuffer(GL_ARRAY_BUFFER, model->vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, model->gl->vertex_buffer);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0,
-            (void *)(model->frame_index * model->vertex_count * 3 *
+            (void *)(instance->frame_index * model->vertex_count * 3 *
                 sizeof *model->frames));
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0,
-            (void *)(model->next_frame_index * model->vertex_count * 3 *
+            (void *)(instance->next_frame_index * model->vertex_count * 3 *
                 sizeof *model->frames));
 
-    glBindBuffer(GL_ARRAY_BUFFER, model->texcoord_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, model->gl->texcoord_buffer);
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, NULL);
 
-    glBindTexture(GL_TEXTURE_2D, model->textures[0]);
+    glBindTexture(GL_TEXTURE_2D, model->gl->textures[instance->skin_index]);
     glDrawArrays(GL_TRIANGLES, 0, model->vertex_count);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -528,61 +767,151 @@ void model_draw(const model_t *model)
     glDisableVertexAttribArray(2);
 }
 
-void model_inc_frame_index(model_t *model)
+void model_inc_frame_index(model_instance_t *instance)
 {
     puts("Incrementing frame index.");
-    model->frame_index = model->next_frame_index;
-    model->next_frame_index += 1;
-    if (model->next_frame_index >= model->frame_count) {
+    instance->frame_index = instance->next_frame_index;
+    instance->next_frame_index += 1;
+    if (instance->next_frame_index >= instance->model->frame_count) {
         puts("Frame index went above frame count, wrapping to zero.");
-        model->next_frame_index = 0;
+        instance->next_frame_index = 0;
     }
-    printf("Frame %d -> %d\n", model->frame_index, model->next_frame_index);
+    printf("Frame %d -> %d\n", instance->frame_index,
+            instance->next_frame_index);
 }
 
-void model_dec_frame_index(model_t *model)
+void model_dec_frame_index(model_instance_t *instance)
 {
     puts("Decrementing frame index.");
-    model->frame_index = model->next_frame_index;
-    model->next_frame_index -= 1;
-    if (model->next_frame_index < 0) {
+    instance->frame_index = instance->next_frame_index;
+    instance->next_frame_index -= 1;
+    if (instance->next_frame_index < 0) {
         puts("Frame index went below zero, wrapping to frame count.");
-        model->next_frame_index = model->frame_count - 1;
+        instance->next_frame_index = instance->model->frame_count - 1;
     }
-    printf("Frame %d -> %d\n", model->frame_index, model->next_frame_index);
+    printf("Frame %d -> %d\n", instance->frame_index,
+            instance->next_frame_index);
 }
 
-void model_set_frame_index(model_t *model, int index)
+void model_set_frame_index(model_instance_t *instance, int index)
 {
     printf("Setting frame index to %d\n", index);
-    if (index >= model->frame_count) {
+    if (index >= instance->model->frame_count) {
         fprintf(stderr, "Frame index %d out out of bounds [0, %d]\n",
-                index, model->frame_count - 1);
+                index, instance->model->frame_count - 1);
     } else {
-        model->frame_index = index;
+        instance->frame_index = index;
     }
 }
 
-void model_set_idle_animation(model_t *model, int first, int last)
+void model_set_idle_animation(model_instance_t *instance, int first, int last)
 {
+    const model_t *model = instance->model;
     if (first < 0 || first >= model->frame_count ||
             last  < 0 || last  >= model->frame_count) {
         return;
     }
 
-    model->idle_first = first;
-    model->idle_last = last;
+    instance->idle_first = first;
+    instance->idle_last = last;
 }
 
-void model_set_animation(model_t *model, int first, int last)
+void model_set_animation(model_instance_t *instance, int first, int last)
+{
+}
+
+/*
+ * Free the given model. Its OpenGL objects, if it has any, are left for
+ * model_delete_freed() to delete on the thread that owns the context, so this
+ * may be called from any thread.
+ */
+void model_free(model_t *model)
+{
+    if (model == NULL) {
+        return;
+    }
+
+    if (model->gl != NULL) {
+        pthread_mutex_lock(&mdl_gl_free_lock);
+        model->gl->next = mdl_gl_freed;
+        mdl_gl_freed = model->gl;
+        pthread_mutex_unlock(&mdl_gl_free_lock);
+    }
+
+    if (model->frame_names != NULL) {
+        for (int i = 0; i < model->frame_count; i++) {
+            free(model->frame_names[i]);
+        }
+    }
+
+    free(model->frame_names);
+
+    if (model->derived != NULL) {
+        Derived.close(model->derived);
+    } else {
+        free(model->frame_durations);
+        free(model->frames);
+        free(model->skins);
+        free(model->texcoords);
+    }
+    free(model);
+}
+
+/*
+ * Return the number of bytes of memory held by the given model.
+ */
+size_t model_size(const model_t *model)
+{
+    return sizeof *model +
+        model->frame_count * (mdl_get_frame_size(model) +
+            sizeof *model->frame_durations + sizeof *model->frame_names + 16) +
+        model->skin_count * mdl_get_skin_size(model) +
+        model->vertex_count * 2 * sizeof *model->texcoords;
+}
+
+void *model_cache_load(const char *path, size_t *size)
+{
+    model_t *model = model_from_mdl(path);
+    if (model != NULL) {
+        *size = model_size(model);
+    }
+
+    return model;
+}
+
+void model_cache_free(void *model)
+{
+    model_free(model);
+}
+
+static const cache_loader_t model_cache_loader = {
+    .name = "mdl",
+    .trace_kind = TRACE_MODEL_LOAD,
+    .load = model_cache_load,
+    .free = model_cache_free
+};
+
+/*
+ * Return a handle to the model at the given path through the asset cache,
+ * loading it only if it is not already cached. The model is retrieved with
+ * Cache.get() and is shared, so it must not be freed by the caller; the handle
+ * is passed to Cache.release() instead. Each entity drawn with the model keeps
+ * its own model_instance_t.
+ */
+cache_handle_t *model_acquire(const char *path)
 {
+    return Cache.acquire(&model_cache_loader, path);
 }
 
 const struct model_namespace Model = {
+    .initInstance = model_init_instance,
     .draw = model_draw,
     .decFrameIndex = model_dec_frame_index,
     .incFrameIndex = model_inc_frame_index,
     .fromMDL = model_from_mdl,
     .sendToOpenGL = model_send_to_opengl,
-    .setIdleAnimation = model_set_idle_animation
+    .deleteFreed = model_delete_freed,
+    .setIdleAnimation = model_set_idle_animation,
+    .acquire = model_acquire,
+    .free = model_free
 };
@@ -18,17 +18,68 @@
 #define MDL_H
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "cache.h"
+
 typedef struct mdl_model model_t;
 
+/*
+ * One entity drawn with a model. A model is shared by every entity that uses
+ * it through the asset cache, so everything that differs from one entity to
+ * the next lives here instead.
+ */
+typedef struct {
+    const model_t *model;
+
+    /*
+     * The index of the current or past frame. This is used to provide OpenGL
+     * the first set of vertices for interpolation.
+     */
+    int frame_index;
+
+    int next_frame_index;
+
+    /*
+     * The first and last frames of this entity's idle animation. This will
+     * play when no other animation is in progress.
+     */
+    int idle_first;
+    int idle_last;
+
+    /*
+     * The first and last frames of the entity's current animation.
+     */
+    int anim_first;
+    int anim_last;
+
+    /*
+     * Determines whether or not the entity's current animation should stop
+     * (like in death animations) or repeat (like in idle, walking, etc.).
+     */
+    bool anim_stop;
+
+    int skin_index;
+
+    float position[3];
+    float rotation[3];
+    float scale[3];
+} model_instance_t;
+
 extern const struct model_namespace {
-    void (* const draw)(const model_t *model);
-    void (* const decFrameIndex)(model_t *model);
-    void (* const incFrameIndex)(model_t *model);
+    void (* const initInstance)(model_instance_t *instance,
+            const model_t *model);
+    void (* const draw)(const model_instance_t *instance);
+    void (* const decFrameIndex)(model_instance_t *instance);
+    void (* const incFrameIndex)(model_instance_t *instance);
     model_t *(* const fromMDL)(const char *path);
     void (* const sendToOpenGL)(model_t *model);
-    void (* const setIdleAnimation)(model_t *model, int first, int last);
+    void (* const deleteFreed)();
+    void (* const setIdleAnimation)(model_instance_t *instance, int first,
+            int last);
+    cache_handle_t *(* const acquire)(const char *path);
+    void (* const free)(model_t *model);
 } Model;
 
 #endif
@@ -16,91 +16,961 @@
 
 /** @file pak.c */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "aio.h"
 #include "engine.h"
 #include "file.h"
+#include "jobs.h"
+#include "lz.h"
 #include "pak.h"
-
-#define PAK_MAX_PATH_LENGTH (56)
+#include "trace.h"
+#include "utils.h"
 
 /** Handle to a file in a PAK archive. */
 typedef struct {
     /** The path to this file in the PAK archive. */
     const char *path;
 
+    /** The hash of \p path, as computed by Utils.hashString. */
+    uint32_t hash;
+
+    /**
+     * The offset in bytes of this file from the beginning of the archive, or
+     * the index of its first chunk if the archive is compressed.
+     */
+    size_t offset;
+
     /** The size in bytes of this file. */
     size_t size;
 
-    /** A pointer to the data in this file. */
+    /**
+     * A pointer to the data in this file. For streamed and compressed
+     * archives, this is NULL until the file is first loaded.
+     */
     const void *data;
 } pak_file_t;
 
+/** Describes how the contents of a PAK archive are held in memory. */
+typedef enum {
+    /** The whole archive was read onto the heap. */
+    PAK_BACKING_HEAP,
+
+    /** The archive is a read-only mapping of the file on disk. */
+    PAK_BACKING_MAPPED,
+
+    /**
+     * Only the directory is held in memory. Files are read from disk on first
+     * access and kept until the archive is closed.
+     */
+    PAK_BACKING_STREAMED
+} pak_backing_t;
+
 /** Internal representation of a PAK archive. */
 typedef struct pak_s {
+    /** The path the archive was opened from. */
+    char       *path;
+
+    /** How \p data was obtained, and therefore how it must be released. */
+    pak_backing_t backing;
+
+    /** The raw contents of the archive, or NULL if it is streamed. */
+    void       *data;
+
+    /** The size in bytes of the archive. */
+    size_t      size;
+
+    /** The open archive file if it is streamed, -1 otherwise. */
+    int         fd;
+
+    /** The directory read from a streamed archive, NULL otherwise. */
+    pak_stat_t *directory;
+
+    /** Whether file data is stored in compressed chunks. */
+    bool        compressed;
+
+    /** The uncompressed size in bytes of each chunk. */
+    size_t      chunk_size;
+
+    /** The chunk table of a compressed archive, NULL otherwise. */
+    const pakz_chunk_t *chunks;
+
+    /** The chunk table if it was read from a streamed archive. */
+    pakz_chunk_t *chunk_table;
+
     /** The number of files contained in this PAK archive. */
     size_t      file_count;
 
     /** An array of PAK file handles */
     pak_file_t *files;
+
+    /**
+     * Open-addressing hash table over \p files, keyed on each file's path
+     * hash. Each slot holds an index into \p files plus one, so that zero
+     * marks an empty slot. The table size is a power of two.
+     */
+    uint32_t   *index;
+
+    /** The number of slots in \p index minus one. */
+    size_t      index_mask;
+
+    /**
+     * The sorted view of the directory used for listing. Built and published
+     * atomically the first time the archive is listed.
+     */
+    struct pak_sorted_s *sorted;
 } pak_t;
 
+/**
+ * The files that lookups resolve to, ordered by path. Only the first of
+ * several files with the same path is included.
+ */
+typedef struct pak_sorted_s {
+    size_t count;
+    const pak_file_t *files[];
+} pak_sorted_t;
+
 void pak_print(const pak_t *pak)
 {
     for (size_t i = 0; i < pak->file_count; i++) {
-        puts(pak->files[i].path);
+        printf("%.56s\n", pak->files[i].path);
     }
 }
 
 /**
- * Loads a PAK archive from \p path and returns a handle to it.
- * @param path The path to the PAK file to be loaded
- * @return A handle to the PAK file specified by \p path
+ * Returns the index in \p pak's directory of the file at \p path, or -1 if
+ * \p pak contains no such file.
+ * @param pak The PAK archive to be searched
+ * @param path The path of the file to be found
+ * @param hash The hash of \p path, as computed by Utils.hashString
  */
-pak_t *pak_open(const char *path)
+ptrdiff_t pak_find(const pak_t *pak, const char *path, uint32_t hash)
 {
-    void *pak_data = File.loadFromDisk(path);
-    if (pak_data == NULL) {
-        return NULL;
+    for (size_t slot = hash & pak->index_mask; ;
+            slot = (slot + 1) & pak->index_mask) {
+        uint32_t entry = pak->index[slot];
+        if (entry == 0) {
+            return -1;
+        }
+
+        const pak_file_t *file = &pak->files[entry - 1];
+        if (file->hash == hash &&
+                strncmp(file->path, path, PAK_MAX_PATH_LENGTH) == 0) {
+            return entry - 1;
+        }
     }
+}
 
-    /* Check magic number */
-    pak_header_t *header = pak_data;
-    for (size_t i = 0; i < 4; i++) {
-        if (header->magic[i] != PAK_MAGIC[i]) {
-            Engine.error("PAK archive '%s' has bad magic number\n", path);
-            return NULL;
+/**
+ * Returns the index in \p pak's directory of the file at \p path, or -1 if
+ * \p pak contains no such file. Duplicate paths resolve to their first entry.
+ * @param pak The PAK archive to be searched
+ * @param path The path of the file to be found
+ */
+ptrdiff_t pak_find_path(const pak_t *pak, const char *path)
+{
+    return pak_find(pak, path, Utils.hashString(path, PAK_MAX_PATH_LENGTH));
+}
+
+/**
+ * Builds the hash index over the directory of \p pak. If a path appears in
+ * the directory more than once, the first entry wins.
+ * @param pak The PAK archive to be indexed
+ * @return True on success, false if the index could not be allocated
+ */
+bool pak_build_index(pak_t *pak)
+{
+    /* Keep the load factor at or below one half */
+    size_t slots = 16;
+    while (slots < 2 * pak->file_count) {
+        slots *= 2;
+    }
+
+    pak->index = calloc(slots, sizeof *pak->index);
+    if (pak->index == NULL) {
+        return false;
+    }
+    pak->index_mask = slots - 1;
+
+    for (size_t i = 0; i < pak->file_count; i++) {
+        pak_file_t *file = &pak->files[i];
+        file->hash = Utils.hashString(file->path, PAK_MAX_PATH_LENGTH);
+        if (pak_find(pak, file->path, file->hash) != -1) {
+            continue;
         }
+
+        size_t slot = file->hash & pak->index_mask;
+        while (pak->index[slot] != 0) {
+            slot = (slot + 1) & pak->index_mask;
+        }
+        pak->index[slot] = i + 1;
     }
 
+    return true;
+}
+
+/** Where the directory and, for compressed archives, chunk table lie. */
+typedef struct {
+    bool   compressed;
+    size_t file_count;
+    size_t dir_offset;
+    size_t dir_size;
+    size_t chunk_size;
+    size_t chunk_offset;
+    size_t chunk_count;
+} pak_layout_t;
+
+/**
+ * Checks that \p header describes a well-formed PAK or compressed PAK archive
+ * of \p size bytes and fills \p layout from it.
+ * @param path The path the archive was read from, used for error messages
+ * @param header The first bytes of the archive
+ * @param header_size The number of bytes available at \p header
+ * @param size The size in bytes of the archive
+ * @param layout Receives the layout of the archive
+ * @return True if the archive is well-formed, false otherwise
+ */
+bool pak_check_header(const char *path, const void *header,
+        size_t header_size, size_t size, pak_layout_t *layout)
+{
+    memset(layout, 0, sizeof *layout);
+
+    if (header_size >= sizeof (pakz_header_t) &&
+            memcmp(header, PAKZ_MAGIC, 4) == 0) {
+        const pakz_header_t *zheader = header;
+        if (zheader->chunk_size <= 0 || zheader->chunk_offset < 0 ||
+                zheader->chunk_count < 0 ||
+                (size_t)zheader->chunk_offset +
+                (size_t)zheader->chunk_count * sizeof (pakz_chunk_t) > size) {
+            Engine.error("PAK archive '%s' chunk table is out of bounds\n",
+                    path);
+            return false;
+        }
+
+        layout->compressed = true;
+        layout->chunk_size = zheader->chunk_size;
+        layout->chunk_offset = zheader->chunk_offset;
+        layout->chunk_count = zheader->chunk_count;
+    } else if (header_size < sizeof (pak_header_t)) {
+        Engine.error("PAK archive '%s' is too small\n", path);
+        return false;
+    } else if (memcmp(header, PAK_MAGIC, 4) != 0) {
+        Engine.error("PAK archive '%s' has bad magic number\n", path);
+        return false;
+    }
+
+    /* The directory fields are shared by both header formats */
+    const pak_header_t *pheader = header;
+
     /* Check archive size parity and calculate file count */
-    const pak_stat_t *directory = pak_data + header->offset;
-    if (header->size % sizeof *directory != 0) {
+    if (pheader->offset < 0 || pheader->size < 0 ||
+            (size_t)pheader->offset + (size_t)pheader->size > size) {
+        Engine.error("PAK archive '%s' directory is out of bounds\n", path);
+        return false;
+    }
+    if (pheader->size % sizeof (pak_stat_t) != 0) {
         Engine.error("PAK archive '%s' directory has bad size\n", path);
-        return NULL;
+        return false;
+    }
+
+    layout->dir_offset = pheader->offset;
+    layout->dir_size = pheader->size;
+    layout->file_count = pheader->size / sizeof (pak_stat_t);
+    return true;
+}
+
+/**
+ * Returns the number of chunks a compressed file of \p size bytes occupies.
+ */
+size_t pak_chunk_count(const pak_t *pak, size_t size)
+{
+    return (size + pak->chunk_size - 1) / pak->chunk_size;
+}
+
+/**
+ * Builds a handle to a PAK archive from its directory.
+ * @param path The path the archive was read from, used for error messages
+ * @param layout The layout of the archive, from pak_check_header()
+ * @param directory The directory of the archive
+ * @param chunks The chunk table of the archive, if it is compressed
+ * @param size The size in bytes of the archive
+ * @param data The contents of the archive, or NULL if it is streamed
+ * @return A handle to the PAK archive, or NULL on error
+ */
+pak_t *pak_parse(const char *path, const pak_layout_t *layout,
+        const pak_stat_t *directory, const pakz_chunk_t *chunks, size_t size,
+        void *data)
+{
+    size_t file_count = layout->file_count;
+
+    for (size_t i = 0; i < layout->chunk_count; i++) {
+        if (chunks[i].offset < 0 || chunks[i].size < 0 ||
+                (size_t)chunks[i].size > LZ.bound(layout->chunk_size) ||
+                (size_t)chunks[i].offset + (size_t)chunks[i].size > size) {
+            Engine.error("Chunk %zu in PAK archive '%s' is out of bounds\n",
+                    i, path);
+            return NULL;
+        }
     }
-    size_t file_count = header->size / sizeof *directory;
 
     pak_file_t *files = calloc(file_count, sizeof *files);
-    if (files == NULL) {
+    if (files == NULL && file_count > 0) {
         Engine.error("Failed to allocate memory for files in PAK archive '%s'\n", path);
         return NULL;
     }
 
     for (size_t i = 0; i < file_count; i++) {
+        bool in_bounds = directory[i].offset >= 0 && directory[i].size >= 0;
+        if (in_bounds && layout->compressed) {
+            size_t chunk_count = (directory[i].size + layout->chunk_size - 1) /
+                    layout->chunk_size;
+            in_bounds = (size_t)directory[i].offset + chunk_count <=
+                    layout->chunk_count;
+        } else if (in_bounds) {
+            in_bounds = (size_t)directory[i].offset +
+                    (size_t)directory[i].size <= size;
+        }
+
+        if (!in_bounds) {
+            Engine.error("File %zu in PAK archive '%s' is out of bounds\n",
+                    i, path);
+            free(files);
+            return NULL;
+        }
+
         files[i].path = directory[i].path;
+        files[i].offset = directory[i].offset;
         files[i].size = directory[i].size;
-        files[i].data = (uint8_t *)pak_data + directory[i].offset;
+        if (data != NULL && !layout->compressed) {
+            files[i].data = (uint8_t *)data + directory[i].offset;
+        }
     }
 
     pak_t *pak = calloc(1, sizeof *pak);
+    if (pak == NULL) {
+        Engine.error("Failed to allocate memory for PAK archive '%s'\n", path);
+        free(files);
+        return NULL;
+    }
+
+    pak->path = strdup(path);
+    pak->data = data;
+    pak->size = size;
+    pak->fd = -1;
+    pak->compressed = layout->compressed;
+    pak->chunk_size = layout->chunk_size;
+    pak->chunks = chunks;
     pak->file_count = file_count;
     pak->files = files;
 
+    if (pak->path == NULL || !pak_build_index(pak)) {
+        Engine.error("Failed to index PAK archive '%s'\n", path);
+        free(pak->path);
+        free(files);
+        free(pak);
+        return NULL;
+    }
+
     return pak;
 }
 
+/**
+ * Parses the header and directory of the PAK archive held in \p data and
+ * returns a handle to it. On success, the handle takes ownership of \p data.
+ * @param path The path the archive was read from, used for error messages
+ * @param data The contents of the PAK archive
+ * @param size The size in bytes of \p data
+ * @param backing How \p data was obtained
+ * @return A handle to the PAK archive, or NULL on error
+ */
+pak_t *pak_parse_memory(const char *path, void *data, size_t size,
+        pak_backing_t backing)
+{
+    pak_layout_t layout;
+    if (!pak_check_header(path, data, size, size, &layout)) {
+        return NULL;
+    }
+
+    const pak_stat_t *directory =
+            (const pak_stat_t *)((uint8_t *)data + layout.dir_offset);
+    const pakz_chunk_t *chunks =
+            (const pakz_chunk_t *)((uint8_t *)data + layout.chunk_offset);
+    pak_t *pak = pak_parse(path, &layout, directory, chunks, size, data);
+    if (pak != NULL) {
+        pak->backing = backing;
+    }
+
+    return pak;
+}
+
+/**
+ * Loads a PAK archive from \p path onto the heap and returns a handle to it.
+ * @param path The path to the PAK file to be loaded
+ * @return A handle to the PAK file specified by \p path
+ */
+pak_t *pak_open(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return NULL;
+    }
+
+    void *pak_data = File.loadFromDisk(path);
+    if (pak_data == NULL) {
+        return NULL;
+    }
+
+    pak_t *pak = pak_parse_memory(path, pak_data, st.st_size, PAK_BACKING_HEAP);
+    if (pak == NULL) {
+        free(pak_data);
+    }
+
+    return pak;
+}
+
+/**
+ * Maps the PAK archive at \p path read-only into memory and returns a handle
+ * to it. Unlike pak_open(), nothing but the header and directory is touched
+ * here; the pages holding each file are faulted in when the file is read.
+ * @param path The path to the PAK file to be mapped
+ * @return A handle to the PAK file specified by \p path, or NULL on error
+ */
+pak_t *pak_open_mapped(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *pak_data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    /* The mapping holds its own reference to the file */
+    close(fd);
+
+    if (pak_data == MAP_FAILED) {
+        Engine.error("Failed to map PAK archive '%s'\n", path);
+        return NULL;
+    }
+
+    /*
+     * Lookups walk the directory, so bring it in now rather than faulting it
+     * in a page at a time on the first few lookups.
+     */
+    const pak_header_t *header = pak_data;
+    if ((size_t)st.st_size >= sizeof *header && header->offset >= 0 &&
+            header->size > 0 &&
+            (size_t)header->offset + header->size <= (size_t)st.st_size) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = header->offset & ~(page - 1);
+        madvise((uint8_t *)pak_data + start,
+                header->offset + header->size - start, MADV_WILLNEED);
+    }
+
+    pak_t *pak = pak_parse_memory(path, pak_data, st.st_size,
+            PAK_BACKING_MAPPED);
+    if (pak == NULL) {
+        munmap(pak_data, st.st_size);
+    }
+
+    return pak;
+}
+
+/**
+ * Opens the PAK archive at \p path for streaming and returns a handle to it.
+ * Only the header and directory are read here. The file is kept open, and each
+ * file in the archive is read with a single positioned read the first time it
+ * is loaded, so resident memory grows only with the files actually used.
+ * @param path The path to the PAK file to be opened
+ * @return A handle to the PAK file specified by \p path, or NULL on error
+ */
+pak_t *pak_open_streamed(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    pakz_header_t header;
+    size_t header_size = (size_t)st.st_size < sizeof header ?
+            (size_t)st.st_size : sizeof header;
+    pak_layout_t layout;
+    if (!AsyncIO.readFull(fd, &header, header_size, 0) ||
+            !pak_check_header(path, &header, header_size, st.st_size,
+                &layout)) {
+        close(fd);
+        return NULL;
+    }
+
+    pak_stat_t *directory = calloc(layout.file_count, sizeof *directory);
+    pakz_chunk_t *chunks = calloc(layout.chunk_count, sizeof *chunks);
+    if ((directory == NULL && layout.file_count > 0) ||
+            (chunks == NULL && layout.chunk_count > 0)) {
+        Engine.error("Failed to allocate directory for PAK archive '%s'\n",
+                path);
+        free(chunks);
+        free(directory);
+        close(fd);
+        return NULL;
+    }
+
+    if (!AsyncIO.readFull(fd, directory, layout.dir_size, layout.dir_offset) ||
+            !AsyncIO.readFull(fd, chunks,
+                layout.chunk_count * sizeof *chunks, layout.chunk_offset)) {
+        Engine.error("Failed to read directory of PAK archive '%s'\n", path);
+        free(chunks);
+        free(directory);
+        close(fd);
+        return NULL;
+    }
+
+    pak_t *pak = pak_parse(path, &layout, directory, chunks, st.st_size,
+            NULL);
+    if (pak == NULL) {
+        free(chunks);
+        free(directory);
+        close(fd);
+        return NULL;
+    }
+
+    pak->backing = PAK_BACKING_STREAMED;
+    pak->fd = fd;
+    pak->directory = directory;
+    pak->chunk_table = chunks;
+
+    return pak;
+}
+
+/**
+ * Returns true if files loaded from \p pak are held in buffers of their own
+ * rather than pointing into the archive data.
+ */
+bool pak_owns_file_data(const pak_t *pak)
+{
+    return pak->backing == PAK_BACKING_STREAMED || pak->compressed;
+}
+
+/** Returns the data loaded for \p file, or NULL if it has not been loaded. */
+static inline const void *pak_file_data(const pak_file_t *file)
+{
+    return __atomic_load_n(&file->data, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Makes \p data the loaded data of \p file, unless another thread loaded the
+ * file first, in which case \p data is freed.
+ * @return The data loaded for \p file
+ */
+const void *pak_publish_file_data(pak_file_t *file, void *data)
+{
+    const void *expected = NULL;
+    if (__atomic_compare_exchange_n(&file->data, &expected, data, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return data;
+    }
+
+    free(data);
+    return expected;
+}
+
+/**
+ * Returns the range of the archive holding the compressed chunks of \p file.
+ * @param pak The compressed archive containing \p file
+ * @param file The file whose chunks are to be located
+ * @param start Receives the offset of the first byte of the range
+ * @return The size in bytes of the range
+ */
+size_t pak_chunk_span(const pak_t *pak, const pak_file_t *file, size_t *start)
+{
+    size_t count = pak_chunk_count(pak, file->size);
+    size_t lo = SIZE_MAX;
+    size_t hi = 0;
+    for (size_t i = 0; i < count; i++) {
+        const pakz_chunk_t *chunk = &pak->chunks[file->offset + i];
+        if ((size_t)chunk->offset < lo) {
+            lo = chunk->offset;
+        }
+        if ((size_t)chunk->offset + chunk->size > hi) {
+            hi = chunk->offset + chunk->size;
+        }
+    }
+
+    if (count == 0) {
+        lo = hi = 0;
+    }
+
+    *start = lo;
+    return hi - lo;
+}
+
+typedef struct {
+    const pak_t  *pak;
+    const pak_file_t *file;
+
+    /** The compressed data, starting at \p src_offset in the archive. */
+    const uint8_t *src;
+    size_t        src_offset;
+
+    uint8_t      *dst;
+
+    /** The number of chunks that failed to decode. */
+    size_t        failures;
+} pak_decode_t;
+
+/** Decodes one chunk of a compressed file. */
+void pak_decode_chunk(void *ctx, size_t index)
+{
+    pak_decode_t *decode = ctx;
+    const pak_t *pak = decode->pak;
+    const pak_file_t *file = decode->file;
+    const pakz_chunk_t *chunk = &pak->chunks[file->offset + index];
+
+    size_t start = index * pak->chunk_size;
+    size_t len = file->size - start < pak->chunk_size ?
+            file->size - start : pak->chunk_size;
+    const uint8_t *src = decode->src + (chunk->offset - decode->src_offset);
+
+    bool ok;
+    if ((size_t)chunk->size == len) {
+        memcpy(decode->dst + start, src, len);
+        ok = true;
+    } else {
+        ok = LZ.decompress(src, chunk->size, decode->dst + start, len);
+    }
+
+    if (!ok) {
+        __atomic_fetch_add(&decode->failures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Decompresses \p file into \p buf. Files spanning several chunks are decoded
+ * in parallel on the worker pool.
+ * @param pak The compressed archive containing \p file
+ * @param file The file to be decompressed
+ * @param src Archive data holding at least all of \p file's chunks
+ * @param src_offset The offset of \p src in the archive
+ * @param buf The buffer to receive the file
+ * @return True on success, false if any chunk is corrupt
+ */
+bool pak_decompress_file(const pak_t *pak, const pak_file_t *file,
+        const uint8_t *src, size_t src_offset, void *buf)
+{
+    pak_decode_t decode = {
+        .pak = pak,
+        .file = file,
+        .src = src,
+        .src_offset = src_offset,
+        .dst = buf,
+        .failures = 0
+    };
+
+    size_t count = pak_chunk_count(pak, file->size);
+    if (count == 1) {
+        pak_decode_chunk(&decode, 0);
+    } else {
+        Jobs.run(count, pak_decode_chunk, &decode);
+    }
+
+    if (decode.failures > 0) {
+        Engine.error("'%.56s' in PAK archive is corrupt.\n", file->path);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Releases the PAK archive \p pak and everything loaded from it. Pointers
+ * previously returned by pak_load_file() are invalid afterward.
+ * @param pak The PAK archive to be closed
+ */
+void pak_close(pak_t *pak)
+{
+    if (pak == NULL) {
+        return;
+    }
+
+    if (pak_owns_file_data(pak)) {
+        for (size_t i = 0; i < pak->file_count; i++) {
+            free((void *)pak->files[i].data);
+        }
+    }
+
+    switch (pak->backing) {
+    case PAK_BACKING_HEAP:
+        free(pak->data);
+        break;
+    case PAK_BACKING_MAPPED:
+        munmap(pak->data, pak->size);
+        break;
+    case PAK_BACKING_STREAMED:
+        free(pak->chunk_table);
+        free(pak->directory);
+        close(pak->fd);
+        break;
+    }
+
+    free(pak->sorted);
+    free(pak->index);
+    free(pak->files);
+    free(pak->path);
+    free(pak);
+}
+
+/**
+ * Reads the file at \p index in \p pak's directory into \p buf, which must
+ * be at least as large as the file.
+ * @param pak The PAK archive to be read from
+ * @param index The index of the file in \p pak's directory
+ * @param buf The buffer to be filled
+ * @return True on success, false on error
+ */
+bool pak_read_file_at(const pak_t *pak, size_t index, void *buf)
+{
+    if (index >= pak->file_count) {
+        Engine.error("File index %zu out of range in PAK archive.\n", index);
+        return false;
+    }
+
+    const pak_file_t *file = &pak->files[index];
+    const void *data = pak_file_data(file);
+    if (data != NULL) {
+        memcpy(buf, data, file->size);
+        return true;
+    }
+
+    if (pak->compressed && pak->data != NULL) {
+        return pak_decompress_file(pak, file, pak->data, 0, buf);
+    }
+
+    if (pak->compressed) {
+        size_t start;
+        size_t span = pak_chunk_span(pak, file, &start);
+        uint8_t *src = malloc(span);
+        if (src == NULL && span > 0) {
+            Engine.error("Failed to allocate memory for '%.56s'.\n",
+                    file->path);
+            return false;
+        }
+
+        bool ok = AsyncIO.readFull(pak->fd, src, span, start) &&
+                pak_decompress_file(pak, file, src, start, buf);
+        free(src);
+        return ok;
+    }
+
+    if (!AsyncIO.readFull(pak->fd, buf, file->size, file->offset)) {
+        Engine.error("Failed to read '%.56s' from PAK archive.\n", file->path);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Records a load of \p file, which started at \p trace and returned \p bytes
+ * bytes, with Trace. A failed load is recorded with no bytes. Directory paths
+ * are not always terminated, so they are copied first.
+ */
+void pak_trace_load(uint64_t trace, const pak_t *pak, const pak_file_t *file,
+        size_t bytes, bool hit)
+{
+    if (trace == 0) {
+        return;
+    }
+
+    char path[PAK_MAX_PATH_LENGTH + 1];
+    snprintf(path, sizeof path, "%.56s", file->path);
+    Trace.end(trace, TRACE_PAK_LOAD, path, pak->path, bytes, hit);
+}
+
+/**
+ * Returns the contents of the file at \p index in \p pak's directory. The
+ * data is owned by \p pak and remains valid until it is closed. Like
+ * File.loadFromDisk, files read from streamed or compressed archives are
+ * null-terminated. Safe to call from several threads at once; a file that is
+ * loaded by two threads at the same time is kept only once.
+ * @param pak The PAK archive to be read from
+ * @param index The index of the file in \p pak's directory
+ * @return The contents of the file, or NULL on error
+ */
+const void *pak_load_file_at(const pak_t *pak, size_t index)
+{
+    if (index >= pak->file_count) {
+        Engine.error("File index %zu out of range in PAK archive.\n", index);
+        return NULL;
+    }
+
+    uint64_t trace = Trace.begin();
+    pak_file_t *file = &pak->files[index];
+    const void *loaded = pak_file_data(file);
+    if (loaded != NULL || !pak_owns_file_data(pak)) {
+        pak_trace_load(trace, pak, file, file->size, true);
+        return loaded;
+    }
+
+    uint8_t *data = calloc(file->size + 1, sizeof *data);
+    if (data == NULL) {
+        Engine.error("Failed to allocate memory for '%.56s'.\n", file->path);
+        pak_trace_load(trace, pak, file, 0, false);
+        return NULL;
+    }
+
+    if (!pak_read_file_at(pak, index, data)) {
+        free(data);
+        pak_trace_load(trace, pak, file, 0, false);
+        return NULL;
+    }
+
+    /* Another thread may have loaded the same file in the meantime */
+    loaded = pak_publish_file_data(file, data);
+    pak_trace_load(trace, pak, file, file->size, false);
+    return loaded;
+}
+
+/**
+ * Prepares \p read to fetch the file at \p index in \p pak's directory, so
+ * that several files can be read with one call to AsyncIO.readAll. Once the
+ * read completes, it must be passed to pak_finish_read(). For compressed
+ * archives, the read fetches the file's chunks and pak_finish_read()
+ * decompresses them.
+ * @param pak The PAK archive to be read from
+ * @param index The index of the file in \p pak's directory
+ * @param read The read to be prepared
+ * @return True if \p read must be performed, false if the file is already in
+ * memory and can be obtained with pak_load_file_at()
+ */
+bool pak_prepare_read(const pak_t *pak, size_t index, aio_read_t *read)
+{
+    if (index >= pak->file_count) {
+        return false;
+    }
+
+    const pak_file_t *file = &pak->files[index];
+    if (pak_file_data(file) != NULL && pak_owns_file_data(pak)) {
+        return false;
+    }
+
+    size_t start = file->offset;
+    size_t size = file->size;
+    if (pak->compressed) {
+        size = pak_chunk_span(pak, file, &start);
+    }
+
+    if (pak->backing == PAK_BACKING_MAPPED) {
+        /* Start readahead now so the pages are resident when they are used */
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t page_start = start & ~(page - 1);
+        madvise((uint8_t *)pak->data + page_start, start + size - page_start,
+                MADV_WILLNEED);
+        return false;
+    }
+
+    if (pak->backing != PAK_BACKING_STREAMED) {
+        return false;
+    }
+
+    uint8_t *buf = calloc(size + 1, sizeof *buf);
+    if (buf == NULL) {
+        Engine.error("Failed to allocate memory for '%.56s'.\n", file->path);
+        return false;
+    }
+
+    read->fd = pak->fd;
+    read->offset = start;
+    read->size = size;
+    read->buf = buf;
+    return true;
+}
+
+/**
+ * Completes a read set up by pak_prepare_read() and returns the contents of
+ * the file, as pak_load_file_at() would.
+ * @param pak The PAK archive the file was read from
+ * @param index The index of the file in \p pak's directory
+ * @param read The completed read
+ * @return The contents of the file, or NULL if the read failed
+ */
+const void *pak_finish_read(const pak_t *pak, size_t index, aio_read_t *read)
+{
+    pak_file_t *file = &pak->files[index];
+    if (!read->ok) {
+        Engine.error("Failed to read '%.56s' from PAK archive.\n", file->path);
+        free(read->buf);
+        return NULL;
+    }
+
+    void *data = read->buf;
+    if (pak->compressed) {
+        data = calloc(file->size + 1, 1);
+        bool ok = data != NULL && pak_decompress_file(pak, file, read->buf,
+                read->offset, data);
+        free(read->buf);
+        if (!ok) {
+            free(data);
+            return NULL;
+        }
+    }
+
+    /*
+     * The same file may have been requested more than once in a batch, or
+     * loaded by another thread
+     */
+    return pak_publish_file_data(file, data);
+}
+
+/**
+ * Releases the memory holding the file at \p index in \p pak's directory.
+ * Pooled copies of streamed or compressed files are freed, invalidating any
+ * pointer previously returned for the file; the file is reloaded if it is
+ * requested again. For mapped archives, the pages lying wholly inside the
+ * file are dropped from memory and will be faulted back in if read. Unlike
+ * the other functions here, this must not be called while another thread may
+ * be using the file's data.
+ * @param pak The PAK archive holding the file
+ * @param index The index of the file in \p pak's directory
+ */
+void pak_release(const pak_t *pak, size_t index)
+{
+    if (index >= pak->file_count) {
+        return;
+    }
+
+    pak_file_t *file = &pak->files[index];
+    if (pak_owns_file_data(pak)) {
+        free((void *)__atomic_exchange_n(&file->data, NULL, __ATOMIC_ACQ_REL));
+    } else if (pak->backing == PAK_BACKING_MAPPED) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = (file->offset + page - 1) & ~(page - 1);
+        size_t end = (file->offset + file->size) & ~(page - 1);
+        if (end > start) {
+            madvise((uint8_t *)pak->data + start, end - start, MADV_DONTNEED);
+        }
+    }
+}
+
 const void *pak_load_file(const pak_t *pak, const char *path)
 {
     if (pak == NULL) {
@@ -113,18 +983,174 @@ const void *pak_load_file(const pak_t *pak, const char *path)
         return NULL;
     }
 
-    for (size_t i = 0; i < pak->file_count; i++) {
-        if (strncmp(pak->files[i].path, path, PAK_MAX_PATH_LENGTH)) {
-            return pak->files[i].data;
-        }
+    ptrdiff_t i = pak_find_path(pak, path);
+    if (i != -1) {
+        return pak_load_file_at(pak, i);
     }
 
     Engine.error("'%s' not found in the given PAK archive.\n", path);
     return NULL;
 }
 
+/**
+ * Orders files by path, and files with the same path by their position in
+ * the directory.
+ */
+int pak_compare_files(const void *a, const void *b)
+{
+    const pak_file_t *file_a = *(const pak_file_t * const *)a;
+    const pak_file_t *file_b = *(const pak_file_t * const *)b;
+    int order = strncmp(file_a->path, file_b->path, PAK_MAX_PATH_LENGTH);
+    if (order != 0) {
+        return order;
+    }
+
+    return (file_a > file_b) - (file_a < file_b);
+}
+
+/**
+ * Returns \p pak's sorted view of its directory, building it if this is the
+ * first time the archive has been listed.
+ * @return The view, or NULL if it could not be allocated
+ */
+const pak_sorted_t *pak_sorted_view(pak_t *pak)
+{
+    pak_sorted_t *sorted = __atomic_load_n(&pak->sorted, __ATOMIC_ACQUIRE);
+    if (sorted != NULL) {
+        return sorted;
+    }
+
+    sorted = malloc(sizeof *sorted + pak->file_count * sizeof *sorted->files);
+    if (sorted == NULL) {
+        Engine.error("Failed to allocate sorted directory for '%s'.\n",
+                pak->path);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < pak->file_count; i++) {
+        sorted->files[i] = &pak->files[i];
+    }
+    qsort(sorted->files, pak->file_count, sizeof *sorted->files,
+            pak_compare_files);
+
+    /* Keep only the first of each run of identical paths, as pak_find does */
+    size_t count = 0;
+    for (size_t i = 0; i < pak->file_count; i++) {
+        if (count == 0 || strncmp(sorted->files[count - 1]->path,
+                    sorted->files[i]->path, PAK_MAX_PATH_LENGTH) != 0) {
+            sorted->files[count++] = sorted->files[i];
+        }
+    }
+    sorted->count = count;
+
+    /* Another thread may have built the same view in the meantime */
+    pak_sorted_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&pak->sorted, &expected, sorted, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(sorted);
+        return expected;
+    }
+
+    return sorted;
+}
+
+/**
+ * Calls \p fn for every file in \p pak whose path matches the glob
+ * \p pattern, in order of path. Patterns are matched with fnmatch(), so a
+ * '*' also matches '/' and a pattern such as "*.mdl" lists models in every
+ * directory. Only the files whose paths start with the part of \p pattern before
+ * its first wildcard are examined, and these are found by binary search, so
+ * listing takes O(log n + k) for k such files. File data is not touched.
+ * @param pak The PAK archive to be listed
+ * @param pattern The glob to be matched against each path
+ * @param fn Called with the path and directory index of each match
+ * @param ctx Passed to every call of \p fn
+ * @return The number of matching files
+ */
+size_t pak_list(const pak_t *pak, const char *pattern, pak_list_fn_t fn,
+        void *ctx)
+{
+    const pak_sorted_t *sorted = pak_sorted_view((pak_t *)pak);
+    if (sorted == NULL) {
+        return 0;
+    }
+
+    size_t prefix_len = strcspn(pattern, "*?[\\");
+    if (prefix_len > PAK_MAX_PATH_LENGTH) {
+        return 0;
+    }
+
+    /* Find the first path not less than the literal prefix */
+    size_t low = 0;
+    size_t high = sorted->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(sorted->files[mid]->path, pattern, prefix_len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i = low; i < sorted->count; i++) {
+        const pak_file_t *file = sorted->files[i];
+        if (strncmp(file->path, pattern, prefix_len) != 0) {
+            break;
+        }
+
+        char path[PAK_MAX_PATH_LENGTH + 1];
+        snprintf(path, sizeof path, "%.56s", file->path);
+        if (fnmatch(pattern, path, 0) == 0) {
+            if (fn != NULL) {
+                fn(path, file - pak->files, ctx);
+            }
+            count += 1;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Returns the path \p pak was opened from.
+ */
+const char *pak_path(const pak_t *pak)
+{
+    return pak->path;
+}
+
+size_t pak_file_count(const pak_t *pak)
+{
+    return pak->file_count;
+}
+
+const char *pak_file_path(const pak_t *pak, size_t index)
+{
+    return pak->files[index].path;
+}
+
+size_t pak_file_size(const pak_t *pak, size_t index)
+{
+    return pak->files[index].size;
+}
+
 const struct pak_namespace PAK = {
     .print = pak_print,
     .open = pak_open,
-    .loadFile = pak_load_file
+    .openMapped = pak_open_mapped,
+    .openStreamed = pak_open_streamed,
+    .close = pak_close,
+    .find = pak_find_path,
+    .loadFile = pak_load_file,
+    .loadFileAt = pak_load_file_at,
+    .readFileAt = pak_read_file_at,
+    .prepareRead = pak_prepare_read,
+    .finishRead = pak_finish_read,
+    .release = pak_release,
+    .list = pak_list,
+    .path = pak_path,
+    .fileCount = pak_file_count,
+    .filePath = pak_file_path,
+    .fileSize = pak_file_size
 };
@@ -2,11 +2,18 @@
 #define PAK_H
 
 #include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "aio.h"
+
 static const char * const PAK_MAGIC = "PACK";
 
+/** The maximum length of a path inside a PAK archive. */
+#define PAK_MAX_PATH_LENGTH (56)
+
 typedef struct {
     /**
      * The magic number for the PAK archive format. Must be equivalent to
@@ -48,11 +55,90 @@ typedef struct {
 
 // static_assert(sizeof (pak_stat_t) == 64, "Check PAK file entry size");
 
+static const char * const PAKZ_MAGIC = "PAKZ";
+
+/**
+ * Header of a compressed PAK archive. File data is split into chunks of
+ * chunk_size bytes, each compressed on its own, so that any chunk can be
+ * decoded without the others. The directory has the same layout as a PAK
+ * directory, except that each entry's offset field holds the index of the
+ * file's first chunk; a file's chunks are consecutive in the chunk table.
+ */
+typedef struct {
+    /**
+     * The magic number for the compressed PAK archive format. Must be
+     * equivalent to PAKZ_MAGIC.
+     */
+    char magic[4];
+
+    /**
+     * The offset in bytes from the beginning of the archive to the beginning
+     * of the directory.
+     */
+    int32_t offset;
+
+    /**
+     * The size in bytes of the directory.
+     */
+    int32_t size;
+
+    /**
+     * The size in bytes of each chunk before compression. The last chunk of a
+     * file may be shorter.
+     */
+    int32_t chunk_size;
+
+    /**
+     * The offset in bytes from the beginning of the archive to the beginning
+     * of the chunk table.
+     */
+    int32_t chunk_offset;
+
+    /**
+     * The number of entries in the chunk table.
+     */
+    int32_t chunk_count;
+} pakz_header_t;
+
+typedef struct {
+    /**
+     * The offset in bytes from the beginning of the archive to the beginning
+     * of this chunk's compressed data.
+     */
+    int32_t offset;
+
+    /**
+     * The size in bytes of this chunk's compressed data. If this equals the
+     * chunk's uncompressed size, the chunk is stored without compression.
+     */
+    int32_t size;
+} pakz_chunk_t;
+
 typedef struct pak_s pak_t;
+
+/** Called by PAK.list with each matching path and its directory index. */
+typedef void (*pak_list_fn_t)(const char *path, size_t index, void *ctx);
+
 extern const struct pak_namespace {
     void (* const print)(const pak_t *pak);
     pak_t *(* const open)(const char *path);
+    pak_t *(* const openMapped)(const char *path);
+    pak_t *(* const openStreamed)(const char *path);
+    void (* const close)(pak_t *pak);
+    ptrdiff_t (* const find)(const pak_t *pak, const char *path);
     const void *(* const loadFile)(const pak_t *pak, const char *path);
+    const void *(* const loadFileAt)(const pak_t *pak, size_t index);
+    bool (* const readFileAt)(const pak_t *pak, size_t index, void *buf);
+    bool (* const prepareRead)(const pak_t *pak, size_t index, aio_read_t *read);
+    const void *(* const finishRead)(const pak_t *pak, size_t index,
+            aio_read_t *read);
+    void (* const release)(const pak_t *pak, size_t index);
+    size_t (* const list)(const pak_t *pak, const char *pattern,
+            pak_list_fn_t fn, void *ctx);
+    const char *(* const path)(const pak_t *pak);
+    size_t (* const fileCount)(const pak_t *pak);
+    const char *(* const filePath)(const pak_t *pak, size_t index);
+    size_t (* const fileSize)(const pak_t *pak, size_t index);
 } PAK;
 
 #endif
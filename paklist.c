@@ -0,0 +1,95 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file paklist.c
+ *
+ * Lists the files in a PAK archive whose paths match a glob, in order of
+ * path, then reports how long building the sorted directory and answering
+ * the query took, next to a linear scan of the whole directory for
+ * comparison.
+ */
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "engine.h"
+#include "pak.h"
+
+#define PAKLIST_REPEAT (100)
+
+double paklist_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void paklist_print(const char *path, size_t index, void *ctx)
+{
+    const pak_t *pak = ctx;
+    printf("%10zu  %s\n", PAK.fileSize(pak, index), path);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        printf("Usage: %s [pak] [pattern]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    pak_t *pak = PAK.openMapped(argv[1]);
+    if (pak == NULL) {
+        Engine.fatal("Couldn't open PAK archive '%s'.\n", argv[1]);
+    }
+
+    /* The first listing builds the sorted directory */
+    double t0 = paklist_now();
+    size_t count = PAK.list(pak, argv[2], paklist_print, pak);
+    double first_time = paklist_now() - t0;
+
+    t0 = paklist_now();
+    for (int i = 0; i < PAKLIST_REPEAT; i++) {
+        PAK.list(pak, argv[2], NULL, NULL);
+    }
+    double list_time = (paklist_now() - t0) / PAKLIST_REPEAT;
+
+    size_t file_count = PAK.fileCount(pak);
+    size_t scan_count = 0;
+    t0 = paklist_now();
+    for (int i = 0; i < PAKLIST_REPEAT; i++) {
+        scan_count = 0;
+        for (size_t j = 0; j < file_count; j++) {
+            char path[PAK_MAX_PATH_LENGTH + 1];
+            snprintf(path, sizeof path, "%.56s", PAK.filePath(pak, j));
+            if (fnmatch(argv[2], path, 0) == 0) {
+                scan_count += 1;
+            }
+        }
+    }
+    double scan_time = (paklist_now() - t0) / PAKLIST_REPEAT;
+
+    fprintf(stderr, "%zu of %zu files matched\n", count, file_count);
+    fprintf(stderr, "first listing: %.3f ms\n", first_time * 1e3);
+    fprintf(stderr, "listing:       %.3f ms\n", list_time * 1e3);
+    fprintf(stderr, "linear scan:   %.3f ms (%zu matched)\n", scan_time * 1e3,
+            scan_count);
+
+    PAK.close(pak);
+    exit(EXIT_SUCCESS);
+}
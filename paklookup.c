@@ -0,0 +1,105 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file paklookup.c
+ *
+ * Times lookups of paths in a PAK archive through PAK.loadFile, next to a
+ * linear scan of the whole directory for comparison. The paths looked up are
+ * drawn at random from the archive's directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "engine.h"
+#include "pak.h"
+
+#define PAKLOOKUP_DEFAULT_COUNT (100000)
+
+double paklookup_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        printf("Usage: %s [pak] [lookup-count]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t count = argc == 3 ? strtoul(argv[2], NULL, 10) :
+            PAKLOOKUP_DEFAULT_COUNT;
+
+    pak_t *pak = PAK.openMapped(argv[1]);
+    if (pak == NULL) {
+        Engine.fatal("Couldn't open PAK archive '%s'.\n", argv[1]);
+    }
+
+    size_t file_count = PAK.fileCount(pak);
+    if (file_count == 0 || count == 0) {
+        Engine.fatal("Nothing to look up in '%s'.\n", argv[1]);
+    }
+
+    char (*paths)[PAK_MAX_PATH_LENGTH + 1] = malloc(count * sizeof *paths);
+    if (paths == NULL) {
+        Engine.fatal("Couldn't allocate %zu lookups.\n", count);
+    }
+
+    srand(1);
+    for (size_t i = 0; i < count; i++) {
+        snprintf(paths[i], sizeof paths[i], "%.56s",
+                PAK.filePath(pak, rand() % file_count));
+    }
+
+    size_t hits = 0;
+    double t0 = paklookup_now();
+    for (size_t i = 0; i < count; i++) {
+        if (PAK.loadFile(pak, paths[i]) != NULL) {
+            hits += 1;
+        }
+    }
+    double lookup_time = paklookup_now() - t0;
+
+    size_t scan_hits = 0;
+    t0 = paklookup_now();
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = 0; j < file_count; j++) {
+            if (strncmp(PAK.filePath(pak, j), paths[i],
+                    PAK_MAX_PATH_LENGTH) == 0) {
+                scan_hits += 1;
+                break;
+            }
+        }
+    }
+    double scan_time = paklookup_now() - t0;
+
+    fprintf(stderr, "%zu lookups in %zu files, %zu found\n", count,
+            file_count, hits);
+    fprintf(stderr, "hashed lookup: %9.3f ms (%.1f ns each)\n",
+            lookup_time * 1e3, lookup_time * 1e9 / count);
+    fprintf(stderr, "linear scan:   %9.3f ms (%.1f ns each, %zu found)\n",
+            scan_time * 1e3, scan_time * 1e9 / count, scan_hits);
+
+    free(paths);
+    PAK.close(pak);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file pakopen.c
+ *
+ * Opens a PAK archive both by reading it onto the heap and by mapping it, and
+ * reports for each how long opening took and how much the resident set grew,
+ * first after opening and then after reading one file. The mapped archive is
+ * opened first so that the heap copy's pages can't be counted against it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "pak.h"
+
+double pakopen_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Returns the resident set size of this process in kilobytes, or 0 if it
+ * can't be read.
+ */
+size_t pakopen_rss()
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    unsigned long size, resident;
+    int count = fscanf(fp, "%lu %lu", &size, &resident);
+    fclose(fp);
+    if (count != 2) {
+        return 0;
+    }
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Opens \p path with \p open, reads the file at \p file from it, and prints
+ * the time and resident memory each step took under the name \p name.
+ */
+void pakopen_measure(const char *name, pak_t *(*open)(const char *path),
+        const char *path, const char *file)
+{
+    size_t rss = pakopen_rss();
+    double t0 = pakopen_now();
+    pak_t *pak = open(path);
+    double open_time = pakopen_now() - t0;
+    if (pak == NULL) {
+        Engine.fatal("Couldn't open PAK archive '%s'.\n", path);
+    }
+    size_t open_rss = pakopen_rss();
+
+    t0 = pakopen_now();
+    const uint8_t *data = PAK.loadFile(pak, file);
+    if (data == NULL) {
+        Engine.fatal("PAK archive '%s' has no file '%s'.\n", path, file);
+    }
+
+    /* Touch every page, as a caller using the whole file would */
+    size_t index = 0;
+    while (index < PAK.fileCount(pak) &&
+            strncmp(PAK.filePath(pak, index), file, PAK_MAX_PATH_LENGTH) != 0) {
+        index += 1;
+    }
+    size_t size = PAK.fileSize(pak, index);
+    unsigned sum = 0;
+    for (size_t i = 0; i < size; i += 512) {
+        sum += data[i];
+    }
+    double read_time = pakopen_now() - t0;
+    size_t read_rss = pakopen_rss();
+
+    printf("%-7s open: %9.3f ms %9zu kB   read: %9.3f ms %9zu kB   (%u)\n",
+            name, open_time * 1e3, open_rss - rss, read_time * 1e3,
+            read_rss - rss, sum & 0xff);
+
+    PAK.close(pak);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        printf("Usage: %s [pak] [file]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    pakopen_measure("mapped", PAK.openMapped, argv[1], argv[2]);
+    pakopen_measure("heap", PAK.open, argv[1], argv[2]);
+
+    exit(EXIT_SUCCESS);
+}
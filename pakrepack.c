@@ -0,0 +1,171 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file pakrepack.c
+ *
+ * Rewrites a PAK archive so that file data is laid out in the order the files
+ * are requested, turning the scattered reads of a startup or map load into one
+ * sequential stream. The order comes from a manifest with one path per line.
+ * Only the first comma-separated field of each line is used, so access traces
+ * dumped as CSV can be passed in directly; lines that do not name a file in
+ * the archive (such as a CSV header) are ignored. Files that are never
+ * requested follow in their original order. The input is opened with
+ * PAK.open, so it may also be compressed; the output is a standard PAK
+ * archive.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "pak.h"
+
+#define REPACK_MAX_LINE_LEN (1024)
+
+/**
+ * Reads the manifest at \p path and fills \p order with the directory indices
+ * of the files of \p pak that it names, in order of first appearance,
+ * followed by every remaining file in directory order. Duplicate paths
+ * resolve to their first entry, as PAK.find does.
+ */
+void repack_read_order(const char *path, const pak_t *pak, size_t *order)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        Engine.fatal("Couldn't open manifest '%s'.\n", path);
+    }
+
+    size_t file_count = PAK.fileCount(pak);
+    bool *placed = calloc(file_count, sizeof *placed);
+    if (placed == NULL && file_count > 0) {
+        Engine.fatal("Couldn't allocate file order.\n");
+    }
+    size_t placed_count = 0;
+    size_t unknown_count = 0;
+
+    char line[REPACK_MAX_LINE_LEN];
+    while (fgets(line, sizeof line, fp) != NULL) {
+        line[strcspn(line, ",\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        ptrdiff_t index = PAK.find(pak, line);
+        if (index == -1) {
+            unknown_count += 1;
+            continue;
+        }
+
+        if (!placed[index]) {
+            placed[index] = true;
+            order[placed_count++] = index;
+        }
+    }
+    fclose(fp);
+
+    printf("%zu of %zu files ordered by manifest, %zu lines ignored.\n",
+            placed_count, file_count, unknown_count);
+
+    for (size_t i = 0; i < file_count; i++) {
+        if (!placed[i]) {
+            order[placed_count++] = i;
+        }
+    }
+
+    free(placed);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        printf("Usage: %s [in-pak] [manifest] [out-pak]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    pak_t *pak = PAK.open(argv[1]);
+    if (pak == NULL) {
+        Engine.fatal("Couldn't open PAK archive '%s'.\n", argv[1]);
+    }
+
+    size_t file_count = PAK.fileCount(pak);
+    size_t *order = calloc(file_count, sizeof *order);
+    if (order == NULL && file_count > 0) {
+        Engine.fatal("Couldn't allocate file order.\n");
+    }
+    repack_read_order(argv[2], pak, order);
+
+    FILE *out = fopen(argv[3], "wb");
+    if (out == NULL) {
+        Engine.fatal("Couldn't open '%s' for writing.\n", argv[3]);
+    }
+
+    /*
+     * The directory keeps its original order, so only the offsets change;
+     * lookups and duplicate resolution behave exactly as before.
+     */
+    pak_stat_t *new_directory = calloc(file_count, sizeof *new_directory);
+    if (new_directory == NULL && file_count > 0) {
+        Engine.fatal("Couldn't allocate directory.\n");
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        strncpy(new_directory[i].path, PAK.filePath(pak, i),
+                sizeof new_directory[i].path);
+        new_directory[i].size = PAK.fileSize(pak, i);
+    }
+
+    pak_header_t new_header;
+    memcpy(new_header.magic, PAK_MAGIC, 4);
+    new_header.offset = 0;
+    new_header.size = file_count * sizeof *new_directory;
+    fwrite(&new_header, sizeof new_header, 1, out);
+
+    size_t offset = sizeof new_header;
+    for (size_t i = 0; i < file_count; i++) {
+        pak_stat_t *file = &new_directory[order[i]];
+        const void *data = PAK.loadFileAt(pak, order[i]);
+        if (data == NULL) {
+            Engine.fatal("Couldn't read '%.56s' from '%s'.\n", file->path,
+                    argv[1]);
+        }
+        if (fwrite(data, 1, file->size, out) != (size_t)file->size) {
+            Engine.fatal("Short write to '%s'.\n", argv[3]);
+        }
+        PAK.release(pak, order[i]);
+
+        file->offset = offset;
+        offset += file->size;
+    }
+
+    new_header.offset = offset;
+    fwrite(new_directory, sizeof *new_directory, file_count, out);
+    fseek(out, 0, SEEK_SET);
+    fwrite(&new_header, sizeof new_header, 1, out);
+
+    if (fclose(out) != 0) {
+        Engine.fatal("Failed to finish writing '%s'.\n", argv[3]);
+    }
+
+    printf("Wrote %zu files to '%s'.\n", file_count, argv[3]);
+
+    free(new_directory);
+    free(order);
+    PAK.close(pak);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file pakz.c
+ *
+ * Converts a PAK archive into a compressed PAK archive, then reads the result
+ * back through the PAK loader to verify it and report compression ratio and
+ * compression and decompression throughput.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "engine.h"
+#include "lz.h"
+#include "pak.h"
+
+#define PAKZ_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+double pakz_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s [in-pak] [out-pakz] [chunk-size]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    long chunk_size = argc == 4 ? strtol(argv[3], NULL, 0) :
+            PAKZ_DEFAULT_CHUNK_SIZE;
+    if (chunk_size <= 0 || chunk_size > 65536) {
+        Engine.fatal("Chunk size must be between 1 and 65536 bytes.\n");
+    }
+
+    pak_t *pak = PAK.open(argv[1]);
+    if (pak == NULL) {
+        Engine.fatal("Couldn't open PAK archive '%s'.\n", argv[1]);
+    }
+
+    size_t file_count = PAK.fileCount(pak);
+    size_t chunk_count = 0;
+    size_t total_size = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        size_t size = PAK.fileSize(pak, i);
+        chunk_count += (size + chunk_size - 1) / chunk_size;
+        total_size += size;
+    }
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        Engine.fatal("Couldn't open '%s' for writing.\n", argv[2]);
+    }
+
+    pakz_header_t header;
+    memset(&header, 0, sizeof header);
+    fwrite(&header, sizeof header, 1, out);
+
+    pak_stat_t *directory = calloc(file_count, sizeof *directory);
+    pakz_chunk_t *chunks = calloc(chunk_count, sizeof *chunks);
+    uint8_t *scratch = malloc(LZ.bound(chunk_size));
+    if ((directory == NULL && file_count > 0) ||
+            (chunks == NULL && chunk_count > 0) || scratch == NULL) {
+        Engine.fatal("Couldn't allocate conversion buffers.\n");
+    }
+
+    double compress_time = 0.0;
+    size_t offset = sizeof header;
+    size_t chunk = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        const uint8_t *data = PAK.loadFileAt(pak, i);
+        size_t size = PAK.fileSize(pak, i);
+
+        strncpy(directory[i].path, PAK.filePath(pak, i), PAK_MAX_PATH_LENGTH);
+        directory[i].offset = chunk;
+        directory[i].size = size;
+
+        for (size_t start = 0; start < size; start += chunk_size) {
+            size_t len = size - start < (size_t)chunk_size ?
+                    size - start : (size_t)chunk_size;
+
+            double t0 = pakz_now();
+            size_t zsize = LZ.compress(data + start, len, scratch,
+                    LZ.bound(chunk_size));
+            compress_time += pakz_now() - t0;
+
+            /* Store chunks that do not shrink as they are */
+            const uint8_t *chunk_data = scratch;
+            if (zsize == 0 || zsize >= len) {
+                chunk_data = data + start;
+                zsize = len;
+            }
+
+            if (fwrite(chunk_data, 1, zsize, out) != zsize) {
+                Engine.fatal("Short write to '%s'.\n", argv[2]);
+            }
+
+            chunks[chunk].offset = offset;
+            chunks[chunk].size = zsize;
+            offset += zsize;
+            chunk += 1;
+        }
+    }
+
+    memcpy(header.magic, PAKZ_MAGIC, 4);
+    header.chunk_size = chunk_size;
+    header.chunk_offset = offset;
+    header.chunk_count = chunk_count;
+    fwrite(chunks, sizeof *chunks, chunk_count, out);
+    offset += chunk_count * sizeof *chunks;
+
+    header.offset = offset;
+    header.size = file_count * sizeof *directory;
+    fwrite(directory, sizeof *directory, file_count, out);
+    offset += file_count * sizeof *directory;
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof header, 1, out);
+    if (fclose(out) != 0) {
+        Engine.fatal("Failed to finish writing '%s'.\n", argv[2]);
+    }
+
+    /* Read everything back through the loader to verify and time it */
+    pak_t *zpak = PAK.openMapped(argv[2]);
+    if (zpak == NULL) {
+        Engine.fatal("Couldn't reopen '%s'.\n", argv[2]);
+    }
+
+    double t0 = pakz_now();
+    for (size_t i = 0; i < file_count; i++) {
+        if (PAK.loadFileAt(zpak, i) == NULL) {
+            Engine.fatal("Failed to decompress file %zu.\n", i);
+        }
+    }
+    double decompress_time = pakz_now() - t0;
+
+    for (size_t i = 0; i < file_count; i++) {
+        if (memcmp(PAK.loadFileAt(zpak, i), PAK.loadFileAt(pak, i),
+                PAK.fileSize(pak, i)) != 0) {
+            Engine.fatal("File %zu does not match after round trip.\n", i);
+        }
+    }
+
+    const double mib = 1024.0 * 1024.0;
+    printf("%zu files, %zu chunks of %ld bytes\n", file_count, chunk_count,
+            chunk_size);
+    printf("%.2f MiB -> %.2f MiB (%.1f%%)\n", total_size / mib, offset / mib,
+            total_size > 0 ? 100.0 * offset / total_size : 100.0);
+    printf("compress:   %.1f MiB/s\n",
+            compress_time > 0 ? total_size / mib / compress_time : 0.0);
+    printf("decompress: %.1f MiB/s\n",
+            decompress_time > 0 ? total_size / mib / decompress_time : 0.0);
+
+    PAK.close(zpak);
+    PAK.close(pak);
+    free(scratch);
+    free(chunks);
+    free(directory);
+    exit(EXIT_SUCCESS);
+}
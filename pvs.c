@@ -0,0 +1,405 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * @file pvs.c
+ *
+ * Potentially visible sets. A BSP stores one run-length-compressed row of
+ * visibility bits per leaf: a nonzero byte is eight bits as they are, and a
+ * zero byte is followed by a count of zero bytes. Bit k of a compressed row
+ * refers to leaf k + 1, since leaf 0 is the solid space outside the map.
+ *
+ * Rows are decompressed on demand into bitsets indexed directly by leaf,
+ * each starting on a cache line. Recently used rows are kept, up to the number
+ * given by the cvar pvs_cacherows (PVS_DEFAULT_ROWS if unset).
+ *
+ * All functions are safe to call from multiple threads, and queries that hit
+ * a cached row take no lock. Each slot is a seqlock: its sequence number is
+ * odd while the slot is being refilled, and a reader that sees it change
+ * while reading the row falls back to the locked path. Misses are filled
+ * under the lock, and the slot to refill is chosen by a clock hand: it sweeps
+ * the slots in order, clearing the referenced flag of each slot it passes and
+ * stopping at the first whose flag was already clear. Readers set a slot's
+ * flag as they use it, so recently used rows survive one sweep, and hits only
+ * write to a slot the first time it is used after the hand has passed it.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsp_private.h"
+#include "cvar.h"
+#include "engine.h"
+#include "pvs.h"
+
+#define PVS_DEFAULT_ROWS (1024)
+#define PVS_ROW_ALIGN    (64)
+
+typedef struct pvs_row_s {
+    /*
+     * Odd while the slot is being refilled. Everything below is only read
+     * with atomic loads, and is only valid if this is even and has not
+     * changed once the reads are done.
+     */
+    uint32_t seq;
+
+    /*
+     * The leaf whose row this is, or -1 if the slot is unused.
+     */
+    int leaf;
+
+    /*
+     * Set when the slot is used, and cleared when the clock hand passes it.
+     */
+    bool referenced;
+
+    uint64_t *bits;
+} pvs_row_t;
+
+typedef struct pvs_s {
+    /*
+     * Held while a slot is refilled.
+     */
+    pthread_mutex_t lock;
+
+    const bsp_t *bsp;
+
+    /*
+     * The number of leaves with visibility information, not counting leaf 0.
+     * Only the world's leaves have any.
+     */
+    int visleaf_count;
+
+    /*
+     * The number of 64-bit words in a row, padded to a whole cache line.
+     */
+    size_t words;
+
+    /*
+     * The slot holding the row of each leaf, or NULL if it is not cached.
+     * Read without the lock, so a reader must check the slot's leaf.
+     */
+    pvs_row_t **leaf_rows;
+
+    pvs_row_t *rows;
+    size_t row_count;
+    uint64_t *bits;
+
+    /*
+     * Where rows are decompressed before being copied into their slot.
+     */
+    uint64_t *scratch;
+
+    /*
+     * The index of the next slot to be considered for refilling. Only used
+     * with the lock held.
+     */
+    size_t hand;
+} pvs_t;
+
+/**
+ * Creates the PVS for \p bsp. No rows are decompressed until they are used.
+ * @param bsp The BSP whose visibility data is to be used
+ * @return The PVS, or NULL on error
+ */
+pvs_t *pvs_create(const bsp_t *bsp)
+{
+    pvs_t *pvs = calloc(1, sizeof *pvs);
+    if (pvs == NULL) {
+        Engine.error("Couldn't allocate PVS.\n");
+        return NULL;
+    }
+
+    pthread_mutex_init(&pvs->lock, NULL);
+    pvs->bsp = bsp;
+
+    pvs->visleaf_count = bsp->model_count > 0 ? bsp->models[0].leaf_count :
+            bsp->leaf_count - 1;
+    if (pvs->visleaf_count < 0 || pvs->visleaf_count >= bsp->leaf_count) {
+        pvs->visleaf_count = bsp->leaf_count > 0 ? bsp->leaf_count - 1 : 0;
+    }
+
+    size_t line_words = PVS_ROW_ALIGN / sizeof (uint64_t);
+    pvs->words = (bsp->leaf_count + 63) / 64;
+    pvs->words = (pvs->words + line_words - 1) / line_words * line_words;
+
+    float rows = Cvar.getNumber("pvs_cacherows");
+    pvs->row_count = rows >= 1.0f ? (size_t)rows : PVS_DEFAULT_ROWS;
+    if (pvs->row_count > (size_t)bsp->leaf_count) {
+        pvs->row_count = bsp->leaf_count;
+    }
+
+    size_t bits_size = pvs->row_count * pvs->words * sizeof *pvs->bits;
+    size_t scratch_size = pvs->words * sizeof *pvs->scratch;
+    pvs->leaf_rows = calloc(bsp->leaf_count, sizeof *pvs->leaf_rows);
+    pvs->rows = calloc(pvs->row_count, sizeof *pvs->rows);
+    pvs->bits = bits_size > 0 ? aligned_alloc(PVS_ROW_ALIGN, bits_size) : NULL;
+    pvs->scratch = scratch_size > 0 ?
+            aligned_alloc(PVS_ROW_ALIGN, scratch_size) : NULL;
+    if ((pvs->leaf_rows == NULL && bsp->leaf_count > 0) ||
+            (pvs->rows == NULL && pvs->row_count > 0) ||
+            (pvs->bits == NULL && bits_size > 0) ||
+            (pvs->scratch == NULL && scratch_size > 0)) {
+        Engine.error("Couldn't allocate %zu PVS rows.\n", pvs->row_count);
+        free(pvs->scratch);
+        free(pvs->bits);
+        free(pvs->rows);
+        free(pvs->leaf_rows);
+        free(pvs);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < pvs->row_count; i++) {
+        pvs_row_t *row = &pvs->rows[i];
+        row->leaf = -1;
+        row->bits = pvs->bits + i * pvs->words;
+    }
+
+    return pvs;
+}
+
+/**
+ * Frees \p pvs and every row it holds.
+ */
+void pvs_free(pvs_t *pvs)
+{
+    if (pvs == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&pvs->lock);
+    free(pvs->scratch);
+    free(pvs->bits);
+    free(pvs->rows);
+    free(pvs->leaf_rows);
+    free(pvs);
+}
+
+/**
+ * Returns the number of 64-bit words in a row of \p pvs, which is the size of
+ * the buffer that PVS.row() fills.
+ */
+size_t pvs_row_words(const pvs_t *pvs)
+{
+    return pvs->words;
+}
+
+/**
+ * Decompresses the row of \p leaf into \p bits. Leaves with no visibility
+ * list can see every leaf, and so can any leaf whose list is corrupt.
+ */
+void pvs_decompress(const pvs_t *pvs, int leaf, uint64_t *bits)
+{
+    const bsp_t *bsp = pvs->bsp;
+    memset(bits, 0, pvs->words * sizeof *bits);
+
+    const uint8_t *in = bsp->leaves[leaf].vislist;
+    if (in != NULL) {
+        const uint8_t *end = bsp->vislists + bsp->vislist_size;
+        int row_bytes = (pvs->visleaf_count + 7) / 8;
+        int out = 0;
+        while (out < row_bytes && in < end) {
+            if (*in != 0) {
+                /* Shift by one so that bit k is leaf k rather than k + 1 */
+                for (int b = 0; b < 8; b++) {
+                    int target = out * 8 + b + 1;
+                    if ((*in & (1 << b)) && target <= pvs->visleaf_count) {
+                        bits[target / 64] |= UINT64_C(1) << (target % 64);
+                    }
+                }
+                in += 1;
+                out += 1;
+                continue;
+            }
+
+            if (in + 1 >= end) {
+                break;
+            }
+            out += in[1];
+            in += 2;
+        }
+
+        if (out >= row_bytes) {
+            return;
+        }
+
+        Engine.error("Visibility list of leaf %d is truncated.\n", leaf);
+    }
+
+    for (int i = 1; i <= pvs->visleaf_count; i++) {
+        bits[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+}
+
+/**
+ * Marks \p row as used. Only the first use after the clock hand has passed
+ * it writes to it.
+ */
+static inline void pvs_touch(pvs_row_t *row)
+{
+    if (!__atomic_load_n(&row->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&row->referenced, true, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Advances the clock hand of \p pvs to a slot that has not been used since
+ * the hand last passed it, clearing the flags of used slots on the way, and
+ * returns that slot. Unused slots are never referenced, so they are taken
+ * first. Must be called with the lock held.
+ */
+pvs_row_t *pvs_next_victim(pvs_t *pvs)
+{
+    size_t start = pvs->hand;
+    for (size_t i = 0; i < pvs->row_count; i++) {
+        pvs_row_t *row = &pvs->rows[pvs->hand];
+        pvs->hand = pvs->hand + 1 < pvs->row_count ? pvs->hand + 1 : 0;
+
+        /* Cleared with an exchange so a hit in the meantime isn't lost */
+        if (!__atomic_exchange_n(&row->referenced, false, __ATOMIC_RELAXED)) {
+            return row;
+        }
+    }
+
+    /*
+     * Every slot was used since the hand last passed it. The hand is back
+     * where it started, and that slot has gone longest without being passed.
+     */
+    pvs->hand = start + 1 < pvs->row_count ? start + 1 : 0;
+    return &pvs->rows[start];
+}
+
+/**
+ * Copies \p count words of the row of \p leaf, starting at word \p first,
+ * into \p bits without taking the lock.
+ * @return False if the row is not cached or was refilled while it was being
+ * read, in which case \p bits holds nothing useful
+ */
+bool pvs_read_cached(pvs_t *pvs, int leaf, size_t first, size_t count,
+        uint64_t *bits)
+{
+    pvs_row_t *row = __atomic_load_n(&pvs->leaf_rows[leaf], __ATOMIC_ACQUIRE);
+    if (row == NULL) {
+        return false;
+    }
+
+    uint32_t seq = __atomic_load_n(&row->seq, __ATOMIC_ACQUIRE);
+    if ((seq & 1) != 0 ||
+            __atomic_load_n(&row->leaf, __ATOMIC_RELAXED) != leaf) {
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        bits[i] = __atomic_load_n(&row->bits[first + i], __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&row->seq, __ATOMIC_RELAXED) != seq) {
+        return false;
+    }
+
+    pvs_touch(row);
+    return true;
+}
+
+/**
+ * Decompresses the row of \p leaf into the slot chosen by the clock hand,
+ * unless another thread has cached it since the caller missed, and copies
+ * \p count words of it, starting at word \p first, into \p bits.
+ */
+void pvs_read_locked(pvs_t *pvs, int leaf, size_t first, size_t count,
+        uint64_t *bits)
+{
+    pthread_mutex_lock(&pvs->lock);
+
+    /* Only this thread can refill slots now, so the reads can't be torn */
+    pvs_row_t *row = __atomic_load_n(&pvs->leaf_rows[leaf], __ATOMIC_RELAXED);
+    if (row == NULL) {
+        row = pvs_next_victim(pvs);
+        pvs_decompress(pvs, leaf, pvs->scratch);
+
+        uint32_t seq = row->seq;
+        __atomic_store_n(&row->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        if (row->leaf != -1) {
+            __atomic_store_n(&pvs->leaf_rows[row->leaf], NULL,
+                    __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&row->leaf, leaf, __ATOMIC_RELAXED);
+        for (size_t i = 0; i < pvs->words; i++) {
+            __atomic_store_n(&row->bits[i], pvs->scratch[i],
+                    __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&row->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&pvs->leaf_rows[leaf], row, __ATOMIC_RELEASE);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        bits[i] = __atomic_load_n(&row->bits[first + i], __ATOMIC_RELAXED);
+    }
+    pvs_touch(row);
+
+    pthread_mutex_unlock(&pvs->lock);
+}
+
+/**
+ * Copies the visibility row of \p leaf into \p bits, which must hold
+ * PVS.rowWords() words. Bit k of the row, in word k / 64, is set if leaf k
+ * is potentially visible from \p leaf.
+ * @return False if \p leaf is out of range
+ */
+bool pvs_row(pvs_t *pvs, int leaf, uint64_t *bits)
+{
+    if (leaf < 0 || leaf >= pvs->bsp->leaf_count) {
+        return false;
+    }
+
+    if (!pvs_read_cached(pvs, leaf, 0, pvs->words, bits)) {
+        pvs_read_locked(pvs, leaf, 0, pvs->words, bits);
+    }
+    return true;
+}
+
+/**
+ * Returns true if leaf \p to is potentially visible from leaf \p from.
+ */
+bool pvs_leaf_can_see(pvs_t *pvs, int from, int to)
+{
+    if (from < 0 || from >= pvs->bsp->leaf_count || to < 0 ||
+            to >= pvs->bsp->leaf_count) {
+        return false;
+    }
+
+    uint64_t word;
+    if (!pvs_read_cached(pvs, from, to / 64, 1, &word)) {
+        pvs_read_locked(pvs, from, to / 64, 1, &word);
+    }
+    return (word >> (to % 64)) & 1;
+}
+
+const struct pvs_namespace PVS = {
+    .create = pvs_create,
+    .free = pvs_free,
+    .rowWords = pvs_row_words,
+    .row = pvs_row,
+    .leafCanSee = pvs_leaf_can_see
+};
@@ -202,7 +202,10 @@ int main(int argc, char *argv[])
     glBindVertexArray(vao);
 
     Model.sendToOpenGL(model);
-    Model.setIdleAnimation(model, 0, 4);
+
+    model_instance_t instance;
+    Model.initInstance(&instance, model);
+    Model.setIdleAnimation(&instance, 0, 4);
 
     glfwSetKeyCallback(window, handle_keys);
 
@@ -222,7 +225,7 @@ int main(int argc, char *argv[])
         glClearDepth(1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        Model.draw(model);
+        Model.draw(&instance);
 
         ERROR_OPENGL("");
         glfwSwapBuffers(window);
@@ -230,6 +233,9 @@ int main(int argc, char *argv[])
         Engine.setTimeDelta(end - start);
     }
     
+    Model.free(model);
+    Model.deleteFreed();
+
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
@@ -0,0 +1,410 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file trace.c
+ *
+ * Opt-in tracing of asset requests. While tracing is started, each traced
+ * request records its path, source, size, whether it was served from memory
+ * and when it started and finished into a fixed-size ring, overwriting the
+ * oldest records once the ring is full. Recording takes no locks, so loads on
+ * any thread can be traced: a writer takes a ticket with an atomic increment,
+ * claims the ticket's slot by marking its sequence number odd, and publishes
+ * the record by making it even again. Records are stored and read a word at a
+ * time with atomic operations, and a reader that raced a writer notices from
+ * the sequence number and throws its copy away. The ring can be
+ * dumped as CSV, or as Chrome trace JSON for chrome://tracing and Perfetto.
+ *
+ * A request is traced by taking a timestamp with Trace.begin() and passing
+ * it to Trace.end() once the request completes. Trace.begin() returns 0 when
+ * tracing is stopped, and Trace.end() ignores it, so an untraced request
+ * costs one atomic load.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "trace.h"
+
+#define TRACE_MAX_PATH_LEN   (64)
+#define TRACE_MAX_SOURCE_LEN (64)
+
+typedef struct {
+    /** Timestamps in nanoseconds since tracing started. */
+    uint64_t     start;
+    uint64_t     end;
+
+    long         thread;
+    size_t       bytes;
+    trace_kind_t kind;
+    bool         hit;
+    char         path[TRACE_MAX_PATH_LEN];
+    char         source[TRACE_MAX_SOURCE_LEN];
+} trace_record_t;
+
+#define TRACE_RECORD_WORDS \
+    ((sizeof (trace_record_t) + sizeof (uint64_t) - 1) / sizeof (uint64_t))
+
+/** A record as the words it is stored in the ring as. */
+typedef union {
+    trace_record_t record;
+    uint64_t       words[TRACE_RECORD_WORDS];
+} trace_words_t;
+
+typedef struct {
+    /**
+     * Twice the ticket of the record in this slot plus two once the record
+     * has been written, and one less while a writer has claimed the slot, so
+     * that the slot is being written exactly when this is odd. 0 if the slot
+     * has never been written.
+     */
+    uint64_t seq;
+
+    /**
+     * The record, only ever accessed with atomic operations: a reader can
+     * run into a writer here, and must get a torn copy it can detect rather
+     * than a data race.
+     */
+    uint64_t words[TRACE_RECORD_WORDS];
+} trace_slot_t;
+
+static const char * const trace_kind_names[TRACE_KIND_COUNT] = {
+    [TRACE_PAK_LOAD] = "PAK.loadFile",
+    [TRACE_DISK_LOAD] = "File.loadFromDisk",
+    [TRACE_BSP_LOAD] = "BSP.load",
+    [TRACE_MODEL_LOAD] = "Model.fromMDL"
+};
+
+static trace_slot_t *trace_ring = NULL;
+
+/** The number of slots in \p trace_ring minus one. */
+static size_t trace_mask = 0;
+
+/** The ticket handed to the next record. */
+static uint64_t trace_head = 0;
+
+static bool trace_enabled = false;
+
+/** The time at which tracing was started, as returned by trace_clock(). */
+static uint64_t trace_epoch = 0;
+
+static __thread long trace_thread = 0;
+
+/** Returns the monotonic clock in nanoseconds. */
+static inline uint64_t trace_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Starts tracing into a ring of at least \p capacity records, discarding any
+ * earlier records. Must not be called while traced requests are in flight.
+ * @param capacity The number of most recent records to keep
+ * @return True on success, false if the ring could not be allocated
+ */
+bool trace_start(size_t capacity)
+{
+    size_t slots = 1;
+    while (slots < capacity) {
+        slots *= 2;
+    }
+
+    trace_slot_t *ring = calloc(slots, sizeof *ring);
+    if (ring == NULL) {
+        Engine.error("Failed to allocate trace ring of %zu records.\n", slots);
+        return false;
+    }
+
+    __atomic_store_n(&trace_enabled, false, __ATOMIC_SEQ_CST);
+    free(trace_ring);
+    trace_ring = ring;
+    trace_mask = slots - 1;
+    trace_head = 0;
+    trace_epoch = trace_clock();
+    __atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Stops tracing. Records already taken are kept and can still be dumped.
+ */
+void trace_stop()
+{
+    __atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the start time of a request to be passed to trace_end(), or 0 if
+ * tracing is stopped.
+ */
+uint64_t trace_begin()
+{
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    /* Never 0, even in the first nanosecond after tracing started */
+    return trace_clock() - trace_epoch + 1;
+}
+
+/**
+ * Records a request that started at \p begin and has just completed. If the
+ * ring has wrapped around onto a slot that another thread is still writing,
+ * the record is dropped rather than waiting for it.
+ * @param begin The value returned by trace_begin() for this request
+ * @param kind The kind of request
+ * @param path The path of the requested asset
+ * @param source Where the asset came from, such as an archive; may be NULL
+ * @param bytes The number of bytes returned
+ * @param hit True if the request was served without reading or decoding
+ */
+void trace_end(uint64_t begin, trace_kind_t kind, const char *path,
+        const char *source, size_t bytes, bool hit)
+{
+    if (begin == 0) {
+        return;
+    }
+
+    uint64_t end = trace_clock() - trace_epoch + 1;
+
+    if (trace_thread == 0) {
+        trace_thread = syscall(SYS_gettid);
+    }
+
+    uint64_t ticket = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_slot_t *slot = &trace_ring[ticket & trace_mask];
+
+    /*
+     * Claim the slot. If another writer holds it, or a later record has been
+     * written there since the ring wrapped, this record is dropped instead.
+     */
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    do {
+        if (seq % 2 != 0 || seq >= 2 * ticket + 2) {
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&slot->seq, &seq, 2 * ticket + 1,
+                true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    trace_words_t words;
+    memset(&words, 0, sizeof words);
+    trace_record_t *record = &words.record;
+    record->start = begin - 1;
+    record->end = end - 1;
+    record->thread = trace_thread;
+    record->bytes = bytes;
+    record->kind = kind;
+    record->hit = hit;
+    snprintf(record->path, sizeof record->path, "%s",
+            path != NULL ? path : "");
+    snprintf(record->source, sizeof record->source, "%s",
+            source != NULL ? source : "");
+
+    /*
+     * Each word is released, so a reader that sees any of them also sees the
+     * claim above and knows its copy is torn.
+     */
+    for (size_t i = 0; i < TRACE_RECORD_WORDS; i++) {
+        __atomic_store_n(&slot->words[i], words.words[i], __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&slot->seq, 2 * ticket + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the record with \p ticket out of the ring into \p dest.
+ * @return False if the record has been overwritten, dropped or is still being
+ * written
+ */
+bool trace_read(uint64_t ticket, trace_record_t *dest)
+{
+    const trace_slot_t *slot = &trace_ring[ticket & trace_mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != 2 * ticket + 2) {
+        return false;
+    }
+
+    /* Acquiring each word keeps the second check of seq after all of them */
+    trace_words_t words;
+    for (size_t i = 0; i < TRACE_RECORD_WORDS; i++) {
+        words.words[i] = __atomic_load_n(&slot->words[i], __ATOMIC_ACQUIRE);
+    }
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != 2 * ticket + 2) {
+        return false;
+    }
+
+    *dest = words.record;
+    return true;
+}
+
+/**
+ * Writes \p str to \p fp, quoted if it contains a character that would break
+ * a CSV field.
+ */
+void trace_write_csv_field(FILE *fp, const char *str)
+{
+    if (strpbrk(str, ",\"\r\n") == NULL) {
+        fputs(str, fp);
+        return;
+    }
+
+    fputc('"', fp);
+    for (; *str != '\0'; str++) {
+        if (*str == '"') {
+            fputc('"', fp);
+        }
+        fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+/** Writes \p str to \p fp as a JSON string. */
+void trace_write_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/**
+ * Calls \p write for every record still in the ring, oldest first.
+ * @return The number of records written
+ */
+size_t trace_for_each(FILE *fp,
+        void (*write)(FILE *fp, const trace_record_t *record, size_t n))
+{
+    if (trace_ring == NULL) {
+        return 0;
+    }
+
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > trace_mask + 1 ? head - (trace_mask + 1) : 0;
+
+    size_t n = 0;
+    for (uint64_t ticket = first; ticket < head; ticket++) {
+        trace_record_t record;
+        if (trace_read(ticket, &record)) {
+            write(fp, &record, n++);
+        }
+    }
+
+    return n;
+}
+
+void trace_write_csv_record(FILE *fp, const trace_record_t *record, size_t n)
+{
+    (void)n;
+    trace_write_csv_field(fp, record->path);
+    fputc(',', fp);
+    trace_write_csv_field(fp, record->source);
+    fprintf(fp, ",%s,%zu,%d,%.3f,%.3f,%ld\n", trace_kind_names[record->kind],
+            record->bytes, record->hit, record->start / 1000.0,
+            (record->end - record->start) / 1000.0, record->thread);
+}
+
+/**
+ * Writes the records in the ring to \p path as CSV, one request per line in
+ * the order the requests completed. The path comes first so the file can be
+ * passed to pakrepack as a manifest. Times are in microseconds.
+ * @return True on success, false if the file could not be written
+ */
+bool trace_dump_csv(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        Engine.error("Couldn't open '%s' for writing.\n", path);
+        return false;
+    }
+
+    fputs("path,source,kind,bytes,hit,start_us,duration_us,thread\n", fp);
+    trace_for_each(fp, trace_write_csv_record);
+
+    if (fclose(fp) != 0) {
+        Engine.error("Failed to finish writing '%s'.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+void trace_write_chrome_record(FILE *fp, const trace_record_t *record,
+        size_t n)
+{
+    fputs(n == 0 ? "\n" : ",\n", fp);
+    fputs("{\"name\":", fp);
+    trace_write_json_string(fp, record->path);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%ld,\"tid\":%ld,\"args\":{\"source\":",
+            trace_kind_names[record->kind], record->start / 1000.0,
+            (record->end - record->start) / 1000.0, (long)getpid(),
+            record->thread);
+    trace_write_json_string(fp, record->source);
+    fprintf(fp, ",\"bytes\":%zu,\"hit\":%s}}", record->bytes,
+            record->hit ? "true" : "false");
+}
+
+/**
+ * Writes the records in the ring to \p path in the Chrome trace event format,
+ * with each request as a complete event on the thread that made it.
+ * @return True on success, false if the file could not be written
+ */
+bool trace_dump_chrome(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        Engine.error("Couldn't open '%s' for writing.\n", path);
+        return false;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+    trace_for_each(fp, trace_write_chrome_record);
+    fputs("\n]}\n", fp);
+
+    if (fclose(fp) != 0) {
+        Engine.error("Failed to finish writing '%s'.\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+const struct trace_namespace Trace = {
+    .start = trace_start,
+    .stop = trace_stop,
+    .begin = trace_begin,
+    .end = trace_end,
+    .dumpCSV = trace_dump_csv,
+    .dumpChrome = trace_dump_chrome
+};
@@ -0,0 +1,43 @@
+/*
+ * Copyright © 2016 Cormac O'Brien
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** The kinds of asset request that are traced. */
+typedef enum {
+    TRACE_PAK_LOAD,
+    TRACE_DISK_LOAD,
+    TRACE_BSP_LOAD,
+    TRACE_MODEL_LOAD,
+    TRACE_KIND_COUNT
+} trace_kind_t;
+
+extern const struct trace_namespace {
+    bool (* const start)(size_t capacity);
+    void (* const stop)();
+    uint64_t (* const begin)();
+    void (* const end)(uint64_t begin, trace_kind_t kind, const char *path,
+            const char *source, size_t bytes, bool hit);
+    bool (* const dumpCSV)(const char *path);
+    bool (* const dumpChrome)(const char *path);
+} Trace;
+
+#endif
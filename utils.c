@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "engine.h"
 #include "utils.h"
@@ -113,6 +114,161 @@ int utils_dump(const char *path, const void *data, size_t size)
     return 0;
 }
 
+/**
+ * Computes the 32-bit FNV-1a hash of the null-terminated string \p str,
+ * considering at most \p max_len characters. Two strings that compare equal
+ * under strncmp() with the same length limit always hash equally.
+ * @param str The string to be hashed
+ * @param max_len The maximum number of characters of \p str to consider
+ * @return The hash of \p str
+ */
+uint32_t utils_hash_string(const char *str, size_t max_len)
+{
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < max_len && str[i] != '\0'; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static const uint64_t UTILS_PRIME64_1 = 0x9e3779b185ebca87ull;
+static const uint64_t UTILS_PRIME64_2 = 0xc2b2ae3d27d4eb4full;
+static const uint64_t UTILS_PRIME64_3 = 0x165667b19e3779f9ull;
+static const uint64_t UTILS_PRIME64_4 = 0x85ebca77c2b2ae63ull;
+static const uint64_t UTILS_PRIME64_5 = 0x27d4eb2f165667c5ull;
+
+static inline uint64_t utils_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t utils_read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static inline uint32_t utils_read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static inline uint64_t utils_xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * UTILS_PRIME64_2;
+    acc = utils_rotl64(acc, 31);
+    return acc * UTILS_PRIME64_1;
+}
+
+static inline uint64_t utils_xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= utils_xxh64_round(0, val);
+    return acc * UTILS_PRIME64_1 + UTILS_PRIME64_4;
+}
+
+/**
+ * Computes the 64-bit hash of \p size bytes at \p data. This is XXH64 with a
+ * seed of zero: fast, but not cryptographic. Its output is stable across
+ * runs and platforms of the same endianness, so it is suitable as a
+ * persistent key for data derived from file contents.
+ * @param data The data to be hashed
+ * @param size The size in bytes of \p data
+ * @return The hash of \p data
+ */
+uint64_t utils_hash_data(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    const uint8_t * const end = p + size;
+    uint64_t hash;
+
+    if (size >= 32) {
+        uint64_t v1 = UTILS_PRIME64_1 + UTILS_PRIME64_2;
+        uint64_t v2 = UTILS_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -UTILS_PRIME64_1;
+
+        const uint8_t * const limit = end - 32;
+        do {
+            v1 = utils_xxh64_round(v1, utils_read64(p));
+            v2 = utils_xxh64_round(v2, utils_read64(p + 8));
+            v3 = utils_xxh64_round(v3, utils_read64(p + 16));
+            v4 = utils_xxh64_round(v4, utils_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        hash = utils_rotl64(v1, 1) + utils_rotl64(v2, 7) +
+                utils_rotl64(v3, 12) + utils_rotl64(v4, 18);
+        hash = utils_xxh64_merge(hash, v1);
+        hash = utils_xxh64_merge(hash, v2);
+        hash = utils_xxh64_merge(hash, v3);
+        hash = utils_xxh64_merge(hash, v4);
+    } else {
+        hash = UTILS_PRIME64_5;
+    }
+
+    hash += size;
+
+    for (; p + 8 <= end; p += 8) {
+        hash ^= utils_xxh64_round(0, utils_read64(p));
+        hash = utils_rotl64(hash, 27) * UTILS_PRIME64_1 + UTILS_PRIME64_4;
+    }
+
+    if (p + 4 <= end) {
+        hash ^= (uint64_t)utils_read32(p) * UTILS_PRIME64_1;
+        hash = utils_rotl64(hash, 23) * UTILS_PRIME64_2 + UTILS_PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        hash ^= *p * UTILS_PRIME64_5;
+        hash = utils_rotl64(hash, 11) * UTILS_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= UTILS_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= UTILS_PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+/**
+ * Converts an array of palette indices into RGBA values in \p rgba, which
+ * must have room for 4 * \p index_count bytes.
+ * @param indices An array of palette indices to be converted
+ * @param index_count The number of elements in \p indices
+ * @param rgba The buffer to receive the RGBA values
+ */
+void utils_indexed_to_rgba_buffer(const uint8_t *indices, size_t index_count,
+        uint8_t *rgba)
+{
+    /*
+     * Building the whole palette in RGBA first turns each pixel into a
+     * single 4-byte copy.
+     */
+    uint8_t table[256][4];
+    for (size_t i = 0; i < 256; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            table[i][j] = palette[3 * i + j];
+        }
+
+        /*
+         * 0xff represents full transparency in the Quake palette
+         */
+        table[i][3] = i == 0xff ? 0x00 : 0xff;
+    }
+
+    for (size_t i = 0; i < index_count; i++) {
+        memcpy(&rgba[4 * i], table[indices[i]], 4);
+    }
+}
+
 /**
  * Converts an array of palette indices into an array of RGBA values.
  * @param indices An array of palette indices to be converted
@@ -129,25 +285,14 @@ uint8_t *utils_indexed_to_rgba(const uint8_t *indices, size_t index_count)
         Engine.fatal("Couldn't allocate RGBA buffer.\n");
     }
 
-    for (size_t i = 0; i < index_count; i++) {
-        for (size_t j = 0; j < 3; j++) {
-            rgba[4 * i + j] = palette[3 * indices[i] + j];
-        }
-
-        /*
-         * 0xff represents full transparency in the Quake palette
-         */
-        if (indices[i] == 0xff) {
-            rgba[4 * i + 3] = 0x00;
-        } else {
-            rgba[4 * i + 3] = 0xff;
-        }
-    }
-
+    utils_indexed_to_rgba_buffer(indices, index_count, rgba);
     return rgba;
 }
 
 const struct utils_namespace Utils = {
     .dump = utils_dump,
-    .indexedToRGBA = utils_indexed_to_rgba
+    .hashString = utils_hash_string,
+    .hashData = utils_hash_data,
+    .indexedToRGBA = utils_indexed_to_rgba,
+    .indexedToRGBABuffer = utils_indexed_to_rgba_buffer
 };
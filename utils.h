@@ -17,11 +17,16 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 extern const struct utils_namespace {
     int (* const dump)(const char *path, const void *data, size_t size);
+    uint32_t (* const hashString)(const char *str, size_t max_len);
+    uint64_t (* const hashData)(const void *data, size_t size);
     uint8_t *(* const indexedToRGBA)(const uint8_t *indices, size_t index_count);
+    void (* const indexedToRGBABuffer)(const uint8_t *indices,
+            size_t index_count, uint8_t *rgba);
 } Utils;
 
 #endif
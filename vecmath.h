@@ -87,7 +87,7 @@ static inline void vec##n##_max(vec##n##_t r, vec##n##_t a, vec##n##_t b) \
 }\
 static inline float vec##n##_dot(vec##n##_t const a, vec##n##_t const b) \
 { \
-    float result; \
+    float result = 0.0f; \
     for (int i = 0; i < n; i++) { \
         result += a[i] * b[i]; \
     } \